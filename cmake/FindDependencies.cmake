@@ -10,6 +10,13 @@ find_package(absl REQUIRED)
 find_package(Ceres REQUIRED COMPONENTS SuiteSparse)
 find_package(Boost REQUIRED)
 find_package(OpenMP REQUIRED COMPONENTS C CXX)
+find_package(SQLite3 REQUIRED)
+# Optional, used to partition large view graphs for rotation averaging
+find_package(METIS QUIET)
+if(METIS_FOUND)
+    message(STATUS "Enabling METIS graph partitioning")
+    add_definitions("-DGLOMAP_METIS_ENABLED")
+endif()
 
 if(CMAKE_CXX_COMPILER_ID STREQUAL "MSVC")
     find_package(Glog REQUIRED)
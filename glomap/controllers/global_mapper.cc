@@ -1,6 +1,7 @@
 #include "global_mapper.h"
 
 #include "glomap/controllers/rotation_averager.h"
+#include "glomap/controllers/run_report.h"
 #include "glomap/io/colmap_converter.h"
 #include "glomap/io/colmap_io.h"
 #include "glomap/processors/image_pair_inliers.h"
@@ -15,8 +16,37 @@
 #include <colmap/util/timer.h>
 
 namespace glomap {
+namespace {
+
+// Record the size of the problem on the innermost running stage
+void RecordProblemSize(const ViewGraph& view_graph,
+                       const std::unordered_map<image_t, Image>& images,
+                       const std::unordered_map<track_t, Track>& tracks) {
+  if (RunReport::Active() == nullptr) return;
+
+  int64_t num_valid_pairs = 0;
+  for (const auto& [pair_id, image_pair] : view_graph.image_pairs) {
+    if (image_pair.is_valid) num_valid_pairs++;
+  }
+  int64_t num_registered_images = 0;
+  for (const auto& [image_id, image] : images) {
+    if (image.IsRegistered()) num_registered_images++;
+  }
+  int64_t num_observations = 0;
+  for (const auto& [track_id, track] : tracks) {
+    num_observations += track.observations.size();
+  }
+
+  RecordCount("image_pairs", view_graph.image_pairs.size());
+  RecordCount("valid_image_pairs", num_valid_pairs);
+  RecordCount("images", images.size());
+  RecordCount("registered_images", num_registered_images);
+  RecordCount("tracks", tracks.size());
+  RecordCount("observations", num_observations);
+}
+
+}  // namespace
 
-// TODO: Rig normalizaiton has not be done
 bool GlobalMapper::Solve(const colmap::Database& database,
                          ViewGraph& view_graph,
                          std::unordered_map<rig_t, Rig>& rigs,
@@ -24,8 +54,55 @@ bool GlobalMapper::Solve(const colmap::Database& database,
                          std::unordered_map<frame_t, Frame>& frames,
                          std::unordered_map<image_t, Image>& images,
                          std::unordered_map<track_t, Track>& tracks) {
+  report_ = std::make_unique<RunReport>();
+  bool success = false;
+  {
+    RunReport::ActiveScope active_report(*report_);
+    {
+      ScopedStage stage("input");
+      RecordProblemSize(view_graph, images, tracks);
+    }
+    success = SolveStages(
+        database, view_graph, rigs, cameras, frames, images, tracks);
+    // The counts of the run are the final problem size
+    RecordProblemSize(view_graph, images, tracks);
+  }
+  report_->SetSuccess(success);
+
+  // Write the report next to the output, so that runs can be compared
+  if (!options_.output_path.empty()) {
+    colmap::CreateDirIfNotExists(options_.output_path);
+    const std::string report_path = options_.output_path + "/run_report.json";
+    if (report_->WriteJson(report_path)) {
+      LOG(INFO) << "Wrote the run report to " << report_path;
+    }
+  }
+  return success;
+}
+
+// TODO: Rig normalizaiton has not be done
+bool GlobalMapper::SolveStages(const colmap::Database& database,
+                               ViewGraph& view_graph,
+                               std::unordered_map<rig_t, Rig>& rigs,
+                               std::unordered_map<camera_t, Camera>& cameras,
+                               std::unordered_map<frame_t, Frame>& frames,
+                               std::unordered_map<image_t, Image>& images,
+                               std::unordered_map<track_t, Track>& tracks) {
+  // The stages up to track establishment work on the matches, which are not
+  // loaded when resuming from a later checkpoint
+  if (!view_graph.has_matches &&
+      !(options_.skip_preprocessing && options_.skip_view_graph_calibration &&
+        options_.skip_relative_pose_estimation &&
+        options_.skip_rotation_averaging &&
+        options_.skip_track_establishment)) {
+    LOG(ERROR) << "The view graph has no matches, only the stages after track "
+                  "establishment can run";
+    return false;
+  }
+
   // 0. Preprocessing
   if (!options_.skip_preprocessing) {
+    ScopedStage stage("preprocessing");
     std::cout << "-------------------------------------" << std::endl;
     std::cout << "Running preprocessing ..." << std::endl;
     std::cout << "-------------------------------------" << std::endl;
@@ -41,6 +118,7 @@ bool GlobalMapper::Solve(const colmap::Database& database,
 
   // 1. Run view graph calibration
   if (!options_.skip_view_graph_calibration) {
+    ScopedStage stage("view_graph_calibration");
     std::cout << "-------------------------------------" << std::endl;
     std::cout << "Running view graph calibration ..." << std::endl;
     std::cout << "-------------------------------------" << std::endl;
@@ -53,6 +131,7 @@ bool GlobalMapper::Solve(const colmap::Database& database,
   // 2. Run relative pose estimation
   //   TODO: Use generalized relative pose estimation for rigs.
   if (!options_.skip_relative_pose_estimation) {
+    ScopedStage stage("relative_pose");
     std::cout << "-------------------------------------" << std::endl;
     std::cout << "Running relative pose estimation ..." << std::endl;
     std::cout << "-------------------------------------" << std::endl;
@@ -60,28 +139,43 @@ bool GlobalMapper::Solve(const colmap::Database& database,
     colmap::Timer run_timer;
     run_timer.Start();
     // Relative pose relies on the undistorted images
-    UndistortImages(cameras, images, true);
-    EstimateRelativePoses(view_graph, cameras, images, options_.opt_relpose);
+    {
+      ScopedStage sub_stage("undistortion");
+      UndistortImages(cameras, images, true);
+    }
+    {
+      ScopedStage sub_stage("estimation");
+      EstimateRelativePoses(view_graph, cameras, images, options_.opt_relpose);
+    }
 
     InlierThresholdOptions inlier_thresholds = options_.inlier_thresholds;
     // Undistort the images and filter edges by inlier number
-    ImagePairsInlierCount(view_graph, cameras, images, inlier_thresholds, true);
+    {
+      ScopedStage sub_stage("inlier_counting");
+      ImagePairsInlierCount(
+          view_graph, cameras, images, inlier_thresholds, true);
+    }
 
-    RelPoseFilter::FilterInlierNum(view_graph,
-                                   options_.inlier_thresholds.min_inlier_num);
-    RelPoseFilter::FilterInlierRatio(
-        view_graph, options_.inlier_thresholds.min_inlier_ratio);
+    {
+      ScopedStage sub_stage("filtering");
+      RelPoseFilter::FilterInlierNum(
+          view_graph, options_.inlier_thresholds.min_inlier_num);
+      RelPoseFilter::FilterInlierRatio(
+          view_graph, options_.inlier_thresholds.min_inlier_ratio);
 
-    if (view_graph.KeepLargestConnectedComponents(frames, images) == 0) {
-      LOG(ERROR) << "no connected components are found";
-      return false;
+      if (view_graph.KeepLargestConnectedComponents(frames, images) == 0) {
+        LOG(ERROR) << "no connected components are found";
+        return false;
+      }
     }
 
+    RecordProblemSize(view_graph, images, tracks);
     run_timer.PrintSeconds();
   }
 
   // 3. Run rotation averaging for three times
   if (!options_.skip_rotation_averaging) {
+    ScopedStage stage("rotation_averaging");
     std::cout << "-------------------------------------" << std::endl;
     std::cout << "Running rotation averaging ..." << std::endl;
     std::cout << "-------------------------------------" << std::endl;
@@ -89,44 +183,75 @@ bool GlobalMapper::Solve(const colmap::Database& database,
     colmap::Timer run_timer;
     run_timer.Start();
 
+    // The second run starts from the solution of the first one
+    RotationEstimatorState ra_state;
+    RotationEstimatorState* ra_state_ptr =
+        options_.opt_ra.use_incremental_passes ? &ra_state : nullptr;
+
     // The first run is for filtering
-    SolveRotationAveraging(view_graph, rigs, frames, images, options_.opt_ra);
+    {
+      ScopedStage sub_stage("pass_1");
+      SolveRotationAveraging(
+          view_graph, rigs, frames, images, options_.opt_ra, ra_state_ptr);
+    }
 
-    RelPoseFilter::FilterRotations(
-        view_graph, images, options_.inlier_thresholds.max_rotation_error);
-    if (view_graph.KeepLargestConnectedComponents(frames, images) == 0) {
-      LOG(ERROR) << "no connected components are found";
-      return false;
+    {
+      ScopedStage sub_stage("filtering_1");
+      RelPoseFilter::FilterRotations(
+          view_graph, images, options_.inlier_thresholds.max_rotation_error);
+      if (view_graph.KeepLargestConnectedComponents(frames, images) == 0) {
+        LOG(ERROR) << "no connected components are found";
+        return false;
+      }
     }
 
     // The second run is for final estimation
-    if (!SolveRotationAveraging(
-            view_graph, rigs, frames, images, options_.opt_ra)) {
-      return false;
+    {
+      ScopedStage sub_stage("pass_2");
+      if (!SolveRotationAveraging(view_graph,
+                                  rigs,
+                                  frames,
+                                  images,
+                                  options_.opt_ra,
+                                  ra_state_ptr)) {
+        return false;
+      }
     }
-    RelPoseFilter::FilterRotations(
-        view_graph, images, options_.inlier_thresholds.max_rotation_error);
-    image_t num_img = view_graph.KeepLargestConnectedComponents(frames, images);
-    if (num_img == 0) {
-      LOG(ERROR) << "no connected components are found";
-      return false;
+    image_t num_img = 0;
+    {
+      ScopedStage sub_stage("filtering_2");
+      RelPoseFilter::FilterRotations(
+          view_graph, images, options_.inlier_thresholds.max_rotation_error);
+      num_img = view_graph.KeepLargestConnectedComponents(frames, images);
+      if (num_img == 0) {
+        LOG(ERROR) << "no connected components are found";
+        return false;
+      }
     }
     LOG(INFO) << num_img << " / " << images.size()
               << " images are within the connected component." << std::endl;
 
+    RecordProblemSize(view_graph, images, tracks);
     run_timer.PrintSeconds();
 
     // Checkpoint after Rotation Averaging
     if (!options_.output_path.empty()) {
+      ScopedStage sub_stage("checkpoint");
       LOG(INFO) << "Checkpointing after Rotation Averaging...";
       WriteGlomapReconstruction(options_.output_path + "/checkpoint_rotation",
                                 rigs, cameras, frames, images, tracks, "bin", "");
-      WriteExtraData(options_.output_path + "/checkpoint_rotation/view_graph.bin", view_graph, frames);
+      if (!WriteExtraData(
+              options_.output_path + "/checkpoint_rotation/view_graph.bin",
+              view_graph,
+              frames)) {
+        LOG(ERROR) << "Failed to write the checkpoint after Rotation Averaging";
+      }
     }
   }
 
   // 4. Track establishment and selection
   if (!options_.skip_track_establishment) {
+    ScopedStage stage("track_establishment");
     colmap::Timer run_timer;
     run_timer.Start();
 
@@ -135,26 +260,43 @@ bool GlobalMapper::Solve(const colmap::Database& database,
     std::cout << "-------------------------------------" << std::endl;
     TrackEngine track_engine(view_graph, images, options_.opt_track);
     std::unordered_map<track_t, Track> tracks_full;
-    track_engine.EstablishFullTracks(tracks_full);
+    {
+      ScopedStage sub_stage("establishment");
+      track_engine.EstablishFullTracks(tracks_full);
+      RecordCount("tracks", tracks_full.size());
+    }
 
     // Filter the tracks
-    track_t num_tracks = track_engine.FindTracksForProblem(tracks_full, tracks);
+    track_t num_tracks = 0;
+    {
+      ScopedStage sub_stage("selection");
+      num_tracks = track_engine.FindTracksForProblem(tracks_full, tracks);
+    }
     LOG(INFO) << "Before filtering: " << tracks_full.size()
               << ", after filtering: " << num_tracks << std::endl;
 
+    RecordProblemSize(view_graph, images, tracks);
     run_timer.PrintSeconds();
 
     // Checkpoint after Track Establishment
     if (!options_.output_path.empty()) {
+      ScopedStage sub_stage("checkpoint");
       LOG(INFO) << "Checkpointing after Track Establishment...";
       WriteGlomapReconstruction(options_.output_path + "/checkpoint_tracks",
                                 rigs, cameras, frames, images, tracks, "bin", "");
-      WriteExtraData(options_.output_path + "/checkpoint_tracks/view_graph.bin", view_graph, frames);
+      if (!WriteExtraData(
+              options_.output_path + "/checkpoint_tracks/view_graph.bin",
+              view_graph,
+              frames)) {
+        LOG(ERROR)
+            << "Failed to write the checkpoint after Track Establishment";
+      }
     }
   }
 
   // 5. Global positioning
   if (!options_.skip_global_positioning) {
+    ScopedStage stage("global_positioning");
     std::cout << "-------------------------------------" << std::endl;
     std::cout << "Running global positioning ..." << std::endl;
     std::cout << "-------------------------------------" << std::endl;
@@ -169,7 +311,10 @@ bool GlobalMapper::Solve(const colmap::Database& database,
     run_timer.Start();
     // Undistort images in case all previous steps are skipped
     // Skip images where an undistortion already been done
-    UndistortImages(cameras, images, false);
+    {
+      ScopedStage sub_stage("undistortion");
+      UndistortImages(cameras, images, false);
+    }
 
     GlobalPositioner gp_engine(options_.opt_gp);
 
@@ -177,44 +322,55 @@ bool GlobalMapper::Solve(const colmap::Database& database,
     if (!gp_engine.Solve(view_graph, rigs, cameras, frames, images, tracks)) {
       return false;
     }
-    // Filter tracks based on the estimation
-    TrackFilter::FilterTracksByAngle(
-        view_graph,
-        cameras,
-        images,
-        tracks,
-        options_.inlier_thresholds.max_angle_error);
+    {
+      ScopedStage sub_stage("filtering");
+      // Filter tracks based on the estimation
+      TrackFilter::FilterTracksByAngle(
+          view_graph,
+          cameras,
+          images,
+          tracks,
+          options_.inlier_thresholds.max_angle_error);
 
-    // Filter tracks based on triangulation angle and reprojection error
-    TrackFilter::FilterTrackTriangulationAngle(
-        view_graph,
-        images,
-        tracks,
-        options_.inlier_thresholds.min_triangulation_angle);
-    // Set the threshold to be larger to avoid removing too many tracks
-    TrackFilter::FilterTracksByReprojection(
-        view_graph,
-        cameras,
-        images,
-        tracks,
-        10 * options_.inlier_thresholds.max_reprojection_error);
-    // Normalize the structure
-    // If the camera rig is used, the structure do not need to be normalized
-    NormalizeReconstruction(rigs, cameras, frames, images, tracks);
+      // Filter tracks based on triangulation angle and reprojection error
+      TrackFilter::FilterTrackTriangulationAngle(
+          view_graph,
+          images,
+          tracks,
+          options_.inlier_thresholds.min_triangulation_angle);
+      // Set the threshold to be larger to avoid removing too many tracks
+      TrackFilter::FilterTracksByReprojection(
+          view_graph,
+          cameras,
+          images,
+          tracks,
+          10 * options_.inlier_thresholds.max_reprojection_error);
+      // Normalize the structure
+      // If the camera rig is used, the structure do not need to be normalized
+      NormalizeReconstruction(rigs, cameras, frames, images, tracks);
+    }
 
+    RecordProblemSize(view_graph, images, tracks);
     run_timer.PrintSeconds();
 
     // Checkpoint after Global Positioning
     if (!options_.output_path.empty()) {
+      ScopedStage sub_stage("checkpoint");
       LOG(INFO) << "Checkpointing after Global Positioning...";
       WriteGlomapReconstruction(options_.output_path + "/checkpoint_gp",
                                 rigs, cameras, frames, images, tracks, "bin", "");
-      WriteExtraData(options_.output_path + "/checkpoint_gp/view_graph.bin", view_graph, frames);
+      if (!WriteExtraData(
+              options_.output_path + "/checkpoint_gp/view_graph.bin",
+              view_graph,
+              frames)) {
+        LOG(ERROR) << "Failed to write the checkpoint after Global Positioning";
+      }
     }
   }
 
   // 6. Bundle adjustment
   if (!options_.skip_bundle_adjustment) {
+    ScopedStage stage("bundle_adjustment");
     std::cout << "-------------------------------------" << std::endl;
     std::cout << "Running bundle adjustment ..." << std::endl;
     std::cout << "-------------------------------------" << std::endl;
@@ -224,6 +380,7 @@ bool GlobalMapper::Solve(const colmap::Database& database,
     run_timer.Start();
 
     for (int ite = 0; ite < options_.num_iteration_bundle_adjustment; ite++) {
+      ScopedStage iteration_stage("iteration_" + std::to_string(ite + 1));
       BundleAdjuster ba_engine(options_.opt_ba);
 
       BundleAdjusterOptions& ba_engine_options_inner = ba_engine.GetOptions();
@@ -231,8 +388,11 @@ bool GlobalMapper::Solve(const colmap::Database& database,
       // Staged bundle adjustment
       // 6.1. First stage: optimize positions only
       ba_engine_options_inner.optimize_rotations = false;
-      if (!ba_engine.Solve(rigs, cameras, frames, images, tracks)) {
-        return false;
+      {
+        ScopedStage sub_stage("positions");
+        if (!ba_engine.Solve(rigs, cameras, frames, images, tracks)) {
+          return false;
+        }
       }
       LOG(INFO) << "Global bundle adjustment iteration " << ite + 1 << " / "
                 << options_.num_iteration_bundle_adjustment
@@ -242,9 +402,11 @@ bool GlobalMapper::Solve(const colmap::Database& database,
       // 6.2. Second stage: optimize rotations if desired
       ba_engine_options_inner.optimize_rotations =
           options_.opt_ba.optimize_rotations;
-      if (ba_engine_options_inner.optimize_rotations &&
-          !ba_engine.Solve(rigs, cameras, frames, images, tracks)) {
-        return false;
+      if (ba_engine_options_inner.optimize_rotations) {
+        ScopedStage sub_stage("rotations");
+        if (!ba_engine.Solve(rigs, cameras, frames, images, tracks)) {
+          return false;
+        }
       }
       LOG(INFO) << "Global bundle adjustment iteration " << ite + 1 << " / "
                 << options_.num_iteration_bundle_adjustment
@@ -259,6 +421,7 @@ bool GlobalMapper::Solve(const colmap::Database& database,
       // For the filtering, in each round, the criteria for outlier is
       // tightened. If only few tracks are changed, no need to start bundle
       // adjustment right away. Instead, use a more strict criteria to filter
+      ScopedStage filter_stage("filtering");
       UndistortImages(cameras, images, true);
       LOG(INFO) << "Filtering tracks by reprojection ...";
 
@@ -278,6 +441,7 @@ bool GlobalMapper::Solve(const colmap::Database& database,
         } else
           ite++;
       }
+      RecordCount("filtered_tracks", filtered_num);
       if (status) {
         LOG(INFO) << "fewer than 0.1% tracks are filtered, stop the iteration.";
         break;
@@ -285,33 +449,44 @@ bool GlobalMapper::Solve(const colmap::Database& database,
     }
 
     // Filter tracks based on the estimation
-    UndistortImages(cameras, images, true);
-    LOG(INFO) << "Filtering tracks by reprojection ...";
-    TrackFilter::FilterTracksByReprojection(
-        view_graph,
-        cameras,
-        images,
-        tracks,
-        options_.inlier_thresholds.max_reprojection_error);
-    TrackFilter::FilterTrackTriangulationAngle(
-        view_graph,
-        images,
-        tracks,
-        options_.inlier_thresholds.min_triangulation_angle);
+    {
+      ScopedStage sub_stage("filtering");
+      UndistortImages(cameras, images, true);
+      LOG(INFO) << "Filtering tracks by reprojection ...";
+      TrackFilter::FilterTracksByReprojection(
+          view_graph,
+          cameras,
+          images,
+          tracks,
+          options_.inlier_thresholds.max_reprojection_error);
+      TrackFilter::FilterTrackTriangulationAngle(
+          view_graph,
+          images,
+          tracks,
+          options_.inlier_thresholds.min_triangulation_angle);
+    }
 
+    RecordProblemSize(view_graph, images, tracks);
     run_timer.PrintSeconds();
 
     // Checkpoint after Bundle Adjustment
     if (!options_.output_path.empty()) {
+      ScopedStage sub_stage("checkpoint");
       LOG(INFO) << "Checkpointing after Bundle Adjustment...";
       WriteGlomapReconstruction(options_.output_path + "/checkpoint_ba",
                                 rigs, cameras, frames, images, tracks, "bin", "");
-      WriteExtraData(options_.output_path + "/checkpoint_ba/view_graph.bin", view_graph, frames);
+      if (!WriteExtraData(
+              options_.output_path + "/checkpoint_ba/view_graph.bin",
+              view_graph,
+              frames)) {
+        LOG(ERROR) << "Failed to write the checkpoint after Bundle Adjustment";
+      }
     }
   }
 
   // 7. Retriangulation
   if (!options_.skip_retriangulation) {
+    ScopedStage stage("retriangulation");
     std::cout << "-------------------------------------" << std::endl;
     std::cout << "Running retriangulation ..." << std::endl;
     std::cout << "-------------------------------------" << std::endl;
@@ -324,16 +499,20 @@ bool GlobalMapper::Solve(const colmap::Database& database,
     LOG(INFO) << "Retriangulation filtering to " << image_names.size() << " images";
     
     for (int ite = 0; ite < options_.num_iteration_retriangulation; ite++) {
+      ScopedStage iteration_stage("iteration_" + std::to_string(ite + 1));
       colmap::Timer run_timer;
       run_timer.Start();
-      RetriangulateTracks(options_.opt_triangulator,
-                          database,
-                          rigs,
-                          cameras,
-                          frames,
-                          images,
-                          tracks,
-                          image_names);
+      {
+        ScopedStage sub_stage("triangulation");
+        RetriangulateTracks(options_.opt_triangulator,
+                            database,
+                            rigs,
+                            cameras,
+                            frames,
+                            images,
+                            tracks,
+                            image_names);
+      }
       run_timer.PrintSeconds();
 
       std::cout << "-------------------------------------" << std::endl;
@@ -341,26 +520,36 @@ bool GlobalMapper::Solve(const colmap::Database& database,
       std::cout << "-------------------------------------" << std::endl;
       LOG(INFO) << "Bundle adjustment start" << std::endl;
       BundleAdjuster ba_engine(options_.opt_ba);
-      if (!ba_engine.Solve(rigs, cameras, frames, images, tracks)) {
-        return false;
+      {
+        ScopedStage sub_stage("bundle_adjustment_1");
+        if (!ba_engine.Solve(rigs, cameras, frames, images, tracks)) {
+          return false;
+        }
       }
 
       // Filter tracks based on the estimation
-      UndistortImages(cameras, images, true);
-      LOG(INFO) << "Filtering tracks by reprojection ...";
-      TrackFilter::FilterTracksByReprojection(
-          view_graph,
-          cameras,
-          images,
-          tracks,
-          options_.inlier_thresholds.max_reprojection_error);
-      if (!ba_engine.Solve(rigs, cameras, frames, images, tracks)) {
-        return false;
+      {
+        ScopedStage sub_stage("filtering");
+        UndistortImages(cameras, images, true);
+        LOG(INFO) << "Filtering tracks by reprojection ...";
+        TrackFilter::FilterTracksByReprojection(
+            view_graph,
+            cameras,
+            images,
+            tracks,
+            options_.inlier_thresholds.max_reprojection_error);
+      }
+      {
+        ScopedStage sub_stage("bundle_adjustment_2");
+        if (!ba_engine.Solve(rigs, cameras, frames, images, tracks)) {
+          return false;
+        }
       }
       run_timer.PrintSeconds();
     }
 
     // Normalize the structure
+    ScopedStage filter_stage("filtering");
     NormalizeReconstruction(rigs, cameras, frames, images, tracks);
 
     // Filter tracks based on the estimation
@@ -381,6 +570,7 @@ bool GlobalMapper::Solve(const colmap::Database& database,
 
   // 8. Reconstruction pruning
   if (!options_.skip_pruning) {
+    ScopedStage stage("pruning");
     std::cout << "-------------------------------------" << std::endl;
     std::cout << "Running postprocessing ..." << std::endl;
     std::cout << "-------------------------------------" << std::endl;
@@ -1,4 +1,6 @@
 #pragma once
+#include "glomap/controllers/rotation_averager.h"
+#include "glomap/controllers/run_report.h"
 #include "glomap/controllers/track_establishment.h"
 #include "glomap/controllers/track_retriangulation.h"
 #include "glomap/estimators/bundle_adjustment.h"
@@ -10,13 +12,15 @@
 
 #include <colmap/scene/database.h>
 
+#include <memory>
+
 namespace glomap {
 
 struct GlobalMapperOptions {
   // Options for each component
   ViewGraphCalibratorOptions opt_vgcalib;
   RelativePoseEstimationOptions opt_relpose;
-  RotationEstimatorOptions opt_ra;
+  RotationAveragerOptions opt_ra;
   TrackEstablishmentOptions opt_track;
   GlobalPositionerOptions opt_gp;
   BundleAdjusterOptions opt_ba;
@@ -40,7 +44,7 @@ struct GlobalMapperOptions {
   bool skip_retriangulation = false;
   bool skip_pruning = true;
 
-  // Output path for checkpoints
+  // Output path for checkpoints and for the run report (run_report.json)
   std::string output_path = "";
 };
 
@@ -57,8 +61,20 @@ class GlobalMapper {
              std::unordered_map<image_t, Image>& images,
              std::unordered_map<track_t, Track>& tracks);
 
+  // Timings, memory usage and problem sizes of the stages of the last Solve
+  const RunReport* Report() const { return report_.get(); }
+
  private:
+  bool SolveStages(const colmap::Database& database,
+                   ViewGraph& view_graph,
+                   std::unordered_map<rig_t, Rig>& rigs,
+                   std::unordered_map<camera_t, Camera>& cameras,
+                   std::unordered_map<frame_t, Frame>& frames,
+                   std::unordered_map<image_t, Image>& images,
+                   std::unordered_map<track_t, Track>& tracks);
+
   const GlobalMapperOptions options_;
+  std::unique_ptr<RunReport> report_;
 };
 
 }  // namespace glomap
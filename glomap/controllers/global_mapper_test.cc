@@ -5,6 +5,7 @@
 
 #include <colmap/estimators/alignment.h>
 #include <colmap/scene/synthetic.h>
+#include <colmap/util/file.h>
 #include <colmap/util/testing.h>
 
 #include <gtest/gtest.h>
@@ -87,6 +88,85 @@ TEST(GlobalMapper, WithoutNoise) {
                              /*num_obs_tolerance=*/0);
 }
 
+TEST(GlobalMapper, WithoutNoiseWithBATASolver) {
+  const std::string database_path = colmap::CreateTestDir() + "/database.db";
+
+  auto database = colmap::Database::Open(database_path);
+  colmap::Reconstruction gt_reconstruction;
+  colmap::SyntheticDatasetOptions synthetic_dataset_options;
+  synthetic_dataset_options.num_rigs = 2;
+  synthetic_dataset_options.num_cameras_per_rig = 1;
+  synthetic_dataset_options.num_frames_per_rig = 7;
+  synthetic_dataset_options.num_points3D = 50;
+  synthetic_dataset_options.point2D_stddev = 0;
+  colmap::SynthesizeDataset(
+      synthetic_dataset_options, &gt_reconstruction, database.get());
+
+  ViewGraph view_graph;
+  std::unordered_map<rig_t, Rig> rigs;
+  std::unordered_map<camera_t, Camera> cameras;
+  std::unordered_map<frame_t, Frame> frames;
+  std::unordered_map<image_t, Image> images;
+  std::unordered_map<track_t, Track> tracks;
+
+  ConvertDatabaseToGlomap(*database, view_graph, rigs, cameras, frames, images);
+
+  GlobalMapperOptions options = CreateTestOptions();
+  options.opt_gp.solver_type = GlobalPositionerOptions::BATA;
+  GlobalMapper global_mapper(options);
+  global_mapper.Solve(
+      *database, view_graph, rigs, cameras, frames, images, tracks);
+
+  colmap::Reconstruction reconstruction;
+  ConvertGlomapToColmap(rigs, cameras, frames, images, tracks, reconstruction);
+
+  ExpectEqualReconstructions(gt_reconstruction,
+                             reconstruction,
+                             /*max_rotation_error_deg=*/1e-2,
+                             /*max_proj_center_error=*/1e-4,
+                             /*num_obs_tolerance=*/0);
+}
+
+TEST(GlobalMapper, WithoutNoiseWithMultiStart) {
+  const std::string database_path = colmap::CreateTestDir() + "/database.db";
+
+  auto database = colmap::Database::Open(database_path);
+  colmap::Reconstruction gt_reconstruction;
+  colmap::SyntheticDatasetOptions synthetic_dataset_options;
+  synthetic_dataset_options.num_rigs = 2;
+  synthetic_dataset_options.num_cameras_per_rig = 1;
+  synthetic_dataset_options.num_frames_per_rig = 7;
+  synthetic_dataset_options.num_points3D = 50;
+  synthetic_dataset_options.point2D_stddev = 0;
+  colmap::SynthesizeDataset(
+      synthetic_dataset_options, &gt_reconstruction, database.get());
+
+  ViewGraph view_graph;
+  std::unordered_map<rig_t, Rig> rigs;
+  std::unordered_map<camera_t, Camera> cameras;
+  std::unordered_map<frame_t, Frame> frames;
+  std::unordered_map<image_t, Image> images;
+  std::unordered_map<track_t, Track> tracks;
+
+  ConvertDatabaseToGlomap(*database, view_graph, rigs, cameras, frames, images);
+
+  GlobalMapperOptions options = CreateTestOptions();
+  options.opt_gp.coarse_num_tracks = 25;
+  options.opt_gp.num_starts = 3;
+  GlobalMapper global_mapper(options);
+  global_mapper.Solve(
+      *database, view_graph, rigs, cameras, frames, images, tracks);
+
+  colmap::Reconstruction reconstruction;
+  ConvertGlomapToColmap(rigs, cameras, frames, images, tracks, reconstruction);
+
+  ExpectEqualReconstructions(gt_reconstruction,
+                             reconstruction,
+                             /*max_rotation_error_deg=*/1e-2,
+                             /*max_proj_center_error=*/1e-4,
+                             /*num_obs_tolerance=*/0);
+}
+
 TEST(GlobalMapper, WithoutNoiseWithNonTrivialKnownRig) {
   const std::string database_path = colmap::CreateTestDir() + "/database.db";
 
@@ -215,5 +295,110 @@ TEST(GlobalMapper, WithNoiseAndOutliers) {
                              /*num_obs_tolerance=*/0.02);
 }
 
+TEST(GlobalMapper, ConvertDatabaseByPath) {
+  const std::string database_path = colmap::CreateTestDir() + "/database.db";
+
+  auto database = colmap::Database::Open(database_path);
+  colmap::Reconstruction gt_reconstruction;
+  colmap::SyntheticDatasetOptions synthetic_dataset_options;
+  synthetic_dataset_options.num_rigs = 2;
+  synthetic_dataset_options.num_cameras_per_rig = 1;
+  synthetic_dataset_options.num_frames_per_rig = 7;
+  synthetic_dataset_options.num_points3D = 50;
+  synthetic_dataset_options.inlier_match_ratio = 0.7;
+  colmap::SynthesizeDataset(
+      synthetic_dataset_options, &gt_reconstruction, database.get());
+
+  // The pairs read at once from the database and streamed from its file
+  ViewGraph view_graph;
+  std::unordered_map<rig_t, Rig> rigs;
+  std::unordered_map<camera_t, Camera> cameras;
+  std::unordered_map<frame_t, Frame> frames;
+  std::unordered_map<image_t, Image> images;
+  ConvertDatabaseToGlomap(*database, view_graph, rigs, cameras, frames, images);
+
+  ViewGraph view_graph_streamed;
+  std::unordered_map<rig_t, Rig> rigs_streamed;
+  std::unordered_map<camera_t, Camera> cameras_streamed;
+  std::unordered_map<frame_t, Frame> frames_streamed;
+  std::unordered_map<image_t, Image> images_streamed;
+  ConvertDatabaseToGlomap(*database,
+                          view_graph_streamed,
+                          rigs_streamed,
+                          cameras_streamed,
+                          frames_streamed,
+                          images_streamed,
+                          /*image_list_path=*/"",
+                          database_path);
+
+  EXPECT_EQ(images_streamed.size(), images.size());
+  ASSERT_FALSE(view_graph.image_pairs.empty());
+  ASSERT_EQ(view_graph_streamed.image_pairs.size(),
+            view_graph.image_pairs.size());
+  for (const auto& [pair_id, image_pair] : view_graph.image_pairs) {
+    const auto it = view_graph_streamed.image_pairs.find(pair_id);
+    ASSERT_NE(it, view_graph_streamed.image_pairs.end());
+    const ImagePair& image_pair_streamed = it->second;
+    EXPECT_EQ(image_pair_streamed.is_valid, image_pair.is_valid);
+    EXPECT_EQ(image_pair_streamed.config, image_pair.config);
+    ASSERT_EQ(image_pair_streamed.matches.rows(), image_pair.matches.rows());
+    EXPECT_TRUE(image_pair_streamed.matches == image_pair.matches);
+    EXPECT_EQ(image_pair_streamed.inliers, image_pair.inliers);
+  }
+}
+
+TEST(GlobalMapper, WritesRunReport) {
+  const std::string test_dir = colmap::CreateTestDir();
+  const std::string database_path = test_dir + "/database.db";
+
+  auto database = colmap::Database::Open(database_path);
+  colmap::Reconstruction gt_reconstruction;
+  colmap::SyntheticDatasetOptions synthetic_dataset_options;
+  synthetic_dataset_options.num_rigs = 2;
+  synthetic_dataset_options.num_cameras_per_rig = 1;
+  synthetic_dataset_options.num_frames_per_rig = 7;
+  synthetic_dataset_options.num_points3D = 50;
+  synthetic_dataset_options.point2D_stddev = 0;
+  colmap::SynthesizeDataset(
+      synthetic_dataset_options, &gt_reconstruction, database.get());
+
+  ViewGraph view_graph;
+  std::unordered_map<rig_t, Rig> rigs;
+  std::unordered_map<camera_t, Camera> cameras;
+  std::unordered_map<frame_t, Frame> frames;
+  std::unordered_map<image_t, Image> images;
+  std::unordered_map<track_t, Track> tracks;
+
+  ConvertDatabaseToGlomap(*database, view_graph, rigs, cameras, frames, images);
+
+  GlobalMapperOptions options = CreateTestOptions();
+  options.output_path = test_dir + "/output";
+  GlobalMapper global_mapper(options);
+  EXPECT_TRUE(global_mapper.Solve(
+      *database, view_graph, rigs, cameras, frames, images, tracks));
+
+  ASSERT_NE(global_mapper.Report(), nullptr);
+  std::unordered_set<std::string> stage_names;
+  for (const auto& stage : global_mapper.Report()->Stages()) {
+    EXPECT_GE(stage.seconds, 0);
+    stage_names.insert(stage.name);
+  }
+  EXPECT_TRUE(stage_names.count("relative_pose/inlier_counting"));
+  EXPECT_TRUE(stage_names.count("rotation_averaging/pass_2"));
+  EXPECT_TRUE(stage_names.count("track_establishment/establishment"));
+  EXPECT_TRUE(stage_names.count("global_positioning/solve"));
+  EXPECT_TRUE(stage_names.count("bundle_adjustment/iteration_1/positions"));
+  EXPECT_TRUE(stage_names.count("input"));
+
+  // The final problem size is recorded for the run
+  std::unordered_map<std::string, int64_t> counts;
+  for (const auto& [name, value] : global_mapper.Report()->Counts()) {
+    counts[name] = value;
+  }
+  EXPECT_EQ(counts["images"], static_cast<int64_t>(images.size()));
+  EXPECT_EQ(counts["tracks"], static_cast<int64_t>(tracks.size()));
+  EXPECT_TRUE(colmap::ExistsFile(options.output_path + "/run_report.json"));
+}
+
 }  // namespace
 }  // namespace glomap
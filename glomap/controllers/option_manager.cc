@@ -157,6 +157,8 @@ void OptionManager::AddRelativePoseEstimationOptions() {
   AddAndRegisterDefaultOption(
       "RelPoseEstimation.max_iterations",
       &mapper->opt_relpose.ransac_options.max_iterations);
+  AddAndRegisterDefaultOption("RelPoseEstimation.cache_path",
+                              &mapper->opt_relpose.cache_path);
 }
 
 void OptionManager::AddRotationEstimatorOptions() {
@@ -164,7 +166,22 @@ void OptionManager::AddRotationEstimatorOptions() {
     return;
   }
   added_rotation_averaging_options_ = true;
-  // TODO: maybe add options for rotation averaging
+  // TODO: maybe add more options for rotation averaging
+  AddAndRegisterDefaultOption("RotationEstimation.use_incremental_passes",
+                              &mapper->opt_ra.use_incremental_passes);
+  AddAndRegisterDefaultOption(
+      "RotationEstimation.pcg_max_num_iterations",
+      &mapper->opt_ra.pcg_options.max_num_iterations);
+  AddAndRegisterDefaultOption("RotationEstimation.pcg_tolerance",
+                              &mapper->opt_ra.pcg_options.tolerance);
+  AddAndRegisterDefaultOption("RotationEstimation.use_partitioning",
+                              &mapper->opt_ra.use_partitioning);
+  AddAndRegisterDefaultOption(
+      "RotationEstimation.max_num_frames_per_cluster",
+      &mapper->opt_ra.partition_options.max_num_frames_per_cluster);
+  AddAndRegisterDefaultOption(
+      "RotationEstimation.max_num_overlap_frames",
+      &mapper->opt_ra.partition_options.max_num_overlap_frames);
 }
 
 void OptionManager::AddTrackEstablishmentOptions() {
@@ -205,6 +222,15 @@ void OptionManager::AddGlobalPositionerOptions() {
   AddAndRegisterDefaultOption(
       "GlobalPositioning.max_num_tracks",
       &mapper->opt_gp.max_num_tracks);
+  AddAndRegisterDefaultOption(
+      "GlobalPositioning.track_selection_grid_size",
+      &mapper->opt_gp.track_selection_grid_size);
+  AddAndRegisterDefaultOption(
+      "GlobalPositioning.coarse_num_tracks",
+      &mapper->opt_gp.coarse_num_tracks);
+  AddAndRegisterDefaultOption(
+      "GlobalPositioning.num_starts",
+      &mapper->opt_gp.num_starts);
   AddAndRegisterDefaultOption(
       "GlobalPositioning.force_non_iterative",
       &mapper->opt_gp.force_non_iterative);
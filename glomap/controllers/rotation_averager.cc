@@ -3,13 +3,189 @@
 #include "glomap/estimators/rotation_initializer.h"
 #include "glomap/io/colmap_converter.h"
 
+#include <colmap/geometry/pose.h>
+#include <colmap/util/threading.h>
+
 namespace glomap {
+namespace {
+
+// Solve the rotation averaging of the frames of one cluster on a copy of the
+// reconstruction restricted to the cluster. Returns the rig_from_world
+// rotations of the frames that could be estimated.
+std::unordered_map<frame_t, Eigen::Quaterniond> SolveCluster(
+    const ViewGraph& view_graph,
+    const std::unordered_map<rig_t, Rig>& rigs,
+    const std::unordered_map<frame_t, Frame>& frames,
+    const std::unordered_map<image_t, Image>& images,
+    const RotationEstimatorOptions& options,
+    const std::vector<frame_t>& frame_ids) {
+  std::unordered_map<rig_t, Rig> cluster_rigs = rigs;
+  std::unordered_map<frame_t, Frame> cluster_frames;
+  std::unordered_map<image_t, Image> cluster_images;
+  for (const frame_t frame_id : frame_ids) {
+    const Frame& frame = frames.at(frame_id);
+    Frame& cluster_frame =
+        cluster_frames.emplace(frame_id, frame).first->second;
+    cluster_frame.SetRigPtr(&cluster_rigs.at(frame.RigId()));
+    for (const auto& data_id : frame.ImageIds()) {
+      const auto image_it = images.find(data_id.id);
+      if (image_it == images.end()) continue;
+      const Image& image = image_it->second;
+      // The features are not needed
+      Image& cluster_image =
+          cluster_images
+              .emplace(data_id.id,
+                       Image(data_id.id, image.camera_id, image.file_name))
+              .first->second;
+      cluster_image.frame_id = frame_id;
+      cluster_image.frame_ptr = &cluster_frame;
+    }
+  }
+
+  ViewGraph cluster_view_graph;
+  for (const auto& [pair_id, image_pair] : view_graph.image_pairs) {
+    if (!image_pair.is_valid) continue;
+    if (cluster_images.find(image_pair.image_id1) == cluster_images.end() ||
+        cluster_images.find(image_pair.image_id2) == cluster_images.end()) {
+      continue;
+    }
+    ImagePair& cluster_pair =
+        cluster_view_graph.image_pairs
+            .emplace(pair_id,
+                     ImagePair(image_pair.image_id1,
+                               image_pair.image_id2,
+                               image_pair.cam2_from_cam1))
+            .first->second;
+    cluster_pair.weight = image_pair.weight;
+  }
+
+  std::unordered_map<frame_t, Eigen::Quaterniond> rotations;
+  if (cluster_view_graph.KeepLargestConnectedComponents(cluster_frames,
+                                                        cluster_images) == 0) {
+    return rotations;
+  }
+  RotationEstimator rotation_estimator(options);
+  // The inliers are not copied, the tree is weighted with those of the view
+  // graph, which is only read
+  rotation_estimator.SetTreeViewGraph(&view_graph);
+  if (!rotation_estimator.EstimateRotations(
+          cluster_view_graph, cluster_rigs, cluster_frames, cluster_images)) {
+    return rotations;
+  }
+  for (const auto& [frame_id, frame] : cluster_frames) {
+    if (!frame.is_registered) continue;
+    rotations.emplace(frame_id, frame.RigFromWorld().rotation);
+  }
+  return rotations;
+}
+
+// Solve the clusters in parallel, align them to each other through the frames
+// they share and refine all rotations together. The refinement fills the
+// state, so that the later passes start from it.
+bool SolvePartitioned(ViewGraph& view_graph,
+                      std::unordered_map<rig_t, Rig>& rigs,
+                      std::unordered_map<frame_t, Frame>& frames,
+                      std::unordered_map<image_t, Image>& images,
+                      const RotationAveragerOptions& options,
+                      const std::vector<std::vector<frame_t>>& clusters,
+                      RotationEstimatorState* state) {
+  // The threads are divided among the clusters that are solved at the same
+  // time, as every cluster runs its kernels in parallel as well
+  const int num_threads = colmap::GetEffectiveNumThreads(options.num_threads);
+  const int num_parallel_clusters =
+      std::min<int>(clusters.size(), num_threads);
+  RotationEstimatorOptions options_cluster = options;
+  options_cluster.num_threads =
+      std::max(1, num_threads / num_parallel_clusters);
+  options_cluster.pcg_options.num_threads = options_cluster.num_threads;
+  std::vector<std::unordered_map<frame_t, Eigen::Quaterniond>>
+      cluster_rotations(clusters.size());
+  colmap::ThreadPool thread_pool(num_parallel_clusters);
+  for (size_t cluster = 0; cluster < clusters.size(); cluster++) {
+    thread_pool.AddTask([&, cluster]() {
+      cluster_rotations[cluster] = SolveCluster(
+          view_graph, rigs, frames, images, options_cluster, clusters[cluster]);
+    });
+  }
+  thread_pool.Wait();
+
+  // Start from the largest cluster and repeatedly add the cluster that shares
+  // the most frames with the merged ones. The rotation that maps the world of
+  // the cluster to the merged world is averaged over the shared frames.
+  std::vector<bool> is_merged(clusters.size(), false);
+  size_t ref_cluster = 0;
+  for (size_t cluster = 1; cluster < clusters.size(); cluster++) {
+    if (cluster_rotations[cluster].size() >
+        cluster_rotations[ref_cluster].size()) {
+      ref_cluster = cluster;
+    }
+  }
+  std::unordered_map<frame_t, Eigen::Quaterniond> rotations =
+      cluster_rotations[ref_cluster];
+  is_merged[ref_cluster] = true;
+  while (true) {
+    int best_cluster = -1;
+    size_t best_num_shared = 0;
+    for (size_t cluster = 0; cluster < clusters.size(); cluster++) {
+      if (is_merged[cluster]) continue;
+      size_t num_shared = 0;
+      for (const auto& [frame_id, rotation] : cluster_rotations[cluster]) {
+        num_shared += rotations.count(frame_id);
+      }
+      if (num_shared > best_num_shared) {
+        best_cluster = cluster;
+        best_num_shared = num_shared;
+      }
+    }
+    if (best_cluster == -1) break;
+    is_merged[best_cluster] = true;
+
+    std::vector<Eigen::Quaterniond> world_alignments;
+    world_alignments.reserve(best_num_shared);
+    for (const auto& [frame_id, rotation] : cluster_rotations[best_cluster]) {
+      const auto it = rotations.find(frame_id);
+      if (it == rotations.end()) continue;
+      world_alignments.push_back(rotation.inverse() * it->second);
+    }
+    const Eigen::Quaterniond world_alignment = colmap::AverageQuaternions(
+        world_alignments, std::vector<double>(world_alignments.size(), 1));
+    for (const auto& [frame_id, rotation] : cluster_rotations[best_cluster]) {
+      rotations.emplace(frame_id, (rotation * world_alignment).normalized());
+    }
+  }
+
+  const int num_unmerged =
+      std::count(is_merged.begin(), is_merged.end(), false);
+  if (num_unmerged > 0) {
+    LOG(WARNING) << num_unmerged
+                 << " clusters share no frames with the others and are "
+                    "initialized from the previous rotations";
+  }
+
+  for (const auto& [frame_id, rotation] : rotations) {
+    frames.at(frame_id).SetRigFromWorld(
+        Rigid3d(rotation, Eigen::Vector3d::Zero()));
+  }
+
+  // Refine the merged rotations on the whole view graph
+  RotationEstimatorOptions options_refine = options;
+  options_refine.skip_initialization = true;
+  options_refine.max_num_l1_iterations = 0;
+  options_refine.max_num_irls_iterations =
+      options.max_num_refinement_irls_iterations;
+  RotationEstimator rotation_estimator(options_refine);
+  return rotation_estimator.EstimateRotations(
+      view_graph, rigs, frames, images, state);
+}
+
+}  // namespace
 
 bool SolveRotationAveraging(ViewGraph& view_graph,
                             std::unordered_map<rig_t, Rig>& rigs,
                             std::unordered_map<frame_t, Frame>& frames,
                             std::unordered_map<image_t, Image>& images,
-                            const RotationAveragerOptions& options) {
+                            const RotationAveragerOptions& options,
+                            RotationEstimatorState* state) {
   view_graph.KeepLargestConnectedComponents(frames, images);
 
   bool solve_1dof_system = options.use_gravity && options.use_stratified;
@@ -189,9 +365,23 @@ bool SolveRotationAveraging(ViewGraph& view_graph,
       options_ra.skip_initialization = false;
     }
 
-    RotationEstimator rotation_estimator(options_ra);
-    status_ra =
-        rotation_estimator.EstimateRotations(view_graph, rigs, frames, images);
+    // A pass that starts from the state of the previous one needs no
+    // initialization, so it is not partitioned
+    std::vector<std::vector<frame_t>> clusters;
+    if (options.use_partitioning && unknown_cams_from_rig.empty() &&
+        (state == nullptr || !state->IsSet())) {
+      clusters = PartitionViewGraph(
+          view_graph, frames, images, options.partition_options);
+    }
+
+    if (clusters.size() > 1) {
+      status_ra = SolvePartitioned(
+          view_graph, rigs, frames, images, options_ra, clusters, state);
+    } else {
+      RotationEstimator rotation_estimator(options_ra);
+      status_ra = rotation_estimator.EstimateRotations(
+          view_graph, rigs, frames, images, state);
+    }
     view_graph.KeepLargestConnectedComponents(frames, images);
   }
   return status_ra;
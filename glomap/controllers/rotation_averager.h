@@ -1,6 +1,7 @@
 #pragma once
 
 #include "glomap/estimators/global_rotation_averaging.h"
+#include "glomap/processors/view_graph_partitioning.h"
 
 namespace glomap {
 
@@ -9,12 +10,26 @@ struct RotationAveragerOptions : public RotationEstimatorOptions {
   RotationAveragerOptions(const RotationEstimatorOptions& options)
       : RotationEstimatorOptions(options) {}
   bool use_stratified = true;
+
+  // Solve overlapping clusters of the view graph in parallel, align them
+  // through their shared frames and refine the result with a few iterations
+  // of IRLS on the whole view graph. Only used for the 3-DoF system with known
+  // cam_from_rig, and only if the view graph has more frames than a cluster.
+  // A pass that starts from the state of a previous pass is not partitioned.
+  bool use_partitioning = false;
+  ViewGraphPartitionOptions partition_options;
+  int max_num_refinement_irls_iterations = 10;
 };
 
+// If state is given, it carries the solution of one call over to the next
+// call on the same reconstruction (see RotationEstimatorState). It is only
+// used by the single 3-DoF system, the stratified, the partitioned and the rig
+// initialization paths solve from scratch.
 bool SolveRotationAveraging(ViewGraph& view_graph,
                             std::unordered_map<rig_t, Rig>& rigs,
                             std::unordered_map<frame_t, Frame>& frames,
                             std::unordered_map<image_t, Image>& images,
-                            const RotationAveragerOptions& options);
+                            const RotationAveragerOptions& options,
+                            RotationEstimatorState* state = nullptr);
 
 }  // namespace glomap
\ No newline at end of file
@@ -311,6 +311,110 @@ TEST(RotationEstimator, WithNoiseAndOutliers) {
   }
 }
 
+TEST(RotationEstimator, WithNoiseAndOutliersPcg) {
+  colmap::SetPRNGSeed(1);
+
+  const std::string database_path = colmap::CreateTestDir() + "/database.db";
+
+  auto database = colmap::Database::Open(database_path);
+  colmap::Reconstruction gt_reconstruction;
+  colmap::SyntheticDatasetOptions synthetic_dataset_options;
+  synthetic_dataset_options.num_rigs = 2;
+  synthetic_dataset_options.num_cameras_per_rig = 1;
+  synthetic_dataset_options.num_frames_per_rig = 7;
+  synthetic_dataset_options.num_points3D = 100;
+  synthetic_dataset_options.point2D_stddev = 1;
+  synthetic_dataset_options.inlier_match_ratio = 0.6;
+  colmap::SynthesizeDataset(
+      synthetic_dataset_options, &gt_reconstruction, database.get());
+
+  ViewGraph view_graph;
+  std::unordered_map<rig_t, Rig> rigs;
+  std::unordered_map<camera_t, Camera> cameras;
+  std::unordered_map<image_t, Image> images;
+  std::unordered_map<frame_t, Frame> frames;
+  std::unordered_map<track_t, Track> tracks;
+
+  ConvertDatabaseToGlomap(*database, view_graph, rigs, cameras, frames, images);
+
+  GlobalMapper global_mapper(CreateMapperTestOptions());
+  global_mapper.Solve(
+      *database, view_graph, rigs, cameras, frames, images, tracks);
+
+  RotationAveragerOptions options = CreateRATestOptions();
+  options.linear_solver_type = RotationEstimatorOptions::PCG;
+  SolveRotationAveraging(view_graph, rigs, frames, images, options);
+
+  colmap::Reconstruction reconstruction;
+  ConvertGlomapToColmap(rigs, cameras, frames, images, tracks, reconstruction);
+  ExpectEqualRotations(
+      gt_reconstruction, reconstruction, /*max_rotation_error_deg=*/3);
+}
+
+TEST(RotationEstimator, WithoutNoisePartitioned) {
+  colmap::SetPRNGSeed(1);
+
+  const std::string database_path = colmap::CreateTestDir() + "/database.db";
+
+  auto database = colmap::Database::Open(database_path);
+  colmap::Reconstruction gt_reconstruction;
+  colmap::SyntheticDatasetOptions synthetic_dataset_options;
+  synthetic_dataset_options.num_rigs = 2;
+  synthetic_dataset_options.num_cameras_per_rig = 1;
+  synthetic_dataset_options.num_frames_per_rig = 10;
+  synthetic_dataset_options.num_points3D = 100;
+  synthetic_dataset_options.point2D_stddev = 0;
+  colmap::SynthesizeDataset(
+      synthetic_dataset_options, &gt_reconstruction, database.get());
+
+  ViewGraph view_graph;
+  std::unordered_map<rig_t, Rig> rigs;
+  std::unordered_map<camera_t, Camera> cameras;
+  std::unordered_map<frame_t, Frame> frames;
+  std::unordered_map<image_t, Image> images;
+  std::unordered_map<track_t, Track> tracks;
+
+  ConvertDatabaseToGlomap(*database, view_graph, rigs, cameras, frames, images);
+
+  GlobalMapper global_mapper(CreateMapperTestOptions());
+  global_mapper.Solve(
+      *database, view_graph, rigs, cameras, frames, images, tracks);
+
+  SolveRotationAveraging(
+      view_graph, rigs, frames, images, CreateRATestOptions());
+  colmap::Reconstruction reconstruction;
+  ConvertGlomapToColmap(rigs, cameras, frames, images, tracks, reconstruction);
+
+  // Clusters of at most 8 + 4 of the 20 frames
+  RotationAveragerOptions options = CreateRATestOptions();
+  options.use_partitioning = true;
+  options.partition_options.max_num_frames_per_cluster = 8;
+  options.partition_options.max_num_overlap_frames = 4;
+  SolveRotationAveraging(view_graph, rigs, frames, images, options);
+  colmap::Reconstruction partitioned_reconstruction;
+  ConvertGlomapToColmap(
+      rigs, cameras, frames, images, tracks, partitioned_reconstruction);
+
+  ExpectEqualRotations(reconstruction,
+                       partitioned_reconstruction,
+                       /*max_rotation_error_deg=*/1e-2);
+  ExpectEqualRotations(gt_reconstruction,
+                       partitioned_reconstruction,
+                       /*max_rotation_error_deg=*/1e-2);
+
+  // The partitioned pass fills the state that the next pass starts from
+  RotationEstimatorState state;
+  SolveRotationAveraging(view_graph, rigs, frames, images, options, &state);
+  EXPECT_TRUE(state.IsSet());
+  SolveRotationAveraging(view_graph, rigs, frames, images, options, &state);
+  colmap::Reconstruction warm_started_reconstruction;
+  ConvertGlomapToColmap(
+      rigs, cameras, frames, images, tracks, warm_started_reconstruction);
+  ExpectEqualRotations(gt_reconstruction,
+                       warm_started_reconstruction,
+                       /*max_rotation_error_deg=*/1e-2);
+}
+
 TEST(RotationEstimator, WithNoiseAndOutliersWithNonTrivialKnownRigs) {
   colmap::SetPRNGSeed(1);
 
@@ -448,5 +552,57 @@ TEST(RotationEstimator, RefineGravityWithNontrivialRigs) {
                      /*max_gravity_error_deg=*/1e-2);
 }
 
+TEST(RotationEstimator, KeepLargestConnectedComponentsWithOtherFrames) {
+  // Images 1 and 3 share a frame of the rig, and every image has a trivial
+  // frame of its own, as in the stratified rotation averaging
+  auto CreateImages =
+      [](const std::vector<std::pair<image_t, frame_t>>& image_to_frame,
+         std::unordered_map<frame_t, Frame>& frames,
+         std::unordered_map<image_t, Image>& images) {
+        for (const auto& [image_id, frame_id] : image_to_frame) {
+          frames[frame_id];
+        }
+        for (const auto& [image_id, frame_id] : image_to_frame) {
+          Image& image =
+              images.emplace(image_id, Image(image_id, 1, "")).first->second;
+          image.frame_id = frame_id;
+          image.frame_ptr = &frames.at(frame_id);
+        }
+      };
+  std::unordered_map<frame_t, Frame> frames;
+  std::unordered_map<image_t, Image> images;
+  CreateImages({{1, 10}, {2, 20}, {3, 10}}, frames, images);
+  std::unordered_map<frame_t, Frame> frames_trivial;
+  std::unordered_map<image_t, Image> images_trivial;
+  CreateImages({{1, 1}, {2, 2}, {3, 3}}, frames_trivial, images_trivial);
+
+  ViewGraph view_graph;
+  for (const auto& [image_id1, image_id2] :
+       std::vector<std::pair<image_t, image_t>>{{1, 2}, {2, 3}}) {
+    ImagePair image_pair(image_id1, image_id2);
+    view_graph.image_pairs.emplace(image_pair.pair_id, image_pair);
+  }
+
+  auto ExpectAllRegistered =
+      [&](const std::unordered_map<image_t, Image>& images) {
+        for (const auto& [image_id, image] : images) {
+          EXPECT_TRUE(image.IsRegistered());
+        }
+        for (const auto& [pair_id, image_pair] : view_graph.image_pairs) {
+          EXPECT_TRUE(image_pair.is_valid);
+        }
+      };
+
+  // The connectivity must follow the frames of the images of every call
+  view_graph.KeepLargestConnectedComponents(frames, images);
+  ExpectAllRegistered(images);
+  view_graph.KeepLargestConnectedComponents(frames_trivial, images_trivial);
+  ExpectAllRegistered(images_trivial);
+  EXPECT_EQ(frames_trivial.size(), 3);
+  view_graph.KeepLargestConnectedComponents(frames, images);
+  ExpectAllRegistered(images);
+  EXPECT_EQ(frames.size(), 2);
+}
+
 }  // namespace
 }  // namespace glomap
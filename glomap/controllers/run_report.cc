@@ -0,0 +1,205 @@
+#include "glomap/controllers/run_report.h"
+
+#include <colmap/util/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+// windows.h has to be included first
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace glomap {
+namespace {
+
+std::atomic<RunReport*> active_report{nullptr};
+
+double SecondsSince(const std::chrono::steady_clock::time_point& start_time) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start_time)
+      .count();
+}
+
+std::string JsonString(const std::string& value) {
+  std::string escaped = "\"";
+  for (const char c : value) {
+    if (c == '"' || c == '\\') escaped += '\\';
+    if (static_cast<unsigned char>(c) < 0x20) continue;
+    escaped += c;
+  }
+  escaped += '"';
+  return escaped;
+}
+
+void WriteCounts(std::ostream& stream,
+                 const std::vector<std::pair<std::string, int64_t>>& counts) {
+  stream << "{";
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (i > 0) stream << ", ";
+    stream << JsonString(counts[i].first) << ": " << counts[i].second;
+  }
+  stream << "}";
+}
+
+void SetCountIn(std::vector<std::pair<std::string, int64_t>>& counts,
+                const std::string& name,
+                int64_t value) {
+  for (auto& [count_name, count_value] : counts) {
+    if (count_name == name) {
+      count_value = value;
+      return;
+    }
+  }
+  counts.emplace_back(name, value);
+}
+
+}  // namespace
+
+size_t CurrentResidentSetSize() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+    return counters.WorkingSetSize;
+  }
+  return 0;
+#elif defined(__linux__)
+  std::ifstream file("/proc/self/statm");
+  size_t num_pages_total = 0;
+  size_t num_pages_resident = 0;
+  if (!(file >> num_pages_total >> num_pages_resident)) return 0;
+  return num_pages_resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+  return 0;
+#endif
+}
+
+size_t PeakResidentSetSize() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+    return counters.PeakWorkingSetSize;
+  }
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return static_cast<size_t>(usage.ru_maxrss);
+#else
+  // Linux reports kilobytes
+  return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+RunReport::RunReport() : start_time_(std::chrono::steady_clock::now()) {}
+
+size_t RunReport::BeginStage(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stage stage;
+  stage.depth = running_stages_.size();
+  stage.name = running_stages_.empty()
+                   ? name
+                   : stages_[running_stages_.back().stage_idx].name + "/" +
+                         name;
+  stage.rss_begin = CurrentResidentSetSize();
+  stages_.push_back(std::move(stage));
+
+  running_stages_.push_back({stages_.size() - 1,
+                             std::chrono::steady_clock::now(),
+                             PeakResidentSetSize()});
+  return stages_.size() - 1;
+}
+
+void RunReport::EndStage(size_t stage_idx) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const size_t peak_rss = PeakResidentSetSize();
+  // Stages end in reverse order, unless a child stage was not ended
+  while (!running_stages_.empty()) {
+    const RunningStage running_stage = running_stages_.back();
+    running_stages_.pop_back();
+
+    Stage& stage = stages_[running_stage.stage_idx];
+    stage.seconds = SecondsSince(running_stage.start_time);
+    stage.rss_end = CurrentResidentSetSize();
+    stage.peak_rss_delta =
+        peak_rss - std::min(peak_rss, running_stage.peak_rss_begin);
+    if (running_stage.stage_idx == stage_idx) break;
+  }
+}
+
+void RunReport::SetCount(const std::string& name, int64_t value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_stages_.empty()) {
+    SetCountIn(counts_, name, value);
+  } else {
+    SetCountIn(stages_[running_stages_.back().stage_idx].counts, name, value);
+  }
+}
+
+bool RunReport::WriteJson(const std::string& path) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ofstream file(path);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open file for writing: " << path;
+    return false;
+  }
+
+  file << std::setprecision(6) << std::fixed;
+  file << "{\n";
+  file << "  \"success\": " << (success_ ? "true" : "false") << ",\n";
+  file << "  \"total_seconds\": " << SecondsSince(start_time_) << ",\n";
+  file << "  \"peak_rss_bytes\": " << PeakResidentSetSize() << ",\n";
+  file << "  \"counts\": ";
+  WriteCounts(file, counts_);
+  file << ",\n";
+  file << "  \"stages\": [";
+  for (size_t i = 0; i < stages_.size(); i++) {
+    const Stage& stage = stages_[i];
+    file << (i > 0 ? ",\n" : "\n");
+    file << "    {\"name\": " << JsonString(stage.name)
+         << ", \"depth\": " << stage.depth << ", \"seconds\": " << stage.seconds
+         << ", \"rss_begin_bytes\": " << stage.rss_begin
+         << ", \"rss_end_bytes\": " << stage.rss_end
+         << ", \"peak_rss_delta_bytes\": " << stage.peak_rss_delta
+         << ", \"counts\": ";
+    WriteCounts(file, stage.counts);
+    file << "}";
+  }
+  file << "\n  ]\n";
+  file << "}\n";
+  return file.good();
+}
+
+RunReport* RunReport::Active() { return active_report.load(); }
+
+RunReport::ActiveScope::ActiveScope(RunReport& report)
+    : previous_(active_report.exchange(&report)) {}
+
+RunReport::ActiveScope::~ActiveScope() { active_report.store(previous_); }
+
+ScopedStage::ScopedStage(const std::string& name)
+    : report_(RunReport::Active()) {
+  if (report_ != nullptr) stage_idx_ = report_->BeginStage(name);
+}
+
+ScopedStage::~ScopedStage() {
+  if (report_ != nullptr) report_->EndStage(stage_idx_);
+}
+
+void RecordCount(const std::string& name, int64_t value) {
+  RunReport* report = RunReport::Active();
+  if (report != nullptr) report->SetCount(name, value);
+}
+
+}  // namespace glomap
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace glomap {
+
+// Current and peak resident set size of the process in bytes, 0 if unknown
+size_t CurrentResidentSetSize();
+size_t PeakResidentSetSize();
+
+// Runtime, memory usage and problem sizes of the stages of a run. Stages
+// nest: a stage begun while another one is running becomes its child, and its
+// name is prefixed with the name of the parent ("rotation_averaging/pass_1").
+// The report is written as JSON, so that runs can be compared with each other.
+class RunReport {
+ public:
+  struct Stage {
+    std::string name;
+    int depth = 0;
+    double seconds = 0;
+    size_t rss_begin = 0;
+    size_t rss_end = 0;
+    // Growth of the peak resident set size during the stage
+    size_t peak_rss_delta = 0;
+    std::vector<std::pair<std::string, int64_t>> counts;
+  };
+
+  RunReport();
+
+  // Stages are stored in the order in which they begin
+  size_t BeginStage(const std::string& name);
+  void EndStage(size_t stage_idx);
+
+  // Set a count of the innermost running stage, or of the run if none runs
+  void SetCount(const std::string& name, int64_t value);
+
+  void SetSuccess(bool success) { success_ = success; }
+
+  const std::vector<Stage>& Stages() const { return stages_; }
+  const std::vector<std::pair<std::string, int64_t>>& Counts() const {
+    return counts_;
+  }
+
+  bool WriteJson(const std::string& path) const;
+
+  // The report that ScopedStage and RecordCount use. At most one report is
+  // active at a time, the stages are recorded from one thread.
+  static RunReport* Active();
+
+  // Make the report active for the lifetime of the object
+  class ActiveScope {
+   public:
+    explicit ActiveScope(RunReport& report);
+    ~ActiveScope();
+    ActiveScope(const ActiveScope&) = delete;
+    ActiveScope& operator=(const ActiveScope&) = delete;
+
+   private:
+    RunReport* previous_;
+  };
+
+ private:
+  struct RunningStage {
+    size_t stage_idx;
+    std::chrono::steady_clock::time_point start_time;
+    size_t peak_rss_begin;
+  };
+
+  mutable std::mutex mutex_;
+  std::chrono::steady_clock::time_point start_time_;
+  std::vector<Stage> stages_;
+  std::vector<RunningStage> running_stages_;
+  std::vector<std::pair<std::string, int64_t>> counts_;
+  bool success_ = false;
+};
+
+// Record a stage of the active report for the lifetime of the object. Does
+// nothing if no report is active.
+class ScopedStage {
+ public:
+  explicit ScopedStage(const std::string& name);
+  ~ScopedStage();
+  ScopedStage(const ScopedStage&) = delete;
+  ScopedStage& operator=(const ScopedStage&) = delete;
+
+ private:
+  RunReport* report_;
+  size_t stage_idx_ = 0;
+};
+
+// Set a count on the active report, if any
+void RecordCount(const std::string& name, int64_t value);
+
+}  // namespace glomap
@@ -1,11 +1,55 @@
 #include "track_establishment.h"
 
+#include "glomap/controllers/work_stealing.h"
+
+#include <atomic>
+#include <mutex>
+#include <numeric>
+
 namespace glomap {
+namespace {
+
+// Stable LSD radix sort of (key, value) pairs by their key
+void RadixSortByKey(std::vector<std::pair<uint32_t, uint32_t>>& items) {
+  constexpr int kNumBits = 16;
+  constexpr uint32_t kMask = (1 << kNumBits) - 1;
+  std::vector<std::pair<uint32_t, uint32_t>> buffer(items.size());
+  std::vector<size_t> offsets(kMask + 2);
+  for (int shift = 0; shift < 32; shift += kNumBits) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+    for (const auto& item : items) {
+      offsets[((item.first >> shift) & kMask) + 1]++;
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    for (const auto& item : items) {
+      buffer[offsets[(item.first >> shift) & kMask]++] = item;
+    }
+    items.swap(buffer);
+  }
+}
+
+}  // namespace
 
 size_t TrackEngine::EstablishFullTracks(
     std::unordered_map<track_t, Track>& tracks) {
   tracks.clear();
-  uf_.Clear();
+
+  // The inlier matches of the valid pairs are read in place from the view
+  // graph, without copying them
+  valid_pairs_.clear();
+  for (const auto& [pair_id, image_pair] : view_graph_.image_pairs) {
+    if (image_pair.is_valid) valid_pairs_.push_back(&image_pair);
+  }
+  // The passes over the pairs run with work stealing and start with the pairs
+  // with the most inliers, so that the small ones fill the tail
+  std::stable_sort(valid_pairs_.begin(),
+                   valid_pairs_.end(),
+                   [](const ImagePair* pair1, const ImagePair* pair2) {
+                     return pair1->inliers.size() > pair2->inliers.size();
+                   });
+
+  // Assign a contiguous index to every feature of an inlier match
+  InitializeFeatureIndex();
 
   // Blindly concatenate tracks if any matches occur
   BlindConcatenation();
@@ -13,141 +57,166 @@ size_t TrackEngine::EstablishFullTracks(
   // Iterate through the collected tracks and record the items for each track
   TrackCollection(tracks);
 
+  uf_.Clear();
+  feature_index_.Clear();
+  valid_pairs_.clear();
+
   return tracks.size();
 }
 
-void TrackEngine::BlindConcatenation() {
-  // Initialize the union find data structure by connecting all the
-  // correspondences
-  image_pair_t counter = 0;
-  for (auto pair : view_graph_.image_pairs) {
-    if ((counter + 1) % 1000 == 0 ||
-        counter == view_graph_.image_pairs.size() - 1) {
-      std::cout << "\r Initializing pairs " << counter + 1 << " / "
-                << view_graph_.image_pairs.size() << std::flush;
-    }
-    counter++;
-
-    const ImagePair& image_pair = pair.second;
-    if (!image_pair.is_valid) continue;
-
-    // Get the matches
-    const Eigen::MatrixXi& matches = image_pair.matches;
-
-    // Get the inlier mask
-    const std::vector<int>& inliers = image_pair.inliers;
+void TrackEngine::InitializeFeatureIndex() {
+  image_t max_image_id = 0;
+  for (const auto& [image_id, image] : images_) {
+    max_image_id = std::max(max_image_id, image_id);
+  }
 
-    for (size_t i = 0; i < inliers.size(); i++) {
-      size_t idx = inliers[i];
+  // Only the features of the inlier matches of valid pairs can be part of a
+  // track, and most features of the images are in none of them. The others
+  // only cost a bit each in the index and are left out of the union find.
+  feature_index_.Reset(max_image_id);
+  for (const ImagePair* image_pair : valid_pairs_) {
+    for (const image_t image_id : {image_pair->image_id1,
+                                   image_pair->image_id2}) {
+      feature_index_.SetNumFeatures(image_id,
+                                    images_.at(image_id).features.size());
+    }
+  }
+  feature_index_.AllocateMarks();
+  std::vector<int> pair_order(valid_pairs_.size());
+  std::iota(pair_order.begin(), pair_order.end(), 0);
+  RunWithWorkStealing(pair_order, [&](int pair_idx) {
+    const ImagePair& image_pair = *valid_pairs_[pair_idx];
+    for (const int idx : image_pair.inliers) {
+      feature_index_.Mark(image_pair.image_id1, image_pair.matches(idx, 0));
+      feature_index_.Mark(image_pair.image_id2, image_pair.matches(idx, 1));
+    }
+  });
+  feature_index_.Finalize();
+  VLOG(2) << "Indexed " << feature_index_.NumElements()
+          << " features of inlier matches";
 
-      // Get point indices
-      const uint32_t& point1_idx = matches(idx, 0);
-      const uint32_t& point2_idx = matches(idx, 1);
+  uf_.Reset(feature_index_.NumElements());
+}
 
-      image_pair_t point_global_id1 =
-          static_cast<image_pair_t>(image_pair.image_id1) << 32 |
-          static_cast<image_pair_t>(point1_idx);
-      image_pair_t point_global_id2 =
-          static_cast<image_pair_t>(image_pair.image_id2) << 32 |
-          static_cast<image_pair_t>(point2_idx);
+void TrackEngine::BlindConcatenation() {
+  // Link the features of the inlier matches of all the pairs in one run
+  // without barriers
+  const int64_t num_pairs = valid_pairs_.size();
+  std::vector<int> pair_order(num_pairs);
+  std::iota(pair_order.begin(), pair_order.end(), 0);
+
+  std::atomic<int64_t> num_done(0);
+  std::mutex progress_mutex;
+  RunWithWorkStealing(pair_order, [&](int pair_idx) {
+    const ImagePair& image_pair = *valid_pairs_[pair_idx];
+    for (const int idx : image_pair.inliers) {
+      uf_.Union(
+          feature_index_.Index(image_pair.image_id1,
+                               image_pair.matches(idx, 0)),
+          feature_index_.Index(image_pair.image_id2,
+                               image_pair.matches(idx, 1)));
+    }
 
-      // Link the first point to the second point. Take the smallest one as the
-      // root
-      if (point_global_id2 < point_global_id1) {
-        uf_.Union(point_global_id1, point_global_id2);
-      } else
-        uf_.Union(point_global_id2, point_global_id1);
+    // Report the progress in steps of 10%
+    const int64_t num_done_now = ++num_done;
+    if (num_done_now * 10 / num_pairs != (num_done_now - 1) * 10 / num_pairs) {
+      std::lock_guard<std::mutex> lock(progress_mutex);
+      std::cout << "\r Initializing pairs " << num_done_now << " / "
+                << num_pairs << std::flush;
     }
-  }
+  });
   std::cout << std::endl;
 }
 
 void TrackEngine::TrackCollection(std::unordered_map<track_t, Track>& tracks) {
-  std::unordered_map<uint64_t, std::unordered_set<uint64_t>> track_map;
-  std::unordered_map<uint64_t, int> track_counter;
-
-  // Create tracks from the connected components of the point correspondences
-  size_t counter = 0;
-  for (auto pair : view_graph_.image_pairs) {
-    if ((counter + 1) % 1000 == 0 ||
-        counter == view_graph_.image_pairs.size() - 1) {
-      std::cout << "\r Establishing pairs " << counter + 1 << " / "
-                << view_graph_.image_pairs.size() << std::flush;
-    }
-    counter++;
-
-    const ImagePair& image_pair = pair.second;
-    if (!image_pair.is_valid) continue;
-
-    // Get the matches
-    const Eigen::MatrixXi& matches = image_pair.matches;
-
-    // Get the inlier mask
-    const std::vector<int>& inliers = image_pair.inliers;
+  // Pair every feature that is not a root with the root of its set. The root
+  // is the smallest element of the set, and is added back to each track below
+  std::vector<std::pair<uint32_t, uint32_t>> root_feature_pairs;
+  const uint32_t num_features = feature_index_.NumElements();
+  for (uint32_t feature_idx = 0; feature_idx < num_features; feature_idx++) {
+    const uint32_t root = uf_.Find(feature_idx);
+    if (root != feature_idx) root_feature_pairs.emplace_back(root, feature_idx);
+  }
 
-    for (size_t i = 0; i < inliers.size(); i++) {
-      size_t idx = inliers[i];
+  // Group the features by track. As the sort is stable, the features of each
+  // track stay ordered by their index, hence grouped by image
+  RadixSortByKey(root_feature_pairs);
 
-      // Get point indices
-      const uint32_t& point1_idx = matches(idx, 0);
-      const uint32_t& point2_idx = matches(idx, 1);
+  // Collect the consistent tracks in a CSR layout
+  std::vector<track_t> track_ids;
+  std::vector<size_t> track_offsets = {0};
+  std::vector<Observation> observations;
+  observations.reserve(root_feature_pairs.size());
 
-      image_pair_t point_global_id1 =
-          static_cast<image_pair_t>(image_pair.image_id1) << 32 |
-          static_cast<image_pair_t>(point1_idx);
-      image_pair_t point_global_id2 =
-          static_cast<image_pair_t>(image_pair.image_id2) << 32 |
-          static_cast<image_pair_t>(point2_idx);
+  size_t counter = 0;
+  size_t discarded_counter = 0;
+  size_t run_start = 0;
+  while (run_start < root_feature_pairs.size()) {
+    const uint32_t root = root_feature_pairs[run_start].first;
+    size_t run_end = run_start;
+    observations.push_back(feature_index_.ImageFeature(root));
+    while (run_end < root_feature_pairs.size() &&
+           root_feature_pairs[run_end].first == root) {
+      observations.push_back(
+          feature_index_.ImageFeature(root_feature_pairs[run_end].second));
+      run_end++;
+    }
 
-      image_pair_t track_id = uf_.Find(point_global_id1);
+    if (IsTrackConsistent(observations.data() + track_offsets.back(),
+                          observations.data() + observations.size())) {
+      track_ids.push_back(root);
+      track_offsets.push_back(observations.size());
+    } else {
+      observations.resize(track_offsets.back());
+      discarded_counter++;
+    }
 
-      track_map[track_id].insert(point_global_id1);
-      track_map[track_id].insert(point_global_id2);
-      track_counter[track_id]++;
+    if ((counter + 1) % 1000 == 0 || run_end == root_feature_pairs.size()) {
+      std::cout << "\r Establishing tracks " << counter + 1 << ", features "
+                << run_end << " / " << root_feature_pairs.size() << std::flush;
     }
+    counter++;
+    run_start = run_end;
   }
   std::cout << std::endl;
+  root_feature_pairs = {};
+
+  tracks.reserve(track_ids.size());
+  for (size_t i = 0; i < track_ids.size(); i++) {
+    Track& track = tracks[track_ids[i]];
+    track.track_id = track_ids[i];
+    track.observations.assign(observations.begin() + track_offsets[i],
+                              observations.begin() + track_offsets[i + 1]);
+  }
 
-  counter = 0;
-  size_t discarded_counter = 0;
-  for (auto& [track_id, correspondence_set] : track_map) {
-    if ((counter + 1) % 1000 == 0 || counter == track_map.size() - 1) {
-      std::cout << "\r Establishing tracks " << counter + 1 << " / "
-                << track_map.size() << std::flush;
-    }
-    counter++;
+  LOG(INFO) << "Discarded " << discarded_counter
+            << " tracks due to inconsistency";
+}
 
-    std::unordered_map<image_t, std::vector<Eigen::Vector2d>> image_id_set;
-    for (auto point_global_id : correspondence_set) {
-      // image_id is the higher 32 bits and feature_id is the lower 32 bits
-      image_t image_id = point_global_id >> 32;
-      feature_t feature_id = point_global_id & 0xFFFFFFFF;
-      if (image_id_set.find(image_id) != image_id_set.end()) {
-        for (const auto& feature : image_id_set.at(image_id)) {
-          if ((feature - images_.at(image_id).features[feature_id]).norm() >
+bool TrackEngine::IsTrackConsistent(const Observation* begin,
+                                    const Observation* end) const {
+  // The observations of the same image are contiguous. Within each image, all
+  // the features need to be close to each other
+  for (const Observation* image_begin = begin; image_begin != end;) {
+    const image_t image_id = image_begin->first;
+    const Observation* image_end = image_begin + 1;
+    while (image_end != end && image_end->first == image_id) image_end++;
+
+    if (image_end - image_begin > 1) {
+      const std::vector<Eigen::Vector2d>& features =
+          images_.at(image_id).features;
+      for (const Observation* it1 = image_begin; it1 != image_end; it1++) {
+        for (const Observation* it2 = it1 + 1; it2 != image_end; it2++) {
+          if ((features[it1->second] - features[it2->second]).norm() >
               options_.thres_inconsistency) {
-            tracks[track_id].observations.clear();
-            break;
+            return false;
           }
         }
-        if (tracks[track_id].observations.size() == 0) {
-          discarded_counter++;
-          break;
-        }
-      } else
-        image_id_set.insert(
-            std::make_pair(image_id, std::vector<Eigen::Vector2d>()));
-
-      image_id_set[image_id].push_back(
-          images_.at(image_id).features[feature_id]);
-
-      tracks[track_id].observations.emplace_back(image_id, feature_id);
+      }
     }
+    image_begin = image_end;
   }
-
-  std::cout << std::endl;
-  LOG(INFO) << "Discarded " << discarded_counter
-            << " tracks due to inconsistency";
+  return true;
 }
 
 size_t TrackEngine::FindTracksForProblem(
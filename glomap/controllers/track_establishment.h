@@ -41,19 +41,35 @@ class TrackEngine {
       std::unordered_map<track_t, Track>& tracks_selected);
 
  private:
-  // Blindly concatenate tracks if any matches occur
+  // Index the features of the inlier matches of the valid pairs contiguously
+  void InitializeFeatureIndex();
+
+  // Blindly concatenate tracks if any matches occur. The image pairs are
+  // processed in parallel
   void BlindConcatenation();
 
-  // Iterate through the collected tracks and record the items for each track
+  // Group the features by the root of their set and record the consistent
+  // groups as tracks
   void TrackCollection(std::unordered_map<track_t, Track>& tracks);
 
+  // Check that the features of the track in the same image are within
+  // thres_inconsistency of each other. Observations need to be grouped by image
+  bool IsTrackConsistent(const Observation* begin,
+                         const Observation* end) const;
+
   const TrackEstablishmentOptions& options_;
 
   const ViewGraph& view_graph_;
   const std::unordered_map<image_t, Image>& images_;
 
-  // Internal structure used for concatenating tracks
-  UnionFind<image_pair_t> uf_;
+  // The valid pairs, collected when establishing the tracks. Their inlier
+  // matches are read in place.
+  std::vector<const ImagePair*> valid_pairs_;
+
+  // Internal structures used for concatenating tracks. Features are addressed
+  // by their dense index, see DenseFeatureIndex
+  DenseFeatureIndex<uint32_t> feature_index_;
+  ConcurrentUnionFind<uint32_t> uf_;
 };
 
 }  // namespace glomap
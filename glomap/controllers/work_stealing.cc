@@ -0,0 +1,128 @@
+#include "glomap/controllers/work_stealing.h"
+
+#include <colmap/util/threading.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <numeric>
+
+namespace glomap {
+namespace {
+
+// Queue of the tasks of one thread. The range [head, tail) of the remaining
+// tasks is packed into one atomic, so that the owner and the thieves can take
+// tasks from both ends with a compare-and-swap.
+struct TaskQueue {
+  std::vector<int> tasks;
+  std::atomic<uint64_t> range{0};
+
+  static uint64_t Pack(uint32_t head, uint32_t tail) {
+    return (static_cast<uint64_t>(head) << 32) | tail;
+  }
+
+  int NumRemaining() const {
+    const uint64_t packed = range.load(std::memory_order_relaxed);
+    const uint32_t head = packed >> 32;
+    const uint32_t tail = static_cast<uint32_t>(packed);
+    return head < tail ? tail - head : 0;
+  }
+
+  // Take the task from the front or the back, -1 if the queue is empty
+  int Pop(bool from_front) {
+    uint64_t packed = range.load(std::memory_order_relaxed);
+    while (true) {
+      const uint32_t head = packed >> 32;
+      const uint32_t tail = static_cast<uint32_t>(packed);
+      if (head >= tail) return -1;
+      const uint64_t new_packed =
+          from_front ? Pack(head + 1, tail) : Pack(head, tail - 1);
+      if (range.compare_exchange_weak(packed, new_packed)) {
+        return tasks[from_front ? head : tail - 1];
+      }
+    }
+  }
+};
+
+double SecondsSince(const std::chrono::steady_clock::time_point& start_time) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start_time)
+      .count();
+}
+
+}  // namespace
+
+double WorkStealingSummary::Utilization() const {
+  if (busy_seconds.empty() || wall_seconds <= 0) return 1;
+  return std::accumulate(busy_seconds.begin(), busy_seconds.end(), 0.) /
+         (busy_seconds.size() * wall_seconds);
+}
+
+WorkStealingSummary RunWithWorkStealing(const std::vector<int>& task_order,
+                                        const std::function<void(int)>& func,
+                                        int num_threads) {
+  const auto start_time = std::chrono::steady_clock::now();
+  num_threads = std::max(
+      1,
+      std::min<int>(colmap::GetEffectiveNumThreads(num_threads),
+                    task_order.size()));
+
+  std::vector<TaskQueue> queues(num_threads);
+  for (size_t i = 0; i < task_order.size(); i++) {
+    queues[i % num_threads].tasks.push_back(task_order[i]);
+  }
+  for (TaskQueue& queue : queues) {
+    queue.range.store(TaskQueue::Pack(0, queue.tasks.size()));
+  }
+
+  WorkStealingSummary summary;
+  summary.num_tasks.assign(num_threads, 0);
+  summary.num_stolen_tasks.assign(num_threads, 0);
+  summary.busy_seconds.assign(num_threads, 0);
+
+  auto worker = [&](int thread_idx) {
+    while (true) {
+      bool stolen = false;
+      int task = queues[thread_idx].Pop(/*from_front=*/true);
+      if (task == -1) {
+        // Steal from the thread with the most remaining tasks
+        int victim = -1;
+        int max_num_remaining = 0;
+        for (int other = 0; other < num_threads; other++) {
+          const int num_remaining = queues[other].NumRemaining();
+          if (num_remaining > max_num_remaining) {
+            max_num_remaining = num_remaining;
+            victim = other;
+          }
+        }
+        // No tasks are added, so the run is over once all queues are empty
+        if (victim == -1) break;
+        task = queues[victim].Pop(/*from_front=*/false);
+        if (task == -1) continue;
+        stolen = true;
+      }
+
+      const auto task_start_time = std::chrono::steady_clock::now();
+      func(task);
+      summary.busy_seconds[thread_idx] += SecondsSince(task_start_time);
+      summary.num_tasks[thread_idx]++;
+      if (stolen) summary.num_stolen_tasks[thread_idx]++;
+    }
+  };
+
+  if (num_threads == 1) {
+    worker(0);
+  } else {
+    colmap::ThreadPool thread_pool(num_threads);
+    for (int thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+      thread_pool.AddTask([&worker, thread_idx]() { worker(thread_idx); });
+    }
+    thread_pool.Wait();
+  }
+
+  summary.wall_seconds = SecondsSince(start_time);
+  return summary;
+}
+
+}  // namespace glomap
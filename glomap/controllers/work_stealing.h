@@ -0,0 +1,31 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+namespace glomap {
+
+// How the tasks of RunWithWorkStealing were spread over the threads
+struct WorkStealingSummary {
+  // Per thread: number of tasks run, how many of them were stolen from the
+  // queue of another thread, and the time spent running them
+  std::vector<int> num_tasks;
+  std::vector<int> num_stolen_tasks;
+  std::vector<double> busy_seconds;
+  double wall_seconds = 0;
+
+  // Fraction of the wall time the threads spent running tasks
+  double Utilization() const;
+};
+
+// Run func(task) for all the tasks in task_order on num_threads threads,
+// without barriers. The tasks are dealt round-robin to per-thread queues in
+// the given order, which should put the most expensive tasks first. A thread
+// takes the tasks from the front of its own queue, and once it is empty it
+// steals from the back of the fullest queue of the other threads, so the
+// cheap tasks fill the tail of the run.
+WorkStealingSummary RunWithWorkStealing(const std::vector<int>& task_order,
+                                        const std::function<void(int)>& func,
+                                        int num_threads = -1);
+
+}  // namespace glomap
@@ -0,0 +1,498 @@
+#include "glomap/estimators/bata_solver.h"
+
+#include <colmap/util/logging.h>
+
+#include <algorithm>
+#include <numeric>
+
+#include <Eigen/Cholesky>
+#include <Eigen/LU>
+
+namespace glomap {
+namespace {
+
+// The lower bound of the scales, as in GlobalPositioner
+constexpr double kMinScale = 1e-5;
+
+// The chunks of points and camera positions that are processed by one task
+constexpr int kNumPointsPerChunk = 1024;
+constexpr int kNumPositionsPerChunk = 16;
+
+// The trust region of Levenberg-Marquardt, with the defaults of Ceres
+constexpr double kInitialRadius = 1e4;
+constexpr double kMinRadius = 1e-32;
+constexpr double kMaxRadius = 1e16;
+constexpr double kMinRelativeDecrease = 1e-3;
+constexpr double kMinDiagonal = 1e-6;
+constexpr double kMaxDiagonal = 1e32;
+
+// The error t - s * diff with the optimal scale s for diff = X - c, and its
+// Jacobian with respect to diff if requested
+void ComputeReducedError(const Eigen::Vector3d& direction,
+                         double constant_scale,
+                         const Eigen::Vector3d& diff,
+                         Eigen::Vector3d& residual,
+                         Eigen::Matrix3d* jacobian) {
+  double scale = constant_scale;
+  if (scale == 0) {
+    const double sq_norm = diff.squaredNorm();
+    const double dot = direction.dot(diff);
+    // The optimal scale is above the lower bound, so the error is the part
+    // of the direction orthogonal to diff
+    if (dot > kMinScale * sq_norm) {
+      residual = direction - (dot / sq_norm) * diff;
+      if (jacobian != nullptr) {
+        *jacobian = (2 * dot / (sq_norm * sq_norm)) * diff * diff.transpose() -
+                    (diff * direction.transpose() +
+                     dot * Eigen::Matrix3d::Identity()) /
+                        sq_norm;
+      }
+      return;
+    }
+    scale = kMinScale;
+  }
+  residual = direction - scale * diff;
+  if (jacobian != nullptr) *jacobian = -scale * Eigen::Matrix3d::Identity();
+}
+
+// The block with the Levenberg-Marquardt damping of its diagonal
+Eigen::Matrix3d Damped(const Eigen::Matrix3d& block, double lambda) {
+  Eigen::Matrix3d damped = block;
+  damped.diagonal() +=
+      lambda * block.diagonal().cwiseMax(kMinDiagonal).cwiseMin(kMaxDiagonal);
+  return damped;
+}
+
+}  // namespace
+
+BATASolver::BATASolver(const BATASolverOptions& options) : options_(options) {
+  const int num_threads = colmap::GetEffectiveNumThreads(options_.num_threads);
+  if (num_threads > 1) {
+    thread_pool_ = std::make_unique<colmap::ThreadPool>(num_threads);
+  }
+}
+
+int BATASolver::AddPosition(double* position) {
+  position_ptrs_.push_back(position);
+  positions_.emplace_back(position[0], position[1], position[2]);
+  return positions_.size() - 1;
+}
+
+int BATASolver::AddPoint(double* point) {
+  point_ptrs_.push_back(point);
+  points_.emplace_back(point[0], point[1], point[2]);
+  return points_.size() - 1;
+}
+
+int BATASolver::AddConstraint(int position_idx,
+                              int point_idx,
+                              const Eigen::Vector3d& direction,
+                              double weight) {
+  THROW_CHECK_GE(position_idx, 0);
+  THROW_CHECK_LT(position_idx, static_cast<int>(positions_.size()));
+  THROW_CHECK_GE(point_idx, 0);
+  THROW_CHECK_LT(point_idx, static_cast<int>(points_.size()));
+  Constraint& constraint = constraints_.emplace_back();
+  constraint.position_idx = position_idx;
+  constraint.point_idx = point_idx;
+  constraint.direction = direction;
+  constraint.weight = weight;
+  return constraints_.size() - 1;
+}
+
+void BATASolver::SetScaleConstant(int constraint_idx, double scale) {
+  THROW_CHECK_GT(scale, 0);
+  constraints_.at(constraint_idx).constant_scale = scale;
+}
+
+template <typename Func>
+void BATASolver::ParallelFor(int num_items, int chunk_size, const Func& func) {
+  if (thread_pool_ == nullptr || num_items <= chunk_size) {
+    for (int begin = 0; begin < num_items; begin += chunk_size) {
+      func(begin, std::min(begin + chunk_size, num_items));
+    }
+    return;
+  }
+  for (int begin = 0; begin < num_items; begin += chunk_size) {
+    const int end = std::min(begin + chunk_size, num_items);
+    thread_pool_->AddTask([&func, begin, end]() { func(begin, end); });
+  }
+  thread_pool_->Wait();
+}
+
+void BATASolver::SetupStructure() {
+  const int num_positions = positions_.size();
+  const int num_points = points_.size();
+  const int num_constraints = constraints_.size();
+
+  // Counting sort of the constraints by point, stable so that the
+  // constraints of a point keep their order
+  point_offsets_.assign(num_points + 1, 0);
+  for (const Constraint& constraint : constraints_) {
+    point_offsets_[constraint.point_idx + 1]++;
+  }
+  std::partial_sum(
+      point_offsets_.begin(), point_offsets_.end(), point_offsets_.begin());
+  std::vector<Constraint> sorted_constraints(num_constraints);
+  std::vector<int> next(point_offsets_.begin(), point_offsets_.end() - 1);
+  for (const Constraint& constraint : constraints_) {
+    sorted_constraints[next[constraint.point_idx]++] = constraint;
+  }
+  constraints_ = std::move(sorted_constraints);
+
+  position_offsets_.assign(num_positions + 1, 0);
+  for (const Constraint& constraint : constraints_) {
+    position_offsets_[constraint.position_idx + 1]++;
+  }
+  std::partial_sum(position_offsets_.begin(),
+                   position_offsets_.end(),
+                   position_offsets_.begin());
+  position_constraints_.resize(num_constraints);
+  next.assign(position_offsets_.begin(), position_offsets_.end() - 1);
+  for (int k = 0; k < num_constraints; k++) {
+    position_constraints_[next[constraints_[k].position_idx]++] = k;
+  }
+
+  constraint_gradients_.resize(num_constraints);
+  constraint_blocks_.resize(num_constraints);
+  position_gradients_.resize(num_positions);
+  position_blocks_.resize(num_positions);
+  preconditioner_.resize(num_positions);
+  point_gradients_.resize(num_points);
+  point_blocks_.resize(num_points);
+  point_block_inverses_.resize(num_points);
+  point_scratch_.resize(num_points);
+  point_step_.resize(num_points);
+}
+
+double BATASolver::Evaluate(const std::vector<Eigen::Vector3d>& positions,
+                            const std::vector<Eigen::Vector3d>& points,
+                            bool compute_derivatives) {
+  const int num_points = points_.size();
+  const double thres = options_.thres_loss_function;
+  std::vector<double> chunk_costs(
+      (num_points + kNumPointsPerChunk - 1) / kNumPointsPerChunk, 0);
+  ParallelFor(num_points, kNumPointsPerChunk, [&](int begin, int end) {
+    double cost = 0;
+    Eigen::Vector3d residual;
+    Eigen::Matrix3d jacobian;
+    for (int point_idx = begin; point_idx < end; point_idx++) {
+      for (int k = point_offsets_[point_idx]; k < point_offsets_[point_idx + 1];
+           k++) {
+        const Constraint& constraint = constraints_[k];
+        const Eigen::Vector3d diff =
+            points[point_idx] - positions[constraint.position_idx];
+        ComputeReducedError(constraint.direction,
+                            constraint.constant_scale,
+                            diff,
+                            residual,
+                            compute_derivatives ? &jacobian : nullptr);
+
+        // The Huber loss of the squared norm and its derivative
+        const double sq_norm = residual.squaredNorm();
+        double rho = sq_norm;
+        double rho_derivative = 1;
+        if (sq_norm > thres * thres) {
+          const double norm = std::sqrt(sq_norm);
+          rho = 2 * thres * norm - thres * thres;
+          rho_derivative = thres / norm;
+        }
+        cost += constraint.weight * rho;
+
+        if (!compute_derivatives) continue;
+        const double weight = constraint.weight * rho_derivative;
+        constraint_gradients_[k].noalias() =
+            weight * jacobian.transpose() * residual;
+        constraint_blocks_[k].noalias() =
+            weight * jacobian.transpose() * jacobian;
+      }
+    }
+    chunk_costs[begin / kNumPointsPerChunk] = 0.5 * cost;
+  });
+  return std::accumulate(chunk_costs.begin(), chunk_costs.end(), 0.);
+}
+
+void BATASolver::AccumulateNormalEquations() {
+  ParallelFor(points_.size(), kNumPointsPerChunk, [&](int begin, int end) {
+    for (int point_idx = begin; point_idx < end; point_idx++) {
+      Eigen::Vector3d& gradient = point_gradients_[point_idx];
+      Eigen::Matrix3d& block = point_blocks_[point_idx];
+      gradient.setZero();
+      block.setZero();
+      for (int k = point_offsets_[point_idx]; k < point_offsets_[point_idx + 1];
+           k++) {
+        gradient += constraint_gradients_[k];
+        block += constraint_blocks_[k];
+      }
+    }
+  });
+  ParallelFor(
+      positions_.size(), kNumPositionsPerChunk, [&](int begin, int end) {
+        for (int position_idx = begin; position_idx < end; position_idx++) {
+          Eigen::Vector3d& gradient = position_gradients_[position_idx];
+          Eigen::Matrix3d& block = position_blocks_[position_idx];
+          gradient.setZero();
+          block.setZero();
+          for (int i = position_offsets_[position_idx];
+               i < position_offsets_[position_idx + 1];
+               i++) {
+            const int k = position_constraints_[i];
+            gradient -= constraint_gradients_[k];
+            block += constraint_blocks_[k];
+          }
+        }
+      });
+}
+
+void BATASolver::MultiplySchurComplement(const Eigen::VectorXd& x,
+                                         Eigen::VectorXd& y) {
+  // The points part of the solution for the right hand side (0, W^T * x)
+  ParallelFor(points_.size(), kNumPointsPerChunk, [&](int begin, int end) {
+    for (int point_idx = begin; point_idx < end; point_idx++) {
+      Eigen::Vector3d value = Eigen::Vector3d::Zero();
+      for (int k = point_offsets_[point_idx]; k < point_offsets_[point_idx + 1];
+           k++) {
+        value += constraint_blocks_[k] *
+                 x.segment<3>(3 * constraints_[k].position_idx);
+      }
+      point_scratch_[point_idx] = point_block_inverses_[point_idx] * value;
+    }
+  });
+
+  y.resize(x.size());
+  ParallelFor(
+      positions_.size(), kNumPositionsPerChunk, [&](int begin, int end) {
+        for (int position_idx = begin; position_idx < end; position_idx++) {
+          Eigen::Vector3d value =
+              Damped(position_blocks_[position_idx], lambda_) *
+              x.segment<3>(3 * position_idx);
+          for (int i = position_offsets_[position_idx];
+               i < position_offsets_[position_idx + 1];
+               i++) {
+            const int k = position_constraints_[i];
+            value -= constraint_blocks_[k] *
+                     point_scratch_[constraints_[k].point_idx];
+          }
+          y.segment<3>(3 * position_idx) = value;
+        }
+      });
+}
+
+int BATASolver::ComputeStep(double lambda) {
+  lambda_ = lambda;
+  const int num_positions = positions_.size();
+  const int num_points = points_.size();
+
+  // The camera and point blocks of the normal equations are
+  //   U = sum B_k, V = sum B_k, W = -B_k
+  // for the blocks B_k of the constraints. Invert the damped point blocks.
+  ParallelFor(num_points, kNumPointsPerChunk, [&](int begin, int end) {
+    for (int point_idx = begin; point_idx < end; point_idx++) {
+      point_block_inverses_[point_idx] =
+          Damped(point_blocks_[point_idx], lambda_).inverse();
+      point_scratch_[point_idx] =
+          point_block_inverses_[point_idx] * point_gradients_[point_idx];
+    }
+  });
+
+  // The right hand side of the reduced camera system and the inverses of its
+  // diagonal blocks, ignoring the points seen twice from the same camera
+  Eigen::VectorXd rhs(3 * num_positions);
+  ParallelFor(num_positions, kNumPositionsPerChunk, [&](int begin, int end) {
+    for (int position_idx = begin; position_idx < end; position_idx++) {
+      Eigen::Matrix3d block = Damped(position_blocks_[position_idx], lambda_);
+      Eigen::Vector3d value = -position_gradients_[position_idx];
+      for (int i = position_offsets_[position_idx];
+           i < position_offsets_[position_idx + 1];
+           i++) {
+        const int k = position_constraints_[i];
+        const int point_idx = constraints_[k].point_idx;
+        value -= constraint_blocks_[k] * point_scratch_[point_idx];
+        block -= constraint_blocks_[k] * point_block_inverses_[point_idx] *
+                 constraint_blocks_[k];
+      }
+      rhs.segment<3>(3 * position_idx) = value;
+
+      const Eigen::LLT<Eigen::Matrix3d> llt(block);
+      if (llt.info() == Eigen::Success) {
+        preconditioner_[position_idx] = llt.solve(Eigen::Matrix3d::Identity());
+      } else {
+        preconditioner_[position_idx] =
+            Damped(position_blocks_[position_idx], lambda_).inverse();
+      }
+    }
+  });
+
+  // Preconditioned conjugate gradients on the reduced camera system
+  int num_iterations = 0;
+  position_step_.setZero(3 * num_positions);
+  const double threshold = options_.linear_tolerance * rhs.norm();
+  Eigen::VectorXd r = rhs;
+  Eigen::VectorXd z(r.size()), p(r.size()), q(r.size());
+  auto apply_preconditioner = [&](const Eigen::VectorXd& x,
+                                  Eigen::VectorXd& y) {
+    for (int position_idx = 0; position_idx < num_positions; position_idx++) {
+      y.segment<3>(3 * position_idx) =
+          preconditioner_[position_idx] * x.segment<3>(3 * position_idx);
+    }
+  };
+  if (r.norm() > threshold) {
+    apply_preconditioner(r, z);
+    p = z;
+    double rz = r.dot(z);
+    while (num_iterations < options_.max_num_linear_iterations) {
+      num_iterations++;
+      MultiplySchurComplement(p, q);
+      const double pq = p.dot(q);
+      if (pq <= 0) break;
+      const double alpha = rz / pq;
+      position_step_.noalias() += alpha * p;
+      r.noalias() -= alpha * q;
+      if (r.norm() <= threshold) break;
+
+      apply_preconditioner(r, z);
+      const double rz_new = r.dot(z);
+      p = z + (rz_new / rz) * p;
+      rz = rz_new;
+    }
+  }
+
+  // Back substitute the steps of the points
+  ParallelFor(num_points, kNumPointsPerChunk, [&](int begin, int end) {
+    for (int point_idx = begin; point_idx < end; point_idx++) {
+      Eigen::Vector3d value = -point_gradients_[point_idx];
+      for (int k = point_offsets_[point_idx]; k < point_offsets_[point_idx + 1];
+           k++) {
+        value += constraint_blocks_[k] *
+                 position_step_.segment<3>(3 * constraints_[k].position_idx);
+      }
+      point_step_[point_idx] = point_block_inverses_[point_idx] * value;
+    }
+  });
+  return num_iterations;
+}
+
+BATASolverSummary BATASolver::Solve() {
+  BATASolverSummary summary;
+  SetupStructure();
+  const int num_positions = positions_.size();
+  const int num_points = points_.size();
+
+  double cost = Evaluate(positions_, points_, /*compute_derivatives=*/true);
+  summary.initial_cost = cost;
+  summary.final_cost = cost;
+  if (!std::isfinite(cost)) {
+    LOG(ERROR) << "The initial BATA cost is not finite";
+    return summary;
+  }
+  AccumulateNormalEquations();
+
+  std::vector<Eigen::Vector3d> trial_positions(num_positions);
+  std::vector<Eigen::Vector3d> trial_points(num_points);
+  const int num_chunks =
+      (num_points + kNumPointsPerChunk - 1) / kNumPointsPerChunk;
+  // Per chunk of points: g^T * step, step^T * H * step, |step|^2, |x|^2
+  std::vector<Eigen::Vector4d> chunk_sums(num_chunks);
+
+  double radius = kInitialRadius;
+  double decrease_factor = 2;
+  while (summary.num_iterations < options_.max_num_iterations) {
+    double max_gradient = 0;
+    for (const Eigen::Vector3d& gradient : position_gradients_) {
+      max_gradient = std::max(max_gradient, gradient.lpNorm<Eigen::Infinity>());
+    }
+    for (const Eigen::Vector3d& gradient : point_gradients_) {
+      max_gradient = std::max(max_gradient, gradient.lpNorm<Eigen::Infinity>());
+    }
+    if (max_gradient <= options_.gradient_tolerance) {
+      summary.converged = true;
+      break;
+    }
+
+    summary.num_iterations++;
+    summary.num_linear_iterations += ComputeStep(1 / radius);
+
+    // The trial parameters and the decrease of the cost predicted by the
+    // linearization, -g^T * step - step^T * H * step / 2
+    ParallelFor(num_points, kNumPointsPerChunk, [&](int begin, int end) {
+      Eigen::Vector4d sums = Eigen::Vector4d::Zero();
+      for (int point_idx = begin; point_idx < end; point_idx++) {
+        const Eigen::Vector3d& point_step = point_step_[point_idx];
+        trial_points[point_idx] = points_[point_idx] + point_step;
+        sums[0] += point_gradients_[point_idx].dot(point_step);
+        sums[2] += point_step.squaredNorm();
+        sums[3] += points_[point_idx].squaredNorm();
+        for (int k = point_offsets_[point_idx];
+             k < point_offsets_[point_idx + 1];
+             k++) {
+          const Eigen::Vector3d diff_step =
+              point_step -
+              position_step_.segment<3>(3 * constraints_[k].position_idx);
+          sums[1] += diff_step.dot(constraint_blocks_[k] * diff_step);
+        }
+      }
+      chunk_sums[begin / kNumPointsPerChunk] = sums;
+    });
+    Eigen::Vector4d sums = Eigen::Vector4d::Zero();
+    for (const Eigen::Vector4d& chunk_sum : chunk_sums) sums += chunk_sum;
+    for (int position_idx = 0; position_idx < num_positions; position_idx++) {
+      const Eigen::Vector3d position_step =
+          position_step_.segment<3>(3 * position_idx);
+      trial_positions[position_idx] = positions_[position_idx] + position_step;
+      sums[0] += position_gradients_[position_idx].dot(position_step);
+      sums[2] += position_step.squaredNorm();
+      sums[3] += positions_[position_idx].squaredNorm();
+    }
+
+    const double step_norm = std::sqrt(sums[2]);
+    if (step_norm <= options_.parameter_tolerance *
+                         (std::sqrt(sums[3]) + options_.parameter_tolerance)) {
+      summary.converged = true;
+      break;
+    }
+
+    const double model_cost_change = -sums[0] - 0.5 * sums[1];
+    const double trial_cost =
+        Evaluate(trial_positions, trial_points, /*compute_derivatives=*/false);
+    const double cost_change = cost - trial_cost;
+    const double relative_decrease = cost_change / model_cost_change;
+    VLOG(2) << "[BATA] iteration " << summary.num_iterations
+            << ": cost=" << cost << ", trial_cost=" << trial_cost
+            << ", radius=" << radius << ", step_norm=" << step_norm;
+
+    if (!std::isfinite(trial_cost) || model_cost_change <= 0 ||
+        relative_decrease <= kMinRelativeDecrease) {
+      radius /= decrease_factor;
+      decrease_factor *= 2;
+      if (radius < kMinRadius) break;
+      continue;
+    }
+
+    std::swap(positions_, trial_positions);
+    std::swap(points_, trial_points);
+    const double previous_cost = cost;
+    cost = Evaluate(positions_, points_, /*compute_derivatives=*/true);
+    AccumulateNormalEquations();
+    radius = std::min(
+        kMaxRadius,
+        radius / std::max(1. / 3.,
+                          1 - std::pow(2 * relative_decrease - 1, 3)));
+    decrease_factor = 2;
+    if (cost_change <= options_.function_tolerance * previous_cost) {
+      summary.converged = true;
+      break;
+    }
+  }
+  summary.final_cost = cost;
+
+  for (int position_idx = 0; position_idx < num_positions; position_idx++) {
+    std::copy_n(
+        positions_[position_idx].data(), 3, position_ptrs_[position_idx]);
+  }
+  for (int point_idx = 0; point_idx < num_points; point_idx++) {
+    std::copy_n(points_[point_idx].data(), 3, point_ptrs_[point_idx]);
+  }
+  return summary;
+}
+
+}  // namespace glomap
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <colmap/util/threading.h>
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace glomap {
+
+struct BATASolverOptions {
+  // The threshold of the Huber loss on the norm of the errors
+  double thres_loss_function = 1e-1;
+
+  // The Levenberg-Marquardt iterations and their termination criteria, with
+  // the same meaning as in ceres::Solver::Options
+  int max_num_iterations = 100;
+  double function_tolerance = 1e-5;
+  double gradient_tolerance = 1e-10;
+  double parameter_tolerance = 1e-8;
+
+  // The conjugate gradient iterations per step. They stop once the residual
+  // norm dropped by linear_tolerance relative to the right hand side.
+  int max_num_linear_iterations = 200;
+  double linear_tolerance = 1e-2;
+
+  // Number of threads, -1 for all cores
+  int num_threads = -1;
+};
+
+struct BATASolverSummary {
+  int num_iterations = 0;
+  int num_linear_iterations = 0;
+  double initial_cost = 0;
+  double final_cost = 0;
+  // Whether a tolerance was reached before the maximum number of iterations
+  bool converged = false;
+
+  bool IsSolutionUsable() const { return std::isfinite(final_cost); }
+};
+
+// Minimizes the point to camera errors of BATA
+//   sum_i w_i * rho(|t_i - s_i * (X_i - c_i)|^2) / 2
+// over the camera positions c, the points X and the scales s, where t_i is the
+// observed direction from the camera to the point and rho is a Huber loss.
+// For given c and X the optimal scale has the closed form
+//   s_i = max(1e-5, t_i^T (X_i - c_i) / |X_i - c_i|^2),
+// so the scales are eliminated and the reduced errors are minimized with
+// Levenberg-Marquardt and analytic Jacobians. The points are eliminated from
+// every step with the Schur complement, and the reduced camera system is
+// solved with block Jacobi preconditioned conjugate gradients that multiply
+// by the Schur complement without forming it.
+class BATASolver {
+ public:
+  explicit BATASolver(const BATASolverOptions& options);
+
+  // Add a camera position or a point and return its index. The values are
+  // read now and written back at the end of Solve.
+  int AddPosition(double* position);
+  int AddPoint(double* point);
+
+  // Add the error of the direction from the camera position to the point.
+  // Returns the index of the error.
+  int AddConstraint(int position_idx,
+                    int point_idx,
+                    const Eigen::Vector3d& direction,
+                    double weight = 1);
+
+  // Keep the scale of an error constant instead of eliminating it. At least
+  // one scale should be constant, to fix the scale of the reconstruction.
+  void SetScaleConstant(int constraint_idx, double scale);
+
+  size_t NumConstraints() const { return constraints_.size(); }
+
+  BATASolverSummary Solve();
+
+ private:
+  struct Constraint {
+    int position_idx;
+    int point_idx;
+    Eigen::Vector3d direction;
+    double weight;
+    // The scale if it is constant, 0 if it is eliminated
+    double constant_scale = 0;
+  };
+
+  // Sort the constraints by point and list them by camera position
+  void SetupStructure();
+
+  // Cost at the given parameters. With derivatives, also compute the
+  // gradient and the Gauss-Newton blocks of every constraint.
+  double Evaluate(const std::vector<Eigen::Vector3d>& positions,
+                  const std::vector<Eigen::Vector3d>& points,
+                  bool compute_derivatives);
+
+  // Sum the gradients and diagonal blocks of the normal equations from the
+  // blocks of the constraints
+  void AccumulateNormalEquations();
+
+  // Compute the Levenberg-Marquardt step for the damping factor lambda.
+  // Returns the number of conjugate gradient iterations.
+  int ComputeStep(double lambda);
+
+  // y = S * x for the Schur complement S of the damped normal equations
+  void MultiplySchurComplement(const Eigen::VectorXd& x, Eigen::VectorXd& y);
+
+  // Run func(begin, end) on the chunks of [0, num_items) of chunk_size items.
+  // The chunks do not depend on the number of threads, so that the sums over
+  // chunks do not either.
+  template <typename Func>
+  void ParallelFor(int num_items, int chunk_size, const Func& func);
+
+  const BATASolverOptions options_;
+  std::unique_ptr<colmap::ThreadPool> thread_pool_;
+
+  std::vector<double*> position_ptrs_;
+  std::vector<double*> point_ptrs_;
+  std::vector<Eigen::Vector3d> positions_;
+  std::vector<Eigen::Vector3d> points_;
+  std::vector<Constraint> constraints_;
+
+  // Once sorted, the constraints of the point p are the range
+  // [point_offsets_[p], point_offsets_[p + 1]) of constraints_, and those of
+  // the camera position c are listed in the range [position_offsets_[c],
+  // position_offsets_[c + 1]) of position_constraints_
+  std::vector<int> point_offsets_;
+  std::vector<int> position_offsets_;
+  std::vector<int> position_constraints_;
+
+  // w * rho' * J^T * r and w * rho' * J^T * J of the reduced error with
+  // respect to the point. The error depends on X - c, so with respect to the
+  // camera position the gradient is negated and the block is the same.
+  std::vector<Eigen::Vector3d> constraint_gradients_;
+  std::vector<Eigen::Matrix3d> constraint_blocks_;
+
+  std::vector<Eigen::Vector3d> position_gradients_;
+  std::vector<Eigen::Vector3d> point_gradients_;
+  std::vector<Eigen::Matrix3d> position_blocks_;
+  std::vector<Eigen::Matrix3d> point_blocks_;
+
+  // The state of the current step: the damping factor, the inverses of the
+  // damped point blocks, the preconditioner and the step itself
+  double lambda_ = 0;
+  std::vector<Eigen::Matrix3d> point_block_inverses_;
+  std::vector<Eigen::Matrix3d> preconditioner_;
+  std::vector<Eigen::Vector3d> point_scratch_;
+  Eigen::VectorXd position_step_;
+  std::vector<Eigen::Vector3d> point_step_;
+};
+
+}  // namespace glomap
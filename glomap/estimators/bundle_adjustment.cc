@@ -1,5 +1,7 @@
 #include "bundle_adjustment.h"
 
+#include "glomap/controllers/run_report.h"
+
 #include <atomic>
 #include <chrono>
 #include <ceres/ceres.h>
@@ -76,18 +78,24 @@ bool BundleAdjuster::Solve(std::unordered_map<rig_t, Rig>& rigs,
     return false;
   }
 
-  // Reset the problem
-  Reset();
+  {
+    ScopedStage stage("setup");
+
+    // Reset the problem
+    Reset();
 
-  // Add the constraints that the point tracks impose on the problem
-  AddPointToCameraConstraints(rigs, cameras, frames, images, tracks);
+    // Add the constraints that the point tracks impose on the problem
+    AddPointToCameraConstraints(rigs, cameras, frames, images, tracks);
 
-  // Add the cameras and points to the parameter groups for schur-based
-  // optimization
-  AddCamerasAndPointsToParameterGroups(rigs, cameras, frames, tracks);
+    // Add the cameras and points to the parameter groups for schur-based
+    // optimization
+    AddCamerasAndPointsToParameterGroups(rigs, cameras, frames, tracks);
 
-  // Parameterize the variables
-  ParameterizeVariables(rigs, cameras, frames, tracks);
+    // Parameterize the variables
+    ParameterizeVariables(rigs, cameras, frames, tracks);
+
+    RecordCount("residual_blocks", problem_->NumResidualBlocks());
+  }
 
   // Set the solver options.
   ceres::Solver::Summary summary;
@@ -191,7 +199,11 @@ bool BundleAdjuster::Solve(std::unordered_map<rig_t, Rig>& rigs,
     }
   });
 
-  ceres::Solve(solver_options, problem_.get(), &summary);
+  {
+    ScopedStage stage("solve");
+    ceres::Solve(solver_options, problem_.get(), &summary);
+    RecordCount("iterations", summary.iterations.size());
+  }
 
   ba_solving.store(false);
   if (ba_heartbeat.joinable()) {
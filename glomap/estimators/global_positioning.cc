@@ -1,14 +1,20 @@
 #include "glomap/estimators/global_positioning.h"
 
+#include "glomap/controllers/run_report.h"
+#include "glomap/estimators/bata_solver.h"
 #include "glomap/estimators/cost_function.h"
 #include "glomap/math/rigid3d.h"
 
 #include <atomic>
 #include <chrono>
+#include <limits>
+#include <numeric>
 #include <ceres/ceres.h>
 #include <thread>
 #include <colmap/util/cuda.h>
 #include <colmap/util/misc.h>
+#include <colmap/util/threading.h>
+#include <Eigen/Eigenvalues>
 
 namespace glomap {
 namespace {
@@ -69,6 +75,32 @@ class SolverProgressLogger : public ceres::IterationCallback {
   std::chrono::steady_clock::time_point last_log_time_;
 };
 
+// Pose data of a registered image that the point to camera constraints of
+// its observations share
+struct ImageConstraintData {
+  enum Type {
+    // The camera is the reference sensor of its rig
+    TRIVIAL_FRAME,
+    // The camera has a known pose in its rig
+    KNOWN_RIG,
+    // The pose of the camera in its rig is estimated as well
+    UNKNOWN_RIG,
+  };
+
+  const Image* image = nullptr;
+  Type type = TRIVIAL_FRAME;
+  Eigen::Matrix3d world_from_cam_rotation;
+  Eigen::Vector3d cam_from_world_translation;
+  double* frame_translation = nullptr;
+  ceres::LossFunction* loss_function = nullptr;
+  // KNOWN_RIG: the translation of the camera in its rig, rotated to the world
+  Eigen::Vector3d translation_rig;
+  double* rig_scale = nullptr;
+  // UNKNOWN_RIG
+  double* cam_from_rig_translation = nullptr;
+  Eigen::Quaterniond rig_from_world_rotation;
+};
+
 Eigen::Vector3d RandVector3d(std::mt19937& random_generator,
                              double low,
                              double high) {
@@ -78,6 +110,87 @@ Eigen::Vector3d RandVector3d(std::mt19937& random_generator,
                          distribution(random_generator));
 }
 
+// Initialize the points of the tracks, except for the given ones, as the
+// least squares intersection of their rays from the registered images. If
+// the rays are close to parallel, the point is put at unit distance along
+// them instead. Returns the number of initialized tracks.
+size_t TriangulateTracks(const std::unordered_map<image_t, Image>& images,
+                         const std::unordered_set<track_t>& skipped_tracks,
+                         std::unordered_map<track_t, Track>& tracks) {
+  size_t num_triangulated = 0;
+  for (auto& [track_id, track] : tracks) {
+    if (skipped_tracks.count(track_id)) continue;
+
+    Eigen::Matrix3d lhs = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d rhs = Eigen::Vector3d::Zero();
+    Eigen::Vector3d ray_points_sum = Eigen::Vector3d::Zero();
+    int num_rays = 0;
+    for (const auto& [image_id, feature_id] : track.observations) {
+      const auto image_it = images.find(image_id);
+      if (image_it == images.end() || !image_it->second.IsRegistered()) {
+        continue;
+      }
+      const Image& image = image_it->second;
+      const Eigen::Vector3d feature_undist = image.features_undist[feature_id];
+      if (feature_undist.array().isNaN().any()) continue;
+
+      const Eigen::Vector3d center = image.Center();
+      const Eigen::Vector3d ray =
+          (image.CamFromWorld().rotation.inverse() * feature_undist)
+              .normalized();
+      // Projection onto the plane orthogonal to the ray
+      const Eigen::Matrix3d projection =
+          Eigen::Matrix3d::Identity() - ray * ray.transpose();
+      lhs += projection;
+      rhs += projection * center;
+      ray_points_sum += center + ray;
+      num_rays++;
+    }
+    if (num_rays == 0) continue;
+
+    const Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver(lhs);
+    const Eigen::Vector3d& eigenvalues = eigen_solver.eigenvalues();
+    if (num_rays >= 2 && eigenvalues(0) > 1e-6 * eigenvalues(2)) {
+      track.xyz = lhs.ldlt().solve(rhs);
+    } else {
+      track.xyz = ray_points_sum / num_rays;
+    }
+    track.is_initialized = true;
+    num_triangulated++;
+  }
+  return num_triangulated;
+}
+
+// Median over the observations of the tracks of the angle in degrees between
+// the observed ray and the direction from the camera to the point
+double MedianAngularResidual(const std::unordered_map<image_t, Image>& images,
+                             const std::unordered_map<track_t, Track>& tracks) {
+  std::vector<double> angles;
+  for (const auto& [track_id, track] : tracks) {
+    if (!track.is_initialized) continue;
+    for (const auto& [image_id, feature_id] : track.observations) {
+      const auto image_it = images.find(image_id);
+      if (image_it == images.end() || !image_it->second.IsRegistered()) {
+        continue;
+      }
+      const Image& image = image_it->second;
+      const Eigen::Vector3d feature_undist = image.features_undist[feature_id];
+      if (feature_undist.array().isNaN().any()) continue;
+
+      const Eigen::Vector3d ray =
+          image.CamFromWorld().rotation.inverse() * feature_undist;
+      const Eigen::Vector3d direction = track.xyz - image.Center();
+      angles.push_back(
+          std::atan2(ray.cross(direction).norm(), ray.dot(direction)) * 180 /
+          EIGEN_PI);
+    }
+  }
+  if (angles.empty()) return std::numeric_limits<double>::infinity();
+  std::nth_element(
+      angles.begin(), angles.begin() + angles.size() / 2, angles.end());
+  return angles[angles.size() / 2];
+}
+
 }  // namespace
 
 GlobalPositioner::GlobalPositioner(const GlobalPositionerOptions& options)
@@ -115,24 +228,35 @@ bool GlobalPositioner::Solve(const ViewGraph& view_graph,
     return false;
   }
 
+  if (options_.coarse_num_tracks > 0 &&
+      tracks.size() > options_.coarse_num_tracks &&
+      options_.constraint_type != GlobalPositionerOptions::ONLY_CAMERAS) {
+    return SolveCoarseToFine(view_graph, rigs, cameras, frames, images, tracks);
+  }
+
   // Filter tracks
   filtered_tracks_.clear();
   if (options_.max_num_tracks > 0 && tracks.size() > options_.max_num_tracks) {
     LOG(INFO) << "Filtering tracks for Global Positioning: " << tracks.size()
               << " -> " << options_.max_num_tracks;
-    std::vector<std::pair<size_t, track_t>> track_lengths;
-    track_lengths.reserve(tracks.size());
-    for (const auto& [track_id, track] : tracks) {
-      track_lengths.emplace_back(track.observations.size(), track_id);
-    }
-    // Sort descending
-    std::partial_sort(track_lengths.begin(),
-                      track_lengths.begin() + options_.max_num_tracks,
-                      track_lengths.end(),
-                      std::greater<std::pair<size_t, track_t>>());
-    
-    for (int i = 0; i < options_.max_num_tracks; ++i) {
-      filtered_tracks_.insert(track_lengths[i].second);
+    if (options_.track_selection_type ==
+        GlobalPositionerOptions::SPATIALLY_BALANCED) {
+      SelectSpatiallyBalancedTracks(cameras, images, tracks);
+    } else {
+      std::vector<std::pair<size_t, track_t>> track_lengths;
+      track_lengths.reserve(tracks.size());
+      for (const auto& [track_id, track] : tracks) {
+        track_lengths.emplace_back(track.observations.size(), track_id);
+      }
+      // Sort descending
+      std::partial_sort(track_lengths.begin(),
+                        track_lengths.begin() + options_.max_num_tracks,
+                        track_lengths.end(),
+                        std::greater<std::pair<size_t, track_t>>());
+
+      for (int i = 0; i < options_.max_num_tracks; ++i) {
+        filtered_tracks_.insert(track_lengths[i].second);
+      }
     }
   } else {
     for (const auto& [track_id, track] : tracks) {
@@ -140,10 +264,20 @@ bool GlobalPositioner::Solve(const ViewGraph& view_graph,
     }
   }
 
+  use_bata_solver_ = false;
+  if (options_.solver_type == GlobalPositionerOptions::BATA) {
+    use_bata_solver_ = CanUseBATASolver(images);
+    if (!use_bata_solver_) {
+      LOG(WARNING) << "[GP] The problem is not supported by the BATA solver, "
+                      "falling back to Ceres";
+    }
+  }
+
   LOG(INFO) << "Setting up the global positioner problem";
 
   // Setup the problem.
   {
+    ScopedStage stage("setup_problem");
     const auto t0 = std::chrono::steady_clock::now();
     SetupProblem(view_graph, rigs, tracks);
     LogStepDuration("[GP] SetupProblem", t0);
@@ -152,15 +286,29 @@ bool GlobalPositioner::Solve(const ViewGraph& view_graph,
   // Initialize camera translations to be random.
   // Also, convert the camera pose translation to be the camera center.
   {
+    ScopedStage stage("initialize_random_positions");
     const auto t0 = std::chrono::steady_clock::now();
     InitializeRandomPositions(view_graph, frames, images, tracks);
     LogStepDuration("[GP] InitializeRandomPositions", t0);
   }
 
+  if (use_bata_solver_) {
+    bool success = false;
+    {
+      ScopedStage stage("solve");
+      const auto t0 = std::chrono::steady_clock::now();
+      success = SolveWithBATASolver(cameras, images, tracks);
+      LogStepDuration("[GP] SolveWithBATASolver", t0);
+    }
+    ConvertResults(rigs, frames);
+    return success;
+  }
+
   // Add the camera to camera constraints to the problem.
   // TODO: support the relative constraints with trivial frames to a non trivial
   // frame
   if (options_.constraint_type != GlobalPositionerOptions::ONLY_POINTS) {
+    ScopedStage stage("add_camera_to_camera_constraints");
     const auto t0 = std::chrono::steady_clock::now();
     AddCameraToCameraConstraints(view_graph, images);
     LogStepDuration("[GP] AddCameraToCameraConstraints", t0);
@@ -168,12 +316,14 @@ bool GlobalPositioner::Solve(const ViewGraph& view_graph,
 
   // Add the point to camera constraints to the problem.
   if (options_.constraint_type != GlobalPositionerOptions::ONLY_CAMERAS) {
+    ScopedStage stage("add_point_to_camera_constraints");
     const auto t0 = std::chrono::steady_clock::now();
     AddPointToCameraConstraints(rigs, cameras, frames, images, tracks);
     LogStepDuration("[GP] AddPointToCameraConstraints", t0);
   }
 
   {
+    ScopedStage stage("add_parameter_groups");
     const auto t0 = std::chrono::steady_clock::now();
     AddCamerasAndPointsToParameterGroups(rigs, frames, tracks);
     LogStepDuration("[GP] AddCamerasAndPointsToParameterGroups", t0);
@@ -182,6 +332,7 @@ bool GlobalPositioner::Solve(const ViewGraph& view_graph,
   // Parameterize the variables, set image poses / tracks / scales to be
   // constant if desired
   {
+    ScopedStage stage("parameterize_variables");
     const auto t0 = std::chrono::steady_clock::now();
     ParameterizeVariables(rigs, frames, tracks);
     LogStepDuration("[GP] ParameterizeVariables", t0);
@@ -191,6 +342,8 @@ bool GlobalPositioner::Solve(const ViewGraph& view_graph,
     LOG(INFO) << "[GP] Problem stats: parameters=" << problem_->NumParameters()
               << ", parameter_blocks=" << problem_->NumParameterBlocks()
               << ", residual_blocks=" << problem_->NumResidualBlocks();
+    RecordCount("parameter_blocks", problem_->NumParameterBlocks());
+    RecordCount("residual_blocks", problem_->NumResidualBlocks());
   }
 
   LOG(INFO) << "Solving the global positioner problem";
@@ -224,7 +377,11 @@ bool GlobalPositioner::Solve(const ViewGraph& view_graph,
     }
   });
 
-  ceres::Solve(solver_options, problem_.get(), &summary);
+  {
+    ScopedStage stage("solve");
+    ceres::Solve(solver_options, problem_.get(), &summary);
+    RecordCount("iterations", summary.iterations.size());
+  }
 
   gp_solving.store(false);
   if (gp_heartbeat.joinable()) {
@@ -237,10 +394,366 @@ bool GlobalPositioner::Solve(const ViewGraph& view_graph,
     LOG(INFO) << summary.BriefReport();
   }
 
+  final_cost_ = summary.final_cost;
   ConvertResults(rigs, frames);
   return summary.IsSolutionUsable();
 }
 
+bool GlobalPositioner::SolveCoarseToFine(
+    const ViewGraph& view_graph,
+    std::unordered_map<rig_t, Rig>& rigs,
+    std::unordered_map<camera_t, Camera>& cameras,
+    std::unordered_map<frame_t, Frame>& frames,
+    std::unordered_map<image_t, Image>& images,
+    std::unordered_map<track_t, Track>& tracks) {
+  GlobalPositionerOptions fine_options = options_;
+  fine_options.coarse_num_tracks = -1;
+
+  // The coarse solution has to be a warm start for every variable of the
+  // full problem, which is not the case for the cam_from_rig translations
+  // that are estimated, and for fixed positions or points
+  bool supported = options_.optimize_positions && options_.optimize_points;
+  for (const auto& [rig_id, rig] : rigs) {
+    for (const auto& [sensor_id, cam_from_rig] : rig.NonRefSensors()) {
+      if (cam_from_rig.has_value() && cam_from_rig->translation.hasNaN()) {
+        supported = false;
+      }
+    }
+  }
+  if (!supported) {
+    LOG(WARNING) << "[GP] Coarse-to-fine positioning is not supported for "
+                    "this problem, solving it directly";
+    GlobalPositioner positioner(fine_options);
+    return positioner.Solve(view_graph, rigs, cameras, frames, images, tracks);
+  }
+
+  std::unordered_set<track_t> coarse_tracks;
+  {
+    ScopedStage stage("coarse");
+    LOG(INFO) << "[GP] Coarse positioning with " << options_.coarse_num_tracks
+              << " of " << tracks.size() << " tracks";
+    GlobalPositionerOptions coarse_options = fine_options;
+    coarse_options.max_num_tracks = options_.coarse_num_tracks;
+    coarse_options.track_selection_type =
+        GlobalPositionerOptions::SPATIALLY_BALANCED;
+    if (options_.num_starts > 1) {
+      coarse_tracks = SolveMultiStart(
+          view_graph, rigs, cameras, frames, images, tracks, coarse_options);
+    } else {
+      GlobalPositioner coarse_positioner(coarse_options);
+      if (coarse_positioner.Solve(
+              view_graph, rigs, cameras, frames, images, tracks)) {
+        coarse_tracks = std::move(coarse_positioner.filtered_tracks_);
+      }
+    }
+    if (coarse_tracks.empty()) {
+      LOG(WARNING) << "[GP] Coarse positioning failed, solving the full "
+                      "problem from a random initialization";
+      GlobalPositioner positioner(fine_options);
+      return positioner.Solve(
+          view_graph, rigs, cameras, frames, images, tracks);
+    }
+  }
+
+  // Start the full problem from the coarse positions and points, with the
+  // other points triangulated and the scales computed from them
+  const size_t num_triangulated =
+      TriangulateTracks(images, coarse_tracks, tracks);
+  LOG(INFO) << "[GP] Fine positioning with " << num_triangulated
+            << " triangulated tracks";
+  fine_options.generate_random_positions = false;
+  fine_options.generate_random_points = false;
+  fine_options.generate_scales = false;
+
+  ScopedStage stage("fine");
+  GlobalPositioner fine_positioner(fine_options);
+  return fine_positioner.Solve(
+      view_graph, rigs, cameras, frames, images, tracks);
+}
+
+std::unordered_set<track_t> GlobalPositioner::SolveMultiStart(
+    const ViewGraph& view_graph,
+    std::unordered_map<rig_t, Rig>& rigs,
+    std::unordered_map<camera_t, Camera>& cameras,
+    std::unordered_map<frame_t, Frame>& frames,
+    std::unordered_map<image_t, Image>& images,
+    std::unordered_map<track_t, Track>& tracks,
+    const GlobalPositionerOptions& coarse_options) {
+  const int num_starts = options_.num_starts;
+  LOG(INFO) << "[GP] Multi-start positioning with " << num_starts
+            << " starts";
+
+  // Every start solves for the same tracks, so that their costs compare
+  GlobalPositioner selector(coarse_options);
+  selector.SelectSpatiallyBalancedTracks(cameras, images, tracks);
+  std::unordered_set<track_t> coarse_tracks =
+      std::move(selector.filtered_tracks_);
+
+  // Only the rays of the coarse tracks are copied to the starts, and the
+  // observations refer to them instead of the features of the images
+  std::unordered_map<image_t, std::vector<Eigen::Vector3d>> image_rays;
+  std::unordered_map<track_t, Track> start_tracks;
+  for (const track_t track_id : coarse_tracks) {
+    Track& start_track =
+        start_tracks.emplace(track_id, tracks.at(track_id)).first->second;
+    for (auto& [image_id, feature_id] : start_track.observations) {
+      const auto image_it = images.find(image_id);
+      if (image_it == images.end()) continue;
+      std::vector<Eigen::Vector3d>& rays = image_rays[image_id];
+      rays.push_back(image_it->second.features_undist[feature_id]);
+      feature_id = rays.size() - 1;
+    }
+  }
+
+  struct Start {
+    std::unordered_map<rig_t, Rig> rigs;
+    std::unordered_map<camera_t, Camera> cameras;
+    std::unordered_map<frame_t, Frame> frames;
+    std::unordered_map<image_t, Image> images;
+    std::unordered_map<track_t, Track> tracks;
+    bool success = false;
+    double cost = std::numeric_limits<double>::infinity();
+    double median_angle = std::numeric_limits<double>::infinity();
+  };
+  std::vector<Start> starts(num_starts);
+
+  const int num_threads = colmap::GetEffectiveNumThreads(
+      coarse_options.solver_options.num_threads);
+  const int num_parallel_starts = std::min(num_starts, num_threads);
+  GlobalPositionerOptions start_options = coarse_options;
+  start_options.max_num_tracks = -1;
+  start_options.solver_options.num_threads =
+      std::max(1, num_threads / num_parallel_starts);
+  {
+    // The stages of the starts would interleave in the run report, so they
+    // are recorded in a report of their own that is dropped
+    RunReport start_report;
+    RunReport::ActiveScope start_report_scope(start_report);
+
+    colmap::ThreadPool thread_pool(num_parallel_starts);
+    for (int k = 0; k < num_starts; k++) {
+      thread_pool.AddTask([&, k]() {
+        Start& start = starts[k];
+        start.rigs = rigs;
+        start.cameras = cameras;
+        for (const auto& [frame_id, frame] : frames) {
+          Frame& start_frame =
+              start.frames.emplace(frame_id, frame).first->second;
+          start_frame.SetRigPtr(&start.rigs.at(frame.RigId()));
+        }
+        for (const auto& [image_id, image] : images) {
+          Image& start_image =
+              start.images
+                  .emplace(image_id,
+                           Image(image_id, image.camera_id, image.file_name))
+                  .first->second;
+          start_image.frame_id = image.frame_id;
+          if (image.frame_ptr != nullptr) {
+            start_image.frame_ptr = &start.frames.at(image.frame_id);
+          }
+          const auto rays_it = image_rays.find(image_id);
+          if (rays_it == image_rays.end()) continue;
+          start_image.features_undist.resize(rays_it->second.size());
+          for (size_t i = 0; i < rays_it->second.size(); i++) {
+            start_image.features_undist.Set(i, rays_it->second[i]);
+          }
+        }
+        start.tracks = start_tracks;
+
+        GlobalPositionerOptions options = start_options;
+        options.seed = coarse_options.seed + k;
+        GlobalPositioner positioner(options);
+        start.success = positioner.Solve(view_graph,
+                                         start.rigs,
+                                         start.cameras,
+                                         start.frames,
+                                         start.images,
+                                         start.tracks);
+        if (!start.success) return;
+        start.cost = positioner.final_cost_;
+        start.median_angle = MedianAngularResidual(start.images, start.tracks);
+      });
+    }
+    thread_pool.Wait();
+  }
+
+  std::vector<int> successful_starts;
+  for (int k = 0; k < num_starts; k++) {
+    if (starts[k].success) successful_starts.push_back(k);
+  }
+  RecordCount("successful_starts", successful_starts.size());
+  if (successful_starts.empty()) return {};
+
+  // Rank the successful starts by each score, the best with rank 0
+  std::vector<int> rank_sums(num_starts, 0);
+  const auto add_ranks = [&](double Start::*score) {
+    std::vector<int> order = successful_starts;
+    std::stable_sort(order.begin(), order.end(), [&](int k1, int k2) {
+      return starts[k1].*score < starts[k2].*score;
+    });
+    for (size_t rank = 0; rank < order.size(); rank++) {
+      rank_sums[order[rank]] += rank;
+    }
+  };
+  add_ranks(&Start::cost);
+  add_ranks(&Start::median_angle);
+
+  int best_start = successful_starts[0];
+  for (const int k : successful_starts) {
+    LOG(INFO) << "[GP] Start " << k << ": seed=" << coarse_options.seed + k
+              << ", final_cost=" << starts[k].cost
+              << ", median_angle_deg=" << starts[k].median_angle
+              << ", rank_sum=" << rank_sums[k];
+    if (rank_sums[k] < rank_sums[best_start] ||
+        (rank_sums[k] == rank_sums[best_start] &&
+         starts[k].cost < starts[best_start].cost)) {
+      best_start = k;
+    }
+  }
+  LOG(INFO) << "[GP] Continuing from start " << best_start;
+  RecordCount("best_start", best_start);
+
+  const Start& best = starts[best_start];
+  for (auto& [rig_id, rig] : rigs) {
+    const Rig& best_rig = best.rigs.at(rig_id);
+    for (auto& [sensor_id, cam_from_rig] : rig.NonRefSensors()) {
+      cam_from_rig = best_rig.NonRefSensors().at(sensor_id);
+    }
+  }
+  for (auto& [frame_id, frame] : frames) {
+    frame.RigFromWorld() = best.frames.at(frame_id).RigFromWorld();
+  }
+  for (const track_t track_id : coarse_tracks) {
+    Track& track = tracks.at(track_id);
+    const Track& best_track = best.tracks.at(track_id);
+    track.xyz = best_track.xyz;
+    track.is_initialized = best_track.is_initialized;
+  }
+  return coarse_tracks;
+}
+
+void GlobalPositioner::SelectSpatiallyBalancedTracks(
+    const std::unordered_map<camera_t, Camera>& cameras,
+    const std::unordered_map<image_t, Image>& images,
+    const std::unordered_map<track_t, Track>& tracks) {
+  const int grid_size = std::max(1, options_.track_selection_grid_size);
+  const int num_cells_per_image = grid_size * grid_size;
+
+  // Dense indices of the registered images and of their frames
+  std::unordered_map<image_t, int> image_indices;
+  std::unordered_map<frame_t, int> frame_indices;
+  std::vector<const Image*> registered_images;
+  std::vector<int> image_frame_indices;
+  for (const auto& [image_id, image] : images) {
+    if (!image.IsRegistered()) continue;
+    image_indices.emplace(image_id, registered_images.size());
+    registered_images.push_back(&image);
+    const auto frame_it =
+        frame_indices.emplace(image.frame_id, frame_indices.size()).first;
+    image_frame_indices.push_back(frame_it->second);
+  }
+
+  // The image cell and the frame of every observation of the candidates
+  std::vector<track_t> candidate_ids;
+  std::vector<int> candidate_offsets = {0};
+  std::vector<int> observation_cells;
+  std::vector<int> observation_frames;
+  std::vector<bool> cell_observed(registered_images.size() *
+                                  num_cells_per_image);
+  for (const auto& [track_id, track] : tracks) {
+    if (track.observations.size() < options_.min_num_view_per_track) continue;
+    for (const auto& [image_id, feature_id] : track.observations) {
+      const auto image_it = image_indices.find(image_id);
+      if (image_it == image_indices.end()) continue;
+      const Image& image = *registered_images[image_it->second];
+      const Camera& camera = cameras.at(image.camera_id);
+      int cell = 0;
+      if (feature_id < image.features.size() && camera.width > 0 &&
+          camera.height > 0) {
+        const Eigen::Vector2d& feature = image.features[feature_id];
+        const int col = std::clamp(
+            static_cast<int>(feature.x() * grid_size / camera.width),
+            0,
+            grid_size - 1);
+        const int row = std::clamp(
+            static_cast<int>(feature.y() * grid_size / camera.height),
+            0,
+            grid_size - 1);
+        cell = row * grid_size + col;
+      }
+      observation_cells.push_back(image_it->second * num_cells_per_image +
+                                  cell);
+      observation_frames.push_back(image_frame_indices[image_it->second]);
+      cell_observed[observation_cells.back()] = true;
+    }
+    if (static_cast<int>(observation_cells.size()) ==
+        candidate_offsets.back()) {
+      continue;
+    }
+    candidate_ids.push_back(track_id);
+    candidate_offsets.push_back(observation_cells.size());
+  }
+
+  // The candidates in order of decreasing length
+  std::vector<int> order(candidate_ids.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](int i, int j) {
+    return candidate_offsets[i + 1] - candidate_offsets[i] >
+           candidate_offsets[j + 1] - candidate_offsets[j];
+  });
+
+  // Round r selects, longest first, the tracks that observe an image cell
+  // with less than r selected tracks, or a frame with less than r selected
+  // tracks per cell. A track is needed again in the round after the lowest
+  // of these counts over its observations, so the rounds in which no track
+  // is needed are skipped.
+  std::vector<int> cell_counts(cell_observed.size(), 0);
+  std::vector<int> frame_counts(frame_indices.size(), 0);
+  std::vector<bool> selected(candidate_ids.size(), false);
+  const size_t max_num_tracks =
+      std::min<size_t>(options_.max_num_tracks, candidate_ids.size());
+  int round = 1;
+  while (filtered_tracks_.size() < max_num_tracks) {
+    int next_round = std::numeric_limits<int>::max();
+    for (const int candidate : order) {
+      if (filtered_tracks_.size() >= max_num_tracks) break;
+      if (selected[candidate]) continue;
+      int candidate_round = std::numeric_limits<int>::max();
+      for (int k = candidate_offsets[candidate];
+           k < candidate_offsets[candidate + 1];
+           k++) {
+        candidate_round = std::min(
+            {candidate_round,
+             cell_counts[observation_cells[k]] + 1,
+             frame_counts[observation_frames[k]] / num_cells_per_image + 1});
+      }
+      if (candidate_round > round) {
+        next_round = std::min(next_round, candidate_round);
+        continue;
+      }
+
+      selected[candidate] = true;
+      filtered_tracks_.insert(candidate_ids[candidate]);
+      for (int k = candidate_offsets[candidate];
+           k < candidate_offsets[candidate + 1];
+           k++) {
+        cell_counts[observation_cells[k]]++;
+        frame_counts[observation_frames[k]]++;
+      }
+    }
+    round = std::max(round + 1, next_round);
+  }
+
+  LOG(INFO) << "Selected " << filtered_tracks_.size()
+            << " spatially balanced tracks, covering "
+            << std::count_if(cell_counts.begin(),
+                             cell_counts.end(),
+                             [](int count) { return count > 0; })
+            << " of "
+            << std::count(cell_observed.begin(), cell_observed.end(), true)
+            << " observed image cells";
+}
+
 void GlobalPositioner::SetupProblem(
     const ViewGraph& view_graph,
     const std::unordered_map<rig_t, Rig>& rigs,
@@ -252,16 +765,18 @@ void GlobalPositioner::SetupProblem(
 
   // Allocate enough memory for the scales. One for each residual.
   // Due to possibly invalid image pairs or tracks, the actual number of
-  // residuals may be smaller.
+  // residuals may be smaller. BATASolver eliminates the scales.
   scales_.clear();
-  scales_.reserve(
-      view_graph.image_pairs.size() +
-      std::accumulate(filtered_tracks_.begin(),
-                      filtered_tracks_.end(),
-                      0,
-                      [&tracks](int sum, const track_t track_id) {
-                        return sum + tracks.at(track_id).observations.size();
-                      }));
+  if (!use_bata_solver_) {
+    scales_.reserve(
+        view_graph.image_pairs.size() +
+        std::accumulate(filtered_tracks_.begin(),
+                        filtered_tracks_.end(),
+                        0,
+                        [&tracks](int sum, const track_t track_id) {
+                          return sum + tracks.at(track_id).observations.size();
+                        }));
+  }
 
   // Initialize the rig scales to be 1.0.
   for (const auto& [rig_id, rig] : rigs) {
@@ -403,6 +918,12 @@ void GlobalPositioner::AddPointToCameraConstraints(
     loss_function_ptcam_calibrated_ = loss_function_;
   }
 
+  // The constraints are built in three phases. First the tracks are gathered
+  // and their points initialized, serially so that the random points do not
+  // depend on the number of threads.
+  std::vector<Track*> problem_tracks;
+  std::vector<track_t> problem_track_ids;
+  std::vector<size_t> observation_offsets = {0};
   for (auto& [track_id, track] : tracks) {
     if (filtered_tracks_.find(track_id) == filtered_tracks_.end()) continue;
     if (track.observations.size() < options_.min_num_view_per_track) continue;
@@ -413,115 +934,295 @@ void GlobalPositioner::AddPointToCameraConstraints(
       track.is_initialized = true;
     }
 
-    AddTrackToProblem(track_id, rigs, cameras, frames, images, tracks);
+    problem_tracks.push_back(&track);
+    problem_track_ids.push_back(track_id);
+    observation_offsets.push_back(observation_offsets.back() +
+                                  track.observations.size());
   }
-}
 
-void GlobalPositioner::AddTrackToProblem(
-    track_t track_id,
-    std::unordered_map<rig_t, Rig>& rigs,
-    std::unordered_map<camera_t, Camera>& cameras,
-    std::unordered_map<frame_t, Frame>& frames,
-    std::unordered_map<image_t, Image>& images,
-    std::unordered_map<track_t, Track>& tracks) {
-  // For each view in the track add the point to camera correspondences.
-  for (const auto& observation : tracks[track_id].observations) {
-    if (images.find(observation.first) == images.end()) continue;
-
-    Image& image = images[observation.first];
+  // The pose data of the registered images, computed once instead of for
+  // every observation
+  image_t max_image_id = 0;
+  for (const auto& [image_id, image] : images) {
+    max_image_id = std::max(max_image_id, image_id);
+  }
+  std::vector<int> image_slots(static_cast<size_t>(max_image_id) + 1, -1);
+  std::vector<ImageConstraintData> image_data;
+  image_data.reserve(images.size());
+  for (auto& [image_id, image] : images) {
     if (!image.IsRegistered()) continue;
+    image_slots[image_id] = image_data.size();
+    ImageConstraintData& data = image_data.emplace_back();
+    const Rigid3d cam_from_world = image.CamFromWorld();
+    data.image = &image;
+    data.world_from_cam_rotation =
+        cam_from_world.rotation.inverse().toRotationMatrix();
+    data.cam_from_world_translation = cam_from_world.translation;
+    data.frame_translation = image.frame_ptr->RigFromWorld().translation.data();
+    // For calibrated and uncalibrated cameras, use different loss
+    // functions
+    // Down weight the uncalibrated cameras
+    data.loss_function = (cameras[image.camera_id].has_prior_focal_length)
+                             ? loss_function_ptcam_calibrated_.get()
+                             : loss_function_ptcam_uncalibrated_.get();
 
-    const Eigen::Vector3d& feature_undist =
-        image.features_undist[observation.second];
-    if (feature_undist.array().isNaN().any()) {
-      LOG(WARNING)
-          << "Ignoring feature because it failed to undistort: track_id="
-          << track_id << ", image_id=" << observation.first
-          << ", feature_id=" << observation.second;
+    // If the image is not part of a camera rig, use the standard BATA error
+    if (image.HasTrivialFrame()) {
+      data.type = ImageConstraintData::TRIVIAL_FRAME;
       continue;
     }
+    // Otherwise, use the camera rig translation from the frame
+    const rig_t rig_id = image.frame_ptr->RigId();
+    Rigid3d& cam_from_rig = rigs.at(rig_id).SensorFromRig(
+        sensor_t(SensorType::CAMERA, image.camera_id));
+    if (!cam_from_rig.translation.hasNaN()) {
+      data.type = ImageConstraintData::KNOWN_RIG;
+      data.translation_rig =
+          data.world_from_cam_rotation * cam_from_rig.translation;
+      data.rig_scale = &rig_scales_[rig_id];
+    } else {
+      // If the cam_from_rig contains nan values, it means that it needs to be
+      // re-estimated. In this case, use the rigged cost. NOTE: the scale for
+      // the rig is not needed, as it would natrually be consistent with the
+      // global one
+      data.type = ImageConstraintData::UNKNOWN_RIG;
+      data.cam_from_rig_translation = cam_from_rig.translation.data();
+      data.rig_from_world_rotation = image.frame_ptr->RigFromWorld().rotation;
+    }
+  }
 
-    const Eigen::Vector3d translation =
-        image.CamFromWorld().rotation.inverse() *
-        image.features_undist[observation.second];
+  // Second, the directions, initial scales and cost functions of all the
+  // observations are computed in parallel into flat arrays
+  const size_t num_observations = observation_offsets.back();
+  std::vector<int> observation_slots(num_observations, -1);
+  std::vector<double> initial_scales(num_observations, 1);
+  std::vector<ceres::CostFunction*> cost_functions(num_observations, nullptr);
+  auto build_track_constraints = [&](size_t begin, size_t end) {
+    for (size_t track_idx = begin; track_idx < end; track_idx++) {
+      const Track& track = *problem_tracks[track_idx];
+      for (size_t k = 0; k < track.observations.size(); k++) {
+        const auto& [image_id, feature_id] = track.observations[k];
+        if (image_id > max_image_id || image_slots[image_id] == -1) continue;
+        const ImageConstraintData& data = image_data[image_slots[image_id]];
+
+        const Eigen::Vector3d feature_undist =
+            data.image->features_undist[feature_id];
+        if (feature_undist.array().isNaN().any()) {
+          LOG(WARNING)
+              << "Ignoring feature because it failed to undistort: track_id="
+              << problem_track_ids[track_idx] << ", image_id=" << image_id
+              << ", feature_id=" << feature_id;
+          continue;
+        }
 
-    double& scale = scales_.emplace_back(1);
+        const size_t obs_idx = observation_offsets[track_idx] + k;
+        const Eigen::Vector3d translation =
+            data.world_from_cam_rotation * feature_undist;
+        if (!options_.generate_scales && track.is_initialized) {
+          const Eigen::Vector3d trans_calc =
+              track.xyz - data.cam_from_world_translation;
+          initial_scales[obs_idx] = std::max(
+              1e-5, translation.dot(trans_calc) / trans_calc.squaredNorm());
+        }
+
+        switch (data.type) {
+          case ImageConstraintData::TRIVIAL_FRAME:
+            cost_functions[obs_idx] =
+                BATAPairwiseDirectionError::Create(translation);
+            break;
+          case ImageConstraintData::KNOWN_RIG:
+            cost_functions[obs_idx] = RigBATAPairwiseDirectionError::Create(
+                translation, data.translation_rig);
+            break;
+          case ImageConstraintData::UNKNOWN_RIG:
+            cost_functions[obs_idx] =
+                RigUnknownBATAPairwiseDirectionError::Create(
+                    translation, data.rig_from_world_rotation);
+            break;
+        }
+        observation_slots[obs_idx] = image_slots[image_id];
+      }
+    }
+  };
+  const size_t num_problem_tracks = problem_tracks.size();
+  const size_t kNumTracksPerTask = 1024;
+  if (num_problem_tracks <= kNumTracksPerTask) {
+    build_track_constraints(0, num_problem_tracks);
+  } else {
+    // The same threads as the solver, so that multi-start positioning keeps
+    // the threads of every start within its share
+    colmap::ThreadPool thread_pool(
+        colmap::GetEffectiveNumThreads(options_.solver_options.num_threads));
+    for (size_t begin = 0; begin < num_problem_tracks;
+         begin += kNumTracksPerTask) {
+      const size_t end =
+          std::min(begin + kNumTracksPerTask, num_problem_tracks);
+      thread_pool.AddTask([&build_track_constraints, begin, end]() {
+        build_track_constraints(begin, end);
+      });
+    }
+    thread_pool.Wait();
+  }
 
-    if (!options_.generate_scales && tracks[track_id].is_initialized) {
-      const Eigen::Vector3d trans_calc =
-          tracks[track_id].xyz - image.CamFromWorld().translation;
-      scale = std::max(1e-5,
-                       translation.dot(trans_calc) / trans_calc.squaredNorm());
+  // Finally, the residual blocks are added to the problem, in the same order
+  // as the observations
+  const size_t num_constraints =
+      num_observations - std::count(cost_functions.begin(),
+                                    cost_functions.end(),
+                                    nullptr);
+  CHECK_GE(scales_.capacity(), scales_.size() + num_constraints)
+      << "Not enough capacity was reserved for the scales.";
+  for (size_t track_idx = 0; track_idx < num_problem_tracks; track_idx++) {
+    double* xyz = problem_tracks[track_idx]->xyz.data();
+    for (size_t obs_idx = observation_offsets[track_idx];
+         obs_idx < observation_offsets[track_idx + 1];
+         obs_idx++) {
+      if (cost_functions[obs_idx] == nullptr) continue;
+      const ImageConstraintData& data =
+          image_data[observation_slots[obs_idx]];
+      double& scale = scales_.emplace_back(initial_scales[obs_idx]);
+      switch (data.type) {
+        case ImageConstraintData::TRIVIAL_FRAME:
+          problem_->AddResidualBlock(cost_functions[obs_idx],
+                                     data.loss_function,
+                                     data.frame_translation,
+                                     xyz,
+                                     &scale);
+          break;
+        case ImageConstraintData::KNOWN_RIG:
+          problem_->AddResidualBlock(cost_functions[obs_idx],
+                                     data.loss_function,
+                                     data.frame_translation,
+                                     xyz,
+                                     &scale,
+                                     data.rig_scale);
+          break;
+        case ImageConstraintData::UNKNOWN_RIG:
+          problem_->AddResidualBlock(cost_functions[obs_idx],
+                                     data.loss_function,
+                                     xyz,
+                                     data.frame_translation,
+                                     data.cam_from_rig_translation,
+                                     &scale);
+          break;
+      }
+      problem_->SetParameterLowerBound(&scale, 0, 1e-5);
     }
+  }
 
-    CHECK_GE(scales_.capacity(), scales_.size())
-        << "Not enough capacity was reserved for the scales.";
+  VLOG(2) << num_constraints << " point to camera constraints of "
+          << num_problem_tracks << " tracks were added";
+}
 
-    // For calibrated and uncalibrated cameras, use different loss
-    // functions
-    // Down weight the uncalibrated cameras
-    ceres::LossFunction* loss_function =
-        (cameras[image.camera_id].has_prior_focal_length)
-            ? loss_function_ptcam_calibrated_.get()
-            : loss_function_ptcam_uncalibrated_.get();
+bool GlobalPositioner::CanUseBATASolver(
+    const std::unordered_map<image_t, Image>& images) const {
+  if (options_.constraint_type != GlobalPositionerOptions::ONLY_POINTS ||
+      !options_.optimize_positions || !options_.optimize_points ||
+      !options_.optimize_scales) {
+    return false;
+  }
+  for (const auto& [image_id, image] : images) {
+    if (image.IsRegistered() && !image.HasTrivialFrame()) return false;
+  }
+  return true;
+}
 
-    // If the image is not part of a camera rig, use the standard BATA error
-    if (image.HasTrivialFrame()) {
-      ceres::CostFunction* cost_function =
-          BATAPairwiseDirectionError::Create(translation);
-
-      problem_->AddResidualBlock(
-          cost_function,
-          loss_function,
-          image.frame_ptr->RigFromWorld().translation.data(),
-          tracks[track_id].xyz.data(),
-          &scale);
-      // If the image is part of a camera rig, use the RigBATA error
-    } else {
-      rig_t rig_id = image.frame_ptr->RigId();
-      // Otherwise, use the camera rig translation from the frame
-      Rigid3d& cam_from_rig = rigs.at(rig_id).SensorFromRig(
-          sensor_t(SensorType::CAMERA, image.camera_id));
-
-      Eigen::Vector3d cam_from_rig_translation = cam_from_rig.translation;
-
-      if (!cam_from_rig_translation.hasNaN()) {
-        const Eigen::Vector3d translation_rig =
-            // image.cam_from_world.rotation.inverse() *
-            // cam_from_rig.translation;
-            image.CamFromWorld().rotation.inverse() * cam_from_rig_translation;
-
-        ceres::CostFunction* cost_function =
-            RigBATAPairwiseDirectionError::Create(translation, translation_rig);
-
-        problem_->AddResidualBlock(
-            cost_function,
-            loss_function,
-            image.frame_ptr->RigFromWorld().translation.data(),
-            tracks[track_id].xyz.data(),
-            &scale,
-            &rig_scales_[rig_id]);
-      } else {
-        // If the cam_from_rig contains nan values, it means that it needs to be
-        // re-estimated In this case, use the rigged cost NOTE: the scale for
-        // the rig is not needed, as it would natrually be consistent with the
-        // global one
-        ceres::CostFunction* cost_function =
-            RigUnknownBATAPairwiseDirectionError::Create(
-                translation, image.frame_ptr->RigFromWorld().rotation);
-
-        problem_->AddResidualBlock(
-            cost_function,
-            loss_function,
-            tracks[track_id].xyz.data(),
-            image.frame_ptr->RigFromWorld().translation.data(),
-            cam_from_rig.translation.data(),
-            &scale);
-      }
+bool GlobalPositioner::SolveWithBATASolver(
+    std::unordered_map<camera_t, Camera>& cameras,
+    std::unordered_map<image_t, Image>& images,
+    std::unordered_map<track_t, Track>& tracks) {
+  BATASolverOptions solver_options;
+  solver_options.thres_loss_function = options_.thres_loss_function;
+  solver_options.max_num_iterations =
+      options_.solver_options.max_num_iterations;
+  solver_options.function_tolerance =
+      options_.solver_options.function_tolerance;
+  solver_options.gradient_tolerance =
+      options_.solver_options.gradient_tolerance;
+  solver_options.parameter_tolerance =
+      options_.solver_options.parameter_tolerance;
+  solver_options.num_threads = options_.solver_options.num_threads;
+  BATASolver solver(solver_options);
+
+  // The constraints are the same as in AddPointToCameraConstraints for
+  // ONLY_POINTS, with the same random initialization of the points
+  std::unordered_map<frame_t, int> position_indices;
+  size_t num_points = 0;
+  for (auto& [track_id, track] : tracks) {
+    if (filtered_tracks_.find(track_id) == filtered_tracks_.end()) continue;
+    if (track.observations.size() < options_.min_num_view_per_track) continue;
+
+    if (options_.generate_random_points) {
+      track.xyz = 100.0 * RandVector3d(random_generator_, -1, 1);
+      track.is_initialized = true;
     }
 
-    problem_->SetParameterLowerBound(&scale, 0, 1e-5);
+    int point_idx = -1;
+    for (const auto& [image_id, feature_id] : track.observations) {
+      auto image_it = images.find(image_id);
+      if (image_it == images.end() || !image_it->second.IsRegistered()) {
+        continue;
+      }
+      Image& image = image_it->second;
+
+      const Eigen::Vector3d feature_undist = image.features_undist[feature_id];
+      if (feature_undist.array().isNaN().any()) {
+        LOG(WARNING)
+            << "Ignoring feature because it failed to undistort: track_id="
+            << track_id << ", image_id=" << image_id
+            << ", feature_id=" << feature_id;
+        continue;
+      }
+
+      if (point_idx == -1) {
+        point_idx = solver.AddPoint(track.xyz.data());
+        num_points++;
+      }
+      auto [position_it, inserted] =
+          position_indices.emplace(image.frame_id, -1);
+      if (inserted) {
+        position_it->second = solver.AddPosition(
+            image.frame_ptr->RigFromWorld().translation.data());
+      }
+
+      const Rigid3d cam_from_world = image.CamFromWorld();
+      const Eigen::Vector3d translation =
+          cam_from_world.rotation.inverse() * feature_undist;
+      // Down weight the uncalibrated cameras
+      const double weight =
+          cameras[image.camera_id].has_prior_focal_length ? 1 : 0.5;
+      const int constraint_idx = solver.AddConstraint(
+          position_it->second, point_idx, translation, weight);
+
+      // Fix the first scale to remove the scale ambiguity, as
+      // ParameterizeVariables does for Ceres
+      if (constraint_idx == 0) {
+        double scale = 1;
+        if (!options_.generate_scales && track.is_initialized) {
+          const Eigen::Vector3d trans_calc =
+              track.xyz - cam_from_world.translation;
+          scale = std::max(
+              1e-5, translation.dot(trans_calc) / trans_calc.squaredNorm());
+        }
+        solver.SetScaleConstant(constraint_idx, scale);
+      }
+    }
   }
+
+  LOG(INFO) << "[GP] BATA problem: positions=" << position_indices.size()
+            << ", points=" << num_points
+            << ", constraints=" << solver.NumConstraints();
+  RecordCount("constraints", solver.NumConstraints());
+
+  const BATASolverSummary summary = solver.Solve();
+  RecordCount("iterations", summary.num_iterations);
+  LOG(INFO) << "[GP] BATA solver: iterations=" << summary.num_iterations
+            << ", linear_iterations=" << summary.num_linear_iterations
+            << ", initial_cost=" << summary.initial_cost
+            << ", final_cost=" << summary.final_cost
+            << (summary.converged ? ", converged" : ", not converged");
+  final_cost_ = summary.final_cost;
+  return summary.IsSolutionUsable();
 }
 
 void GlobalPositioner::AddCamerasAndPointsToParameterGroups(
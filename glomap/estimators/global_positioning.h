@@ -37,9 +37,37 @@ struct GlobalPositionerOptions : public OptimizationBaseOptions {
 
   // Constrain the minimum number of views per track
   int min_num_view_per_track = 3;
-  // Constrain the maximum number of tracks (prioritizing longest tracks)
+  // Constrain the maximum number of tracks
   int max_num_tracks = -1;
 
+  // How the tracks are chosen if there are more than max_num_tracks
+  enum TrackSelectionType {
+    // The longest tracks
+    LONGEST,
+    // The longest tracks in each cell of a grid over every image and in
+    // each frame, taking turns between the cells, so that the constraints
+    // spread over the images instead of clustering in a few textured regions
+    SPATIALLY_BALANCED,
+  } track_selection_type = LONGEST;
+
+  // Number of cells per side of the image grid of SPATIALLY_BALANCED
+  int track_selection_grid_size = 8;
+
+  // Coarse-to-fine positioning: if positive and there are more tracks, first
+  // solve from the random initialization with this many SPATIALLY_BALANCED
+  // tracks, then triangulate the other tracks from the coarse camera
+  // positions and solve the full problem from there
+  int coarse_num_tracks = -1;
+
+  // Multi-start coarse positioning: if larger than 1, the coarse problem is
+  // solved from this many random initializations, seeded with seed, seed + 1,
+  // ..., in parallel with the threads divided among them. The starts are
+  // ranked by their final robust cost and by the median angle between the
+  // observed rays and the directions to their points, and the full problem is
+  // solved from the start with the lowest sum of ranks. Only used with
+  // coarse_num_tracks.
+  int num_starts = 1;
+
   // Random seed
   unsigned seed = 1;
 
@@ -48,6 +76,15 @@ struct GlobalPositionerOptions : public OptimizationBaseOptions {
   double constraint_reweight_scale =
       1.0;  // only relevant for POINTS_AND_CAMERAS_BALANCED
 
+  enum SolverType {
+    // Ceres problem with one residual and one scale per constraint
+    CERES,
+    // BATASolver, with the scales eliminated in closed form. Only for
+    // ONLY_POINTS with all the variables optimized and the registered images
+    // being the reference cameras of their rigs, otherwise Ceres is used.
+    BATA,
+  } solver_type = CERES;
+
   GlobalPositionerOptions() : OptimizationBaseOptions() {
     thres_loss_function = 1e-1;
   }
@@ -74,6 +111,42 @@ class GlobalPositioner {
   GlobalPositionerOptions& GetOptions() { return options_; }
 
  protected:
+  // Solve with coarse_num_tracks tracks first, then with all of them
+  bool SolveCoarseToFine(const ViewGraph& view_graph,
+                         std::unordered_map<rig_t, Rig>& rigs,
+                         std::unordered_map<camera_t, Camera>& cameras,
+                         std::unordered_map<frame_t, Frame>& frames,
+                         std::unordered_map<image_t, Image>& images,
+                         std::unordered_map<track_t, Track>& tracks);
+
+  // Solve the coarse problem of the given options from num_starts seeds and
+  // keep the best solution. The starts work on copies of the coarse tracks
+  // with only the features they observe. Returns the coarse tracks, empty if
+  // every start failed.
+  std::unordered_set<track_t> SolveMultiStart(
+      const ViewGraph& view_graph,
+      std::unordered_map<rig_t, Rig>& rigs,
+      std::unordered_map<camera_t, Camera>& cameras,
+      std::unordered_map<frame_t, Frame>& frames,
+      std::unordered_map<image_t, Image>& images,
+      std::unordered_map<track_t, Track>& tracks,
+      const GlobalPositionerOptions& coarse_options);
+
+  // Whether the problem is supported by BATASolver
+  bool CanUseBATASolver(
+      const std::unordered_map<image_t, Image>& images) const;
+
+  // Solve the point to camera constraints with BATASolver instead of Ceres
+  bool SolveWithBATASolver(std::unordered_map<camera_t, Camera>& cameras,
+                           std::unordered_map<image_t, Image>& images,
+                           std::unordered_map<track_t, Track>& tracks);
+
+  // Choose at most max_num_tracks tracks that cover the images evenly
+  void SelectSpatiallyBalancedTracks(
+      const std::unordered_map<camera_t, Camera>& cameras,
+      const std::unordered_map<image_t, Image>& images,
+      const std::unordered_map<track_t, Track>& tracks);
+
   void SetupProblem(const ViewGraph& view_graph,
                     const std::unordered_map<rig_t, Rig>& rigs,
                     const std::unordered_map<track_t, Track>& tracks);
@@ -88,7 +161,8 @@ class GlobalPositioner {
   void AddCameraToCameraConstraints(const ViewGraph& view_graph,
                                     std::unordered_map<image_t, Image>& images);
 
-  // Add tracks to the problem
+  // Add tracks to the problem. The directions and cost functions of the
+  // observations are computed in parallel, then the residual blocks are added
   void AddPointToCameraConstraints(
       std::unordered_map<rig_t, Rig>& rigs,
       std::unordered_map<camera_t, Camera>& cameras,
@@ -96,14 +170,6 @@ class GlobalPositioner {
       std::unordered_map<image_t, Image>& images,
       std::unordered_map<track_t, Track>& tracks);
 
-  // Add a single track to the problem
-  void AddTrackToProblem(track_t track_id,
-                         std::unordered_map<rig_t, Rig>& rigs,
-                         std::unordered_map<camera_t, Camera>& cameras,
-                         std::unordered_map<frame_t, Frame>& frames,
-                         std::unordered_map<image_t, Image>& images,
-                         std::unordered_map<track_t, Track>& tracks);
-
   // Set the parameter groups
   void AddCamerasAndPointsToParameterGroups(
       std::unordered_map<rig_t, Rig>& rigs,
@@ -135,6 +201,11 @@ class GlobalPositioner {
 
   std::unordered_map<rig_t, double> rig_scales_;
   std::unordered_set<track_t> filtered_tracks_;
+
+  bool use_bata_solver_ = false;
+
+  // The final cost of the last solve
+  double final_cost_ = 0;
 };
 
 }  // namespace glomap
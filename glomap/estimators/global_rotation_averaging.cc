@@ -5,15 +5,28 @@
 #include "glomap/math/rigid3d.h"
 #include "glomap/math/tree.h"
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <mutex>
 #include <queue>
+#include <random>
 
 #include "colmap/geometry/pose.h"
+#include "colmap/util/timer.h"
 
 namespace glomap {
 namespace {
 
-double RelAngleError(double angle_12, double angle_1, double angle_2) {
+// Below this size the kernels run on the calling thread
+constexpr int kMinNumItemsPerThread = 4096;
+
+// The noise is drawn from a generator seeded with the given seed, so that the
+// residuals do not depend on the threads that compute them
+double RelAngleError(double angle_12,
+                     double angle_1,
+                     double angle_2,
+                     uint32_t seed) {
   double est = (angle_2 - angle_1) - angle_12;
 
   while (est >= EIGEN_PI) est -= TWO_PI;
@@ -23,22 +36,35 @@ double RelAngleError(double angle_12, double angle_1, double angle_2) {
   // Inject random noise if the angle is too close to the boundary to break the
   // possible balance at the local minima
   if (est > EIGEN_PI - 0.01 || est < -EIGEN_PI + 0.01) {
+    std::minstd_rand rng(seed);
     if (est < 0)
-      est += (rand() % 1000) / 1000.0 * 0.01;
+      est += (rng() % 1000) / 1000.0 * 0.01;
     else
-      est -= (rand() % 1000) / 1000.0 * 0.01;
+      est -= (rng() % 1000) / 1000.0 * 0.01;
   }
 
   return est;
 }
 
+std::vector<frame_t> RegisteredFrameIds(
+    const std::unordered_map<frame_t, Frame>& frames) {
+  std::vector<frame_t> frame_ids;
+  frame_ids.reserve(frames.size());
+  for (const auto& [frame_id, frame] : frames) {
+    if (frame.is_registered) frame_ids.push_back(frame_id);
+  }
+  std::sort(frame_ids.begin(), frame_ids.end());
+  return frame_ids;
+}
+
 }  // namespace
 
 bool RotationEstimator::EstimateRotations(
     const ViewGraph& view_graph,
     std::unordered_map<rig_t, Rig>& rigs,
     std::unordered_map<frame_t, Frame>& frames,
-    std::unordered_map<image_t, Image>& images) {
+    std::unordered_map<image_t, Image>& images,
+    RotationEstimatorState* state) {
   // Now, for the gravity aligned case, we only support the trivial rigs or rigs
   // with known sensor_from_rig
   if (options_.use_gravity) {
@@ -54,16 +80,28 @@ bool RotationEstimator::EstimateRotations(
       }
     }
   }
+  // The previous pass already provides a robust initial solution
+  const bool warm_start = state != nullptr && state->IsSet();
+  std::vector<frame_t> frame_ids = RegisteredFrameIds(frames);
+
   // Initialize the rotation from maximum spanning tree
-  if (!options_.skip_initialization && !options_.use_gravity) {
+  if (!options_.skip_initialization && !options_.use_gravity && !warm_start) {
     InitializeFromMaximumSpanningTree(view_graph, rigs, frames, images);
   }
 
-  // Set up the linear system
-  SetupLinearSystem(view_graph, rigs, frames, images);
+  // Set up the linear system, or reuse the one of the previous pass if it has
+  // the same unknowns
+  if (warm_start && state->frame_ids == frame_ids) {
+    VLOG(2) << "Reusing the linear system of the previous pass";
+    SwapState(*state);
+    MaskInvalidPairs(view_graph);
+  } else {
+    SetupLinearSystem(view_graph, rigs, frames, images);
+  }
+  SetupBlocks(view_graph, frames, images);
 
   // Solve the linear system for L1 norm optimization
-  if (options_.max_num_l1_iterations > 0) {
+  if (options_.max_num_l1_iterations > 0 && !warm_start) {
     if (!SolveL1Regression(view_graph, frames, images)) {
       return false;
     }
@@ -78,9 +116,104 @@ bool RotationEstimator::EstimateRotations(
 
   ConvertResults(rigs, frames, images);
 
+  if (state != nullptr) {
+    SwapState(*state);
+    state->frame_ids = std::move(frame_ids);
+  }
+
   return true;
 }
 
+void RotationEstimator::MaskInvalidPairs(const ViewGraph& view_graph) {
+  int num_masked = 0;
+  for (auto it = rel_temp_info_.begin(); it != rel_temp_info_.end();) {
+    const ImagePairTempInfo& pair_info = it->second;
+    const auto pair_it = view_graph.image_pairs.find(it->first);
+    if (pair_it != view_graph.image_pairs.end() && pair_it->second.is_valid) {
+      ++it;
+      continue;
+    }
+
+    const int num_rows = pair_info.has_gravity ? 1 : 3;
+    weights_.segment(pair_info.index, num_rows).setZero();
+    num_masked++;
+    // Residuals are only computed for the pairs of the view graph
+    if (pair_it == view_graph.image_pairs.end()) {
+      it = rel_temp_info_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  VLOG(2) << "Masked " << num_masked << " invalid pairs";
+}
+
+void RotationEstimator::SwapState(RotationEstimatorState& state) {
+  sparse_matrix_.swap(state.sparse_matrix);
+  std::swap(weights_, state.weights);
+  std::swap(rotation_estimated_, state.rotation_estimated);
+  std::swap(image_id_to_idx_, state.image_id_to_idx);
+  std::swap(frame_id_to_idx_, state.frame_id_to_idx);
+  std::swap(camera_id_to_idx_, state.camera_id_to_idx);
+  std::swap(rel_temp_info_, state.rel_temp_info);
+  std::swap(fixed_camera_id_, state.fixed_camera_id);
+  std::swap(fixed_camera_rotation_, state.fixed_camera_rotation);
+  std::swap(normal_equations_, state.normal_equations);
+  std::swap(llt_, state.llt);
+
+  tangent_space_step_.setZero(sparse_matrix_.cols());
+  tangent_space_residual_.setZero(sparse_matrix_.rows());
+}
+
+template <typename Func>
+void RotationEstimator::ParallelFor(int num_items, const Func& func) {
+  if (num_items < 2 * kMinNumItemsPerThread) {
+    func(0, num_items);
+    return;
+  }
+  if (thread_pool_ == nullptr) {
+    thread_pool_ = std::make_unique<colmap::ThreadPool>(
+        colmap::GetEffectiveNumThreads(options_.num_threads));
+  }
+  const int num_chunks =
+      std::min(thread_pool_->NumThreads(), num_items / kMinNumItemsPerThread);
+  const int chunk_size = (num_items + num_chunks - 1) / num_chunks;
+  for (int begin = 0; begin < num_items; begin += chunk_size) {
+    const int end = std::min(begin + chunk_size, num_items);
+    thread_pool_->AddTask([&func, begin, end]() { func(begin, end); });
+  }
+  thread_pool_->Wait();
+}
+
+void RotationEstimator::SetupNormalEquations() {
+  if (!normal_equations_.IsSetup()) {
+    normal_equations_.Setup(sparse_matrix_);
+  }
+  if (llt_ == nullptr) {
+    llt_ = std::make_unique<
+        Eigen::CholmodSupernodalLLT<Eigen::SparseMatrix<double>>>();
+    llt_->analyzePattern(normal_equations_.Matrix());
+  }
+}
+
+std::vector<int> RotationEstimator::ParameterBlockSizes() const {
+  std::vector<int> block_starts;
+  block_starts.reserve(frame_id_to_idx_.size() + camera_id_to_idx_.size() + 1);
+  for (const auto& [frame_id, idx] : frame_id_to_idx_) {
+    block_starts.push_back(idx);
+  }
+  for (const auto& [camera_id, idx] : camera_id_to_idx_) {
+    block_starts.push_back(idx);
+  }
+  block_starts.push_back(sparse_matrix_.cols());
+  std::sort(block_starts.begin(), block_starts.end());
+
+  std::vector<int> block_sizes(block_starts.size() - 1);
+  for (size_t i = 0; i < block_sizes.size(); i++) {
+    block_sizes[i] = block_starts[i + 1] - block_starts[i];
+  }
+  return block_sizes;
+}
+
 void RotationEstimator::InitializeFromMaximumSpanningTree(
     const ViewGraph& view_graph,
     std::unordered_map<rig_t, Rig>& rigs,
@@ -89,7 +222,12 @@ void RotationEstimator::InitializeFromMaximumSpanningTree(
   // Here, we assume that largest connected component is already retrieved, so
   // we do not need to do that again compute maximum spanning tree.
   std::unordered_map<image_t, image_t> parents;
-  image_t root = MaximumSpanningTree(view_graph, images, parents, INLIER_NUM);
+  image_t root = MaximumSpanningTree(
+      tree_view_graph_ != nullptr ? *tree_view_graph_ : view_graph,
+      images,
+      parents,
+      INLIER_NUM,
+      options_.num_threads);
 
   // Iterate through the tree to initialize the rotation
   // Establish child info
@@ -255,13 +393,25 @@ void RotationEstimator::SetupLinearSystem(
 
   rotation_estimated_.conservativeResize(num_dof);
 
+  // Iterate over the valid pairs in the order of their ids, so that the rows
+  // of the linear system do not depend on the order of the hash map
+  std::vector<const ImagePair*> valid_pairs;
+  valid_pairs.reserve(view_graph.image_pairs.size());
+  for (const auto& [pair_id, image_pair] : view_graph.image_pairs) {
+    if (image_pair.is_valid) valid_pairs.push_back(&image_pair);
+  }
+  std::sort(valid_pairs.begin(),
+            valid_pairs.end(),
+            [](const ImagePair* pair1, const ImagePair* pair2) {
+              return pair1->pair_id < pair2->pair_id;
+            });
+
   // Prepare the relative information
   int counter = 0;
-  for (auto& [pair_id, image_pair] : view_graph.image_pairs) {
-    if (!image_pair.is_valid) continue;
-
-    image_t image_id1 = image_pair.image_id1;
-    image_t image_id2 = image_pair.image_id2;
+  for (const ImagePair* image_pair : valid_pairs) {
+    const image_pair_t pair_id = image_pair->pair_id;
+    image_t image_id1 = image_pair->image_id1;
+    image_t image_id2 = image_pair->image_id2;
 
     camera_t camera_id1 = images[image_id1].camera_id;
     camera_t camera_id2 = images[image_id2].camera_id;
@@ -302,7 +452,7 @@ void RotationEstimator::SetupLinearSystem(
 
     rel_temp_info_[pair_id].R_rel =
         (cam2_from_rig2.rotation.inverse() *
-         image_pair.cam2_from_cam1.rotation * cam1_from_rig1.rotation)
+         image_pair->cam2_from_cam1.rotation * cam1_from_rig1.rotation)
             .toRotationMatrix();
 
     // Align the relative rotation to the gravity
@@ -346,12 +496,12 @@ void RotationEstimator::SetupLinearSystem(
   size_t curr_pos = 0;
   std::vector<double> weights;
   weights.reserve(3 * view_graph.image_pairs.size());
-  for (const auto& [pair_id, image_pair] : view_graph.image_pairs) {
-    if (!image_pair.is_valid) continue;
+  for (const ImagePair* image_pair : valid_pairs) {
+    const image_pair_t pair_id = image_pair->pair_id;
     if (rel_temp_info_.find(pair_id) == rel_temp_info_.end()) continue;
 
-    image_t image_id1 = image_pair.image_id1;
-    image_t image_id2 = image_pair.image_id2;
+    image_t image_id1 = image_pair->image_id1;
+    image_t image_id2 = image_pair->image_id2;
 
     camera_t camera_id1 = images[image_id1].camera_id;
     camera_t camera_id2 = images[image_id2].camera_id;
@@ -384,8 +534,8 @@ void RotationEstimator::SetupLinearSystem(
     if (rel_temp_info_[pair_id].has_gravity) {
       coeffs.emplace_back(Eigen::Triplet<double>(curr_pos, vector_idx1, -1));
       coeffs.emplace_back(Eigen::Triplet<double>(curr_pos, vector_idx2, 1));
-      if (image_pair.weight >= 0)
-        weights.emplace_back(image_pair.weight);
+      if (image_pair->weight >= 0)
+        weights.emplace_back(image_pair->weight);
       else
         weights.emplace_back(1);
       curr_pos++;
@@ -411,8 +561,8 @@ void RotationEstimator::SetupLinearSystem(
         coeffs.emplace_back(
             Eigen::Triplet<double>(curr_pos + 1, vector_idx2, 1));
       for (int i = 0; i < 3; i++) {
-        if (image_pair.weight >= 0)
-          weights.emplace_back(image_pair.weight);
+        if (image_pair->weight >= 0)
+          weights.emplace_back(image_pair->weight);
         else
           weights.emplace_back(1);
       }
@@ -479,13 +629,30 @@ bool RotationEstimator::SolveL1Regression(
     std::unordered_map<image_t, Image>& images) {
   L1SolverOptions opt_l1_solver;
   opt_l1_solver.max_num_iterations = 10;
-
-  L1Solver<Eigen::SparseMatrix<double>> l1_solver(
-      opt_l1_solver, weights_.matrix().asDiagonal() * sparse_matrix_);
+  opt_l1_solver.use_pcg =
+      options_.linear_solver_type == RotationEstimatorOptions::PCG;
+  opt_l1_solver.pcg_options = options_.pcg_options;
+
+  const Eigen::SparseMatrix<double> weighted_matrix =
+      weights_.matrix().asDiagonal() * sparse_matrix_;
+  std::unique_ptr<L1Solver<Eigen::SparseMatrix<double>>> l1_solver;
+  if (opt_l1_solver.use_pcg) {
+    l1_solver = std::make_unique<L1Solver<Eigen::SparseMatrix<double>>>(
+        opt_l1_solver, weighted_matrix, ParameterBlockSizes());
+  } else {
+    // Factorize through the normal equations of IRLS, so that the symbolic
+    // analysis is shared by both stages
+    SetupNormalEquations();
+    normal_equations_.Assemble(weights_.square());
+    llt_->factorize(normal_equations_.Matrix());
+    l1_solver = std::make_unique<L1Solver<Eigen::SparseMatrix<double>>>(
+        opt_l1_solver, weighted_matrix, llt_.get());
+  }
+  int num_admm_iterations = 0;
   double last_norm = 0;
   double curr_norm = 0;
 
-  ComputeResiduals(view_graph, images);
+  ComputeResiduals();
   VLOG(2) << "ComputeResiduals done";
 
   int iteration = 0;
@@ -496,8 +663,15 @@ bool RotationEstimator::SolveL1Regression(
     // use the current residual as b (Ax - b)
 
     tangent_space_step_.setZero();
-    l1_solver.Solve(weights_.matrix().asDiagonal() * tangent_space_residual_,
-                    &tangent_space_step_);
+    l1_solver->Solve(weights_.matrix().asDiagonal() * tangent_space_residual_,
+                     &tangent_space_step_);
+    const L1SolverSummary& summary = l1_solver->Summary();
+    num_admm_iterations += summary.num_iterations;
+    VLOG(2) << "ADMM iterations: " << summary.num_iterations
+            << ", converged: " << summary.converged
+            << ", primal residual: " << summary.primal_residual
+            << ", dual residual: " << summary.dual_residual
+            << ", rho: " << summary.rho;
     if (tangent_space_step_.array().isNaN().any()) {
       LOG(ERROR) << "nan error";
       iteration++;
@@ -513,12 +687,12 @@ bool RotationEstimator::SolveL1Regression(
                        .sum();
 
     curr_norm = tangent_space_step_.norm();
-    UpdateGlobalRotations(view_graph, frames, images);
-    ComputeResiduals(view_graph, images);
+    UpdateGlobalRotations();
+    ComputeResiduals();
 
     // Check the residual. If it is small, stop
     // TODO: strange bug for the L1 solver: update norm state constant
-    if (ComputeAverageStepSize(frames) <
+    if (ComputeAverageStepSize() <
             options_.l1_step_convergence_threshold ||
         std::abs(last_norm - curr_norm) < EPS) {
       if (std::abs(last_norm - curr_norm) < EPS)
@@ -529,150 +703,267 @@ bool RotationEstimator::SolveL1Regression(
     opt_l1_solver.max_num_iterations =
         std::min(opt_l1_solver.max_num_iterations * 2, 100);
   }
-  VLOG(2) << "L1 ADMM total iteration: " << iteration;
+  VLOG(2) << "L1 ADMM total iteration: " << iteration
+          << ", inner iterations: " << num_admm_iterations;
   return true;
 }
 
 bool RotationEstimator::SolveIRLS(const ViewGraph& view_graph,
                                   std::unordered_map<frame_t, Frame>& frames,
                                   std::unordered_map<image_t, Image>& images) {
-  // TODO: Determine what is the best solver for this part
-  Eigen::CholmodSupernodalLLT<Eigen::SparseMatrix<double>> llt;
-
-  llt.analyzePattern(sparse_matrix_.transpose() * sparse_matrix_);
+  // The rows of masked pairs are kept in the system, so the pattern of a
+  // reused system is unchanged and so is its symbolic analysis
+  std::unique_ptr<PcgSolver> pcg_solver;
+  if (options_.linear_solver_type == RotationEstimatorOptions::PCG) {
+    pcg_solver = std::make_unique<PcgSolver>(
+        options_.pcg_options, sparse_matrix_, ParameterBlockSizes());
+    tangent_space_step_.setZero();
+  } else {
+    SetupNormalEquations();
+  }
 
   const double sigma = DegToRad(options_.irls_loss_parameter_sigma);
   VLOG(2) << "sigma: " << options_.irls_loss_parameter_sigma;
 
-  Eigen::ArrayXd weights_irls(sparse_matrix_.rows());
-  Eigen::SparseMatrix<double> at_weight;
+  Eigen::ArrayXd weights_irls = Eigen::ArrayXd::Ones(sparse_matrix_.rows());
+  Eigen::ArrayXd row_weights;
 
   if (options_.use_gravity && images[fixed_camera_id_].HasGravity())
     weights_irls[sparse_matrix_.rows() - 1] = 1;
   else
     weights_irls.segment(sparse_matrix_.rows() - 3, 3).setConstant(1);
 
-  ComputeResiduals(view_graph, images);
+  ComputeResiduals();
+  colmap::Timer timer;
+  double assembly_seconds = 0;
+  double solve_seconds = 0;
+  double update_seconds = 0;
   int iteration = 0;
   for (iteration = 0; iteration < options_.max_num_irls_iterations;
        iteration++) {
     VLOG(2) << "IRLS iteration: " << iteration;
+    timer.Restart();
 
     // Compute the weights for IRLS
-    for (auto& [pair_id, pair_info] : rel_temp_info_) {
-      image_pair_t image_pair_pos = pair_info.index;
-      double err_squared = 0;
-      double w = 0;
-      // If both cameras have gravity, then we only consider the y-axis
-      if (pair_info.has_gravity)
-        err_squared = std::pow(tangent_space_residual_[image_pair_pos], 2) +
-                      pair_info.xz_error;
-      // Otherwise, we consider all 3 dof
-      else
-        err_squared =
-            tangent_space_residual_.segment<3>(image_pair_pos).squaredNorm();
-
-      // Compute the weight
-      if (options_.weight_type == RotationEstimatorOptions::GEMAN_MCCLURE) {
-        double tmp = err_squared + sigma * sigma;
-        w = sigma * sigma / (tmp * tmp);
-      } else if (options_.weight_type == RotationEstimatorOptions::HALF_NORM) {
-        w = std::pow(err_squared, (0.5 - 2) / 2);
-      }
+    std::atomic<bool> has_nan_weight(false);
+    ParallelFor(pair_blocks_.size(), [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        const PairBlock& block = pair_blocks_[i];
+        const int num_rows = block.has_gravity ? 1 : 3;
+        // Masked pairs do not contribute to the system
+        if (weights_[block.row] == 0) {
+          weights_irls.segment(block.row, num_rows).setZero();
+          continue;
+        }
+        double err_squared = 0;
+        double w = 0;
+        // If both cameras have gravity, then we only consider the y-axis
+        if (block.has_gravity)
+          err_squared = std::pow(tangent_space_residual_[block.row], 2) +
+                        block.xz_error;
+        // Otherwise, we consider all 3 dof
+        else
+          err_squared =
+              tangent_space_residual_.segment<3>(block.row).squaredNorm();
+
+        // Compute the weight
+        if (options_.weight_type == RotationEstimatorOptions::GEMAN_MCCLURE) {
+          double tmp = err_squared + sigma * sigma;
+          w = sigma * sigma / (tmp * tmp);
+        } else if (options_.weight_type ==
+                   RotationEstimatorOptions::HALF_NORM) {
+          w = std::pow(err_squared, (0.5 - 2) / 2);
+        }
 
-      if (std::isnan(w)) {
-        LOG(ERROR) << "nan weight!";
-        return false;
-      }
+        if (std::isnan(w)) {
+          has_nan_weight = true;
+          continue;
+        }
 
-      // If both cameras have gravity, then only 1 equation
-      if (pair_info.has_gravity) weights_irls[image_pair_pos] = w;
-      // Otherwise, 3 equations
-      else
-        weights_irls.segment<3>(image_pair_pos).setConstant(w);
+        // If both cameras have gravity, then only 1 equation, otherwise 3
+        weights_irls.segment(block.row, num_rows).setConstant(w);
+      }
+    });
+    if (has_nan_weight) {
+      LOG(ERROR) << "nan weight!";
+      return false;
     }
 
-    // Update the factorization for the weighted values.
-    at_weight = sparse_matrix_.transpose() *
-                weights_irls.matrix().asDiagonal() *
-                weights_.matrix().asDiagonal();
-
-    llt.factorize(at_weight * sparse_matrix_);
+    // Update the factorization (or the preconditioner) for the weighted
+    // values.
+    row_weights = weights_irls * weights_;
+    if (pcg_solver != nullptr) {
+      pcg_solver->SetRowWeights(row_weights);
+    } else {
+      normal_equations_.Assemble(row_weights);
+    }
+    const double assembly_time = timer.ElapsedSeconds();
 
     // Solve the least squares problem..
-    tangent_space_step_.setZero();
-    tangent_space_step_ = llt.solve(at_weight * tangent_space_residual_);
-    UpdateGlobalRotations(view_graph, frames, images);
-    ComputeResiduals(view_graph, images);
+    const Eigen::VectorXd rhs =
+        sparse_matrix_.transpose() *
+        (row_weights * tangent_space_residual_.array()).matrix();
+    if (pcg_solver != nullptr) {
+      // Start from the step of the previous iteration
+      pcg_solver->Solve(rhs, tangent_space_step_);
+      VLOG(2) << "PCG iterations: " << pcg_solver->NumIterations();
+    } else {
+      llt_->factorize(normal_equations_.Matrix());
+      tangent_space_step_.setZero();
+      tangent_space_step_ = llt_->solve(rhs);
+    }
+    const double solve_time = timer.ElapsedSeconds() - assembly_time;
+    UpdateGlobalRotations();
+    ComputeResiduals();
+    const double update_time =
+        timer.ElapsedSeconds() - assembly_time - solve_time;
+
+    VLOG(2) << "IRLS iteration " << iteration << " took "
+            << assembly_time + solve_time + update_time
+            << "s (assembly: " << assembly_time
+            << "s, solve: " << solve_time << "s, update: " << update_time
+            << "s)";
+    assembly_seconds += assembly_time;
+    solve_seconds += solve_time;
+    update_seconds += update_time;
 
     // Check the residual. If it is small, stop
-    if (ComputeAverageStepSize(frames) <
+    if (ComputeAverageStepSize() <
         options_.irls_step_convergence_threshold) {
       iteration++;
       break;
     }
   }
   VLOG(2) << "IRLS total iteration: " << iteration;
+  VLOG(1) << "IRLS assembly: " << assembly_seconds
+          << "s, solve: " << solve_seconds << "s, update: " << update_seconds
+          << "s";
 
   return true;
 }
 
-void RotationEstimator::UpdateGlobalRotations(
+void RotationEstimator::SetupBlocks(
     const ViewGraph& view_graph,
-    std::unordered_map<frame_t, Frame>& frames,
-    std::unordered_map<image_t, Image>& images) {
-  for (auto& [frame_id, frame] : frames) {
-    if (frames[frame_id].is_registered == false) continue;
-    image_t vector_idx = frame_id_to_idx_[frame_id];
-    if (!(options_.use_gravity && frame.HasGravity())) {
-      Eigen::Matrix3d R_ori =
-          AngleAxisToRotation(rotation_estimated_.segment(vector_idx, 3));
-
-      rotation_estimated_.segment(vector_idx, 3) = RotationToAngleAxis(
-          R_ori *
-          AngleAxisToRotation(-tangent_space_step_.segment(vector_idx, 3)));
-    } else {
-      rotation_estimated_[vector_idx] -= tangent_space_step_[vector_idx];
-    }
+    const std::unordered_map<frame_t, Frame>& frames,
+    const std::unordered_map<image_t, Image>& images) {
+  const auto is_1dof = [this](const Image& image) {
+    return options_.use_gravity && image.HasGravity();
+  };
+
+  // Frames, in the order of the columns
+  frame_blocks_.clear();
+  frame_blocks_.reserve(frame_id_to_idx_.size());
+  for (const auto& [frame_id, idx] : frame_id_to_idx_) {
+    const Frame& frame = frames.at(frame_id);
+    frame_blocks_.push_back({idx, options_.use_gravity && frame.HasGravity()});
+  }
+  std::sort(frame_blocks_.begin(),
+            frame_blocks_.end(),
+            [](const FrameBlock& block1, const FrameBlock& block2) {
+              return block1.idx < block2.idx;
+            });
+  std::unordered_map<int, int> idx_to_frame_block;
+  for (size_t i = 0; i < frame_blocks_.size(); i++) {
+    idx_to_frame_block[frame_blocks_[i].idx] = i;
   }
 
-  std::unordered_map<camera_t, std::vector<Eigen::Matrix3d>> cam_from_rigs;
-  for (auto& [camera_id, camera_idx] : camera_id_to_idx_) {
-    cam_from_rigs[camera_id] = std::vector<Eigen::Matrix3d>();
+  // Estimated cameras and the frames they appear in
+  camera_blocks_.clear();
+  camera_frame_offsets_.assign(1, 0);
+  camera_frames_.clear();
+  std::unordered_map<camera_t, std::vector<int>> camera_frames;
+  for (const auto& [frame_id, idx] : frame_id_to_idx_) {
+    for (const auto& data_id : frames.at(frame_id).ImageIds()) {
+      const auto image_it = images.find(data_id.id);
+      if (image_it == images.end()) continue;
+      const camera_t camera_id = image_it->second.camera_id;
+      if (camera_id_to_idx_.find(camera_id) != camera_id_to_idx_.end()) {
+        camera_frames[camera_id].push_back(idx_to_frame_block.at(idx));
+      }
+    }
   }
-  for (auto& [frame_id, frame] : frames) {
-    if (frames.at(frame_id).is_registered == false) continue;
-    // Update the rig from world for the frame
-    Eigen::Matrix3d R_ori;
-    if (!options_.use_gravity || !frame.HasGravity()) {
-      R_ori = AngleAxisToRotation(
-          rotation_estimated_.segment(frame_id_to_idx_[frame_id], 3));
-    } else {
-      R_ori = AngleToRotUp(rotation_estimated_[frame_id_to_idx_[frame_id]]);
+  for (const auto& [camera_id, idx] : camera_id_to_idx_) {
+    camera_blocks_.push_back(idx);
+    const auto it = camera_frames.find(camera_id);
+    if (it != camera_frames.end()) {
+      camera_frames_.insert(
+          camera_frames_.end(), it->second.begin(), it->second.end());
     }
+    camera_frame_offsets_.push_back(camera_frames_.size());
+  }
 
-    // Update the cam_from_rig for the cameras in the frame
-    for (const auto& data_id : frame.ImageIds()) {
-      image_t image_id = data_id.id;
-      if (images.find(image_id) == images.end()) continue;
-      const auto& image = images.at(image_id);
-      if (camera_id_to_idx_.find(image.camera_id) != camera_id_to_idx_.end()) {
-        cam_from_rigs[image.camera_id].push_back(R_ori);
+  // Pairs, in the order of the rows
+  pair_blocks_.clear();
+  pair_blocks_.reserve(rel_temp_info_.size());
+  for (const auto& [pair_id, pair_info] : rel_temp_info_) {
+    const ImagePair& image_pair = view_graph.image_pairs.at(pair_id);
+    PairBlock block;
+    block.R_rel = pair_info.R_rel;
+    block.angle_rel = pair_info.angle_rel;
+    block.xz_error = pair_info.xz_error;
+    block.row = pair_info.index;
+    block.idx1 = image_id_to_idx_.at(image_pair.image_id1);
+    block.idx2 = image_id_to_idx_.at(image_pair.image_id2);
+    block.idx_cam1 = pair_info.idx_cam1;
+    block.idx_cam2 = pair_info.idx_cam2;
+    block.has_gravity = pair_info.has_gravity;
+    block.is_1dof1 = is_1dof(images.at(image_pair.image_id1));
+    block.is_1dof2 = is_1dof(images.at(image_pair.image_id2));
+    pair_blocks_.push_back(block);
+  }
+  std::sort(pair_blocks_.begin(),
+            pair_blocks_.end(),
+            [](const PairBlock& block1, const PairBlock& block2) {
+              return block1.row < block2.row;
+            });
+
+  const auto fixed_it = image_id_to_idx_.find(fixed_camera_id_);
+  fixed_idx_ = fixed_it == image_id_to_idx_.end() ? 0 : fixed_it->second;
+  fixed_is_1dof_ = fixed_it != image_id_to_idx_.end() &&
+                   is_1dof(images.at(fixed_camera_id_));
+}
+
+void RotationEstimator::UpdateGlobalRotations() {
+  ParallelFor(frame_blocks_.size(), [this](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      const int vector_idx = frame_blocks_[i].idx;
+      if (!frame_blocks_[i].is_1dof) {
+        Eigen::Matrix3d R_ori =
+            AngleAxisToRotation(rotation_estimated_.segment(vector_idx, 3));
+
+        rotation_estimated_.segment(vector_idx, 3) = RotationToAngleAxis(
+            R_ori *
+            AngleAxisToRotation(-tangent_space_step_.segment(vector_idx, 3)));
+      } else {
+        rotation_estimated_[vector_idx] -= tangent_space_step_[vector_idx];
       }
     }
-  }
+  });
 
   // Update the global rotations for cam_from_rig cameras
   // Note: the update is non trivial, and we need to average the rotations from
   // all the frames
-  for (auto& [camera_id, camera_idx] : camera_id_to_idx_) {
+  for (size_t i = 0; i < camera_blocks_.size(); i++) {
+    const int camera_idx = camera_blocks_[i];
     Eigen::Matrix3d R_ori =
         AngleAxisToRotation(rotation_estimated_.segment(camera_idx, 3));
 
     std::vector<Eigen::Quaterniond> rig_rotations;
+    rig_rotations.reserve(camera_frame_offsets_[i + 1] -
+                          camera_frame_offsets_[i]);
     Eigen::Matrix3d R_update =
         AngleAxisToRotation(-tangent_space_step_.segment(camera_idx, 3));
-    for (const auto& R : cam_from_rigs[camera_id]) {
+    for (int k = camera_frame_offsets_[i]; k < camera_frame_offsets_[i + 1];
+         k++) {
+      // The updated rig from world of the frame
+      const FrameBlock& frame_block = frame_blocks_[camera_frames_[k]];
+      Eigen::Matrix3d R;
+      if (!frame_block.is_1dof) {
+        R = AngleAxisToRotation(
+            rotation_estimated_.segment(frame_block.idx, 3));
+      } else {
+        R = AngleToRotUp(rotation_estimated_[frame_block.idx]);
+      }
       // Update the rotation for the camera
       rig_rotations.push_back(
           Eigen::Quaterniond(R_ori * R * R_update * R.transpose()));
@@ -686,82 +977,79 @@ void RotationEstimator::UpdateGlobalRotations(
   }
 }
 
-void RotationEstimator::ComputeResiduals(
-    const ViewGraph& view_graph, std::unordered_map<image_t, Image>& images) {
-  int curr_pos = 0;
-  for (auto& [pair_id, pair_info] : rel_temp_info_) {
-    image_t image_id1 = view_graph.image_pairs.at(pair_id).image_id1;
-    image_t image_id2 = view_graph.image_pairs.at(pair_id).image_id2;
-
-    int idx1 = image_id_to_idx_[image_id1];
-    int idx2 = image_id_to_idx_[image_id2];
-
-    int idx_cam1 = pair_info.idx_cam1;
-    int idx_cam2 = pair_info.idx_cam2;
+void RotationEstimator::ComputeResiduals() {
+  ParallelFor(pair_blocks_.size(), [this](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      const PairBlock& block = pair_blocks_[i];
+      if (block.has_gravity) {
+        tangent_space_residual_[block.row] =
+            RelAngleError(block.angle_rel,
+                          rotation_estimated_[block.idx1],
+                          rotation_estimated_[block.idx2],
+                          /*seed=*/i + 1);
+        continue;
+      }
 
-    if (pair_info.has_gravity) {
-      tangent_space_residual_[pair_info.index] =
-          (RelAngleError(pair_info.angle_rel,
-                         rotation_estimated_[image_id_to_idx_[image_id1]],
-                         rotation_estimated_[image_id_to_idx_[image_id2]]));
-    } else {
       Eigen::Matrix3d R_1, R_2;
-      if (options_.use_gravity && images[image_id1].HasGravity()) {
-        R_1 = AngleToRotUp(rotation_estimated_[image_id_to_idx_[image_id1]]);
+      if (block.is_1dof1) {
+        R_1 = AngleToRotUp(rotation_estimated_[block.idx1]);
       } else {
-        R_1 = AngleAxisToRotation(
-            rotation_estimated_.segment(image_id_to_idx_[image_id1], 3));
+        R_1 = AngleAxisToRotation(rotation_estimated_.segment(block.idx1, 3));
       }
 
-      if (options_.use_gravity && images[image_id2].HasGravity()) {
-        R_2 = AngleToRotUp(rotation_estimated_[image_id_to_idx_[image_id2]]);
+      if (block.is_1dof2) {
+        R_2 = AngleToRotUp(rotation_estimated_[block.idx2]);
       } else {
-        R_2 = AngleAxisToRotation(
-            rotation_estimated_.segment(image_id_to_idx_[image_id2], 3));
+        R_2 = AngleAxisToRotation(rotation_estimated_.segment(block.idx2, 3));
       }
 
-      if (idx_cam1 != -1) {
+      if (block.idx_cam1 != -1) {
         // If the camera is not part of a rig, then we can use the first image
         // to initialize the rotation
-        R_1 =
-            AngleAxisToRotation(rotation_estimated_.segment(idx_cam1, 3)) * R_1;
+        R_1 = AngleAxisToRotation(
+                  rotation_estimated_.segment(block.idx_cam1, 3)) *
+              R_1;
       }
-      if (idx_cam2 != -1) {
-        R_2 =
-            AngleAxisToRotation(rotation_estimated_.segment(idx_cam2, 3)) * R_2;
+      if (block.idx_cam2 != -1) {
+        R_2 = AngleAxisToRotation(
+                  rotation_estimated_.segment(block.idx_cam2, 3)) *
+              R_2;
       }
 
-      tangent_space_residual_.segment(pair_info.index, 3) =
-          -RotationToAngleAxis(R_2.transpose() * pair_info.R_rel * R_1);
+      tangent_space_residual_.segment<3>(block.row) =
+          -RotationToAngleAxis(R_2.transpose() * block.R_rel * R_1);
     }
-  }
+  });
 
-  if (options_.use_gravity && images[fixed_camera_id_].HasGravity())
+  if (fixed_is_1dof_)
     tangent_space_residual_[tangent_space_residual_.size() - 1] =
-        rotation_estimated_[image_id_to_idx_[fixed_camera_id_]] -
-        fixed_camera_rotation_[1];
+        rotation_estimated_[fixed_idx_] - fixed_camera_rotation_[1];
   else
     tangent_space_residual_.segment(tangent_space_residual_.size() - 3, 3) =
         RotationToAngleAxis(
             AngleAxisToRotation(fixed_camera_rotation_).transpose() *
-            AngleAxisToRotation(rotation_estimated_.segment(
-                image_id_to_idx_[fixed_camera_id_], 3)));
+            AngleAxisToRotation(rotation_estimated_.segment(fixed_idx_, 3)));
 }
 
-double RotationEstimator::ComputeAverageStepSize(
-    const std::unordered_map<frame_t, Frame>& frames) {
-  double total_update = 0;
-  for (const auto& [frame_id, frame] : frames) {
-    if (frames.at(frame_id).is_registered) continue;
+double RotationEstimator::ComputeAverageStepSize() {
+  if (frame_blocks_.empty()) return 0;
 
-    if (options_.use_gravity && frame.HasGravity()) {
-      total_update += std::abs(tangent_space_step_[frame_id_to_idx_[frame_id]]);
-    } else {
-      total_update +=
-          tangent_space_step_.segment(frame_id_to_idx_[frame_id], 3).norm();
+  std::mutex mutex;
+  double total_update = 0;
+  ParallelFor(frame_blocks_.size(), [&](int begin, int end) {
+    double update = 0;
+    for (int i = begin; i < end; i++) {
+      const FrameBlock& block = frame_blocks_[i];
+      if (block.is_1dof) {
+        update += std::abs(tangent_space_step_[block.idx]);
+      } else {
+        update += tangent_space_step_.segment<3>(block.idx).norm();
+      }
     }
-  }
-  return total_update / frame_id_to_idx_.size();
+    std::lock_guard<std::mutex> lock(mutex);
+    total_update += update;
+  });
+  return total_update / frame_blocks_.size();
 }
 
 void RotationEstimator::ConvertResults(
@@ -1,12 +1,19 @@
 #pragma once
 
 #include "glomap/math/l1_solver.h"
+#include "glomap/math/normal_equations.h"
+#include "glomap/math/pcg_solver.h"
 #include "glomap/scene/types_sfm.h"
 #include "glomap/types.h"
 
+#include <colmap/util/threading.h>
+
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <Eigen/CholmodSupport>
+
 // Code is adapted from Theia's RobustRotationEstimator
 // (http://www.theia-sfm.org/). For gravity aligned rotation averaging, refere
 // to the paper "Gravity Aligned Rotation Averaging"
@@ -63,6 +70,22 @@ struct RotationEstimatorOptions {
     HALF_NORM,
   } weight_type = GEMAN_MCCLURE;
 
+  enum LinearSolverType {
+    // Supernodal Cholesky factorization of the normal equations
+    SPARSE_CHOLESKY,
+    // Preconditioned conjugate gradients without forming the normal
+    // equations, for view graphs where the fill-in of the factorization does
+    // not fit in memory
+    PCG,
+  } linear_solver_type = SPARSE_CHOLESKY;
+
+  // Options for the PCG linear solver
+  PcgSolverOptions pcg_options;
+
+  // Number of threads of the kernels and of the maximum spanning tree, -1 for
+  // all cores. The PCG solver has its own number of threads in pcg_options.
+  int num_threads = -1;
+
   // Flg to use maximum spanning tree for initialization
   bool skip_initialization = false;
 
@@ -71,6 +94,35 @@ struct RotationEstimatorOptions {
 
   // Flag to use gravity for rotation averaging
   bool use_gravity = false;
+
+  // Flag to let the later passes of a run start from the state of the
+  // previous pass, see RotationEstimatorState
+  bool use_incremental_passes = true;
+};
+
+// Linear system and solution of a rotation averaging pass. Given to the next
+// pass over the same reconstruction, that pass starts from the previous
+// solution and skips the initialization and the L1 stage. If the registered
+// frames did not change, it also keeps the linear system and its symbolic
+// factorization, and only masks the rows of the pairs that became invalid.
+struct RotationEstimatorState {
+  bool IsSet() const { return !frame_ids.empty(); }
+
+  // Registered frames of the pass, sorted
+  std::vector<frame_t> frame_ids;
+
+  Eigen::SparseMatrix<double> sparse_matrix;
+  Eigen::ArrayXd weights;
+  Eigen::VectorXd rotation_estimated;
+  std::unordered_map<image_t, int> image_id_to_idx;
+  std::unordered_map<frame_t, int> frame_id_to_idx;
+  std::unordered_map<camera_t, int> camera_id_to_idx;
+  std::unordered_map<image_pair_t, ImagePairTempInfo> rel_temp_info;
+  image_t fixed_camera_id = -1;
+  Eigen::Vector3d fixed_camera_rotation;
+  NormalEquations normal_equations;
+  std::unique_ptr<Eigen::CholmodSupernodalLLT<Eigen::SparseMatrix<double>>>
+      llt;
 };
 
 class RotationEstimator {
@@ -80,10 +132,21 @@ class RotationEstimator {
 
   // Estimates the global orientations of all views based on an initial
   // guess. Returns true on successful estimation and false otherwise.
+  // If state is given, the estimation starts from it when it is set, and the
+  // state of this estimation is stored in it afterwards.
   bool EstimateRotations(const ViewGraph& view_graph,
                          std::unordered_map<rig_t, Rig>& rigs,
                          std::unordered_map<frame_t, Frame>& frames,
-                         std::unordered_map<image_t, Image>& images);
+                         std::unordered_map<image_t, Image>& images,
+                         RotationEstimatorState* state = nullptr);
+
+  // Weight the maximum spanning tree of the initialization with the inliers of
+  // the pairs of this view graph instead of the estimated one. It has to
+  // contain the valid pairs of the estimated view graph, which can then be a
+  // copy without the inliers.
+  void SetTreeViewGraph(const ViewGraph* view_graph) {
+    tree_view_graph_ = view_graph;
+  }
 
  protected:
   // Initialize the rotation from the maximum spanning tree
@@ -102,6 +165,21 @@ class RotationEstimator {
                          std::unordered_map<frame_t, Frame>& frames,
                          std::unordered_map<image_t, Image>& images);
 
+  // Zero the weights of the rows of the pairs that are no longer valid, so
+  // that the sparsity pattern of the system is kept
+  void MaskInvalidPairs(const ViewGraph& view_graph);
+
+  // Exchange the linear system and the solution with the state
+  void SwapState(RotationEstimatorState& state);
+
+  // Set up the assembly of the normal equations and their symbolic
+  // factorization, unless already done for the current system
+  void SetupNormalEquations();
+
+  // Sizes of the parameter blocks (frames and cameras) in the order of the
+  // columns of the linear system
+  std::vector<int> ParameterBlockSizes() const;
+
   // Performs the L1 robust loss minimization.
   bool SolveL1Regression(const ViewGraph& view_graph,
                          std::unordered_map<frame_t, Frame>& frames,
@@ -112,21 +190,27 @@ class RotationEstimator {
                  std::unordered_map<frame_t, Frame>& frames,
                  std::unordered_map<image_t, Image>& images);
 
+  // Copy the frames, cameras and pairs of the linear system to the flat
+  // arrays used by the kernels below. Called whenever the system changes.
+  void SetupBlocks(const ViewGraph& view_graph,
+                   const std::unordered_map<frame_t, Frame>& frames,
+                   const std::unordered_map<image_t, Image>& images);
+
   // Updates the global rotations based on the current rotation change.
-  void UpdateGlobalRotations(const ViewGraph& view_graph,
-                             std::unordered_map<frame_t, Frame>& frames,
-                             std::unordered_map<image_t, Image>& images);
+  void UpdateGlobalRotations();
 
   // Computes the relative rotation (tangent space) residuals based on the
   // current global orientation estimates.
-  void ComputeResiduals(const ViewGraph& view_graph,
-                        std::unordered_map<image_t, Image>& images);
+  void ComputeResiduals();
 
   // Computes the average size of the most recent step of the algorithm.
   // The is the average over all non-fixed global_orientations_ of their
   // rotation magnitudes.
-  double ComputeAverageStepSize(
-      const std::unordered_map<frame_t, Frame>& frames);
+  double ComputeAverageStepSize();
+
+  // Run func(begin, end) over chunks of [0, num_items) on the thread pool
+  template <typename Func>
+  void ParallelFor(int num_items, const Func& func);
 
   // Converts the results from the tangent space to the global rotations and
   // updates the frames and images with the new rotations.
@@ -138,6 +222,8 @@ class RotationEstimator {
   // Options for the solver.
   const RotationEstimatorOptions& options_;
 
+  const ViewGraph* tree_view_graph_ = nullptr;
+
   // The sparse matrix used to maintain the linear system. This is matrix A in
   // Ax = b.
   Eigen::SparseMatrix<double> sparse_matrix_;
@@ -166,6 +252,44 @@ class RotationEstimator {
 
   // The weights for the edges
   Eigen::ArrayXd weights_;
+
+  // Flat copies of the frames and pairs of the linear system, so that the
+  // per-iteration kernels do not go through the hash maps
+  struct FrameBlock {
+    int idx;
+    // Only the angle around the gravity direction is estimated
+    bool is_1dof;
+  };
+  struct PairBlock {
+    Eigen::Matrix3d R_rel;
+    double angle_rel;
+    double xz_error;
+    int row;
+    int idx1;
+    int idx2;
+    int idx_cam1;
+    int idx_cam2;
+    bool has_gravity;
+    bool is_1dof1;
+    bool is_1dof2;
+  };
+  std::vector<FrameBlock> frame_blocks_;
+  std::vector<PairBlock> pair_blocks_;
+  // Indices of the estimated cameras, and for each of them the range of
+  // camera_frames_ with the frame blocks that contain the camera
+  std::vector<int> camera_blocks_;
+  std::vector<int> camera_frame_offsets_;
+  std::vector<int> camera_frames_;
+  int fixed_idx_ = 0;
+  bool fixed_is_1dof_ = false;
+
+  std::unique_ptr<colmap::ThreadPool> thread_pool_;
+
+  // The IRLS normal equations and their factorization. Both the assembly plan
+  // and the symbolic analysis are done once per sparsity pattern.
+  NormalEquations normal_equations_;
+  std::unique_ptr<Eigen::CholmodSupernodalLLT<Eigen::SparseMatrix<double>>>
+      llt_;
 };
 
 }  // namespace glomap
@@ -1,125 +1,245 @@
 #include "glomap/estimators/relpose_estimation.h"
 
-#include <colmap/util/threading.h>
+#include "glomap/controllers/work_stealing.h"
+#include "glomap/io/relpose_cache.h"
+#include "glomap/math/hash.h"
+
+#include <colmap/util/logging.h>
+
+#include <atomic>
+#include <mutex>
+#include <numeric>
 
 #include <PoseLib/robust.h>
 
 namespace glomap {
 
+namespace {
+
+// Hash of the inputs of the estimation of a pair
+uint64_t HashInputs(const std::vector<Eigen::Vector2d>& points2D_1,
+                    const std::vector<Eigen::Vector2d>& points2D_2,
+                    const Camera& camera1,
+                    const Camera& camera2,
+                    const RelativePoseEstimationOptions& options) {
+  Fnv1aHasher hasher;
+  for (const Camera* camera : {&camera1, &camera2}) {
+    hasher.Add(static_cast<int>(camera->model_id));
+    hasher.Add(camera->width);
+    hasher.Add(camera->height);
+    hasher.AddBytes(camera->params.data(),
+                    camera->params.size() * sizeof(double));
+  }
+  hasher.Add(options.ransac_options.max_iterations);
+  hasher.Add(options.ransac_options.min_iterations);
+  hasher.Add(options.ransac_options.success_prob);
+  hasher.Add(options.ransac_options.max_epipolar_error);
+  hasher.Add(options.ransac_options.seed);
+  hasher.Add(options.bundle_options.max_iterations);
+  hasher.Add(options.bundle_options.loss_scale);
+  hasher.Add(points2D_1.size());
+  hasher.AddBytes(points2D_1.data(),
+                  points2D_1.size() * sizeof(Eigen::Vector2d));
+  hasher.AddBytes(points2D_2.data(),
+                  points2D_2.size() * sizeof(Eigen::Vector2d));
+  return hasher.Hash();
+}
+
+// Estimate the relative pose of the pair with RANSAC, the pair is invalidated
+// if the estimation fails. The outcome is stored in result. If the cache holds
+// a result for the same inputs, it is used instead and true is returned.
+bool EstimateRelativePose(ImagePair& image_pair,
+                          const std::unordered_map<camera_t, Camera>& cameras,
+                          const std::unordered_map<image_t, Image>& images,
+                          const RelativePoseEstimationOptions& options,
+                          const RelativePoseCache* cache,
+                          RelativePoseCache::Entry& result) {
+  // Define as thread-local to reuse memory allocation in different tasks.
+  thread_local std::vector<Eigen::Vector2d> points2D_1;
+  thread_local std::vector<Eigen::Vector2d> points2D_2;
+  thread_local std::vector<char> inliers;
+
+  const Image& image1 = images.at(image_pair.image_id1);
+  const Image& image2 = images.at(image_pair.image_id2);
+  const Eigen::MatrixXi& matches = image_pair.matches;
+
+  const Camera& camera1 = cameras.at(image1.camera_id);
+  const Camera& camera2 = cameras.at(image2.camera_id);
+  poselib::Camera camera_poselib1 = ColmapCameraToPoseLibCamera(camera1);
+  poselib::Camera camera_poselib2 = ColmapCameraToPoseLibCamera(camera2);
+  bool valid_camera_model =
+      (camera_poselib1.model_id >= 0 && camera_poselib2.model_id >= 0);
+
+  // Collect the original 2D points
+  points2D_1.clear();
+  points2D_2.clear();
+  for (size_t idx = 0; idx < matches.rows(); idx++) {
+    points2D_1.push_back(image1.features[matches(idx, 0)]);
+    points2D_2.push_back(image2.features[matches(idx, 1)]);
+  }
+
+  // Reuse the result of an earlier run on the same inputs
+  if (cache != nullptr) {
+    result.input_hash =
+        HashInputs(points2D_1, points2D_2, camera1, camera2, options);
+    const RelativePoseCache::Entry* entry =
+        cache->Find(image_pair.pair_id, result.input_hash);
+    if (entry != nullptr) {
+      result = *entry;
+      if (entry->success) {
+        image_pair.cam2_from_cam1 = entry->cam2_from_cam1;
+      } else {
+        image_pair.is_valid = false;
+      }
+      return true;
+    }
+  }
+
+  // If the camera model is not supported by poselib
+  if (!valid_camera_model) {
+    // Undistort points
+    // Note that here, we still rescale by the focal length (to avoid
+    // change the RANSAC threshold)
+    Eigen::Matrix2d K1_new = Eigen::Matrix2d::Zero();
+    Eigen::Matrix2d K2_new = Eigen::Matrix2d::Zero();
+    K1_new(0, 0) = camera1.FocalLengthX();
+    K1_new(1, 1) = camera1.FocalLengthY();
+    K2_new(0, 0) = camera2.FocalLengthX();
+    K2_new(1, 1) = camera2.FocalLengthY();
+    for (size_t idx = 0; idx < matches.rows(); idx++) {
+      points2D_1[idx] = K1_new * camera1.CamFromImg(points2D_1[idx])
+                                     .value_or(Eigen::Vector2d::Zero());
+      points2D_2[idx] = K2_new * camera2.CamFromImg(points2D_2[idx])
+                                     .value_or(Eigen::Vector2d::Zero());
+    }
+
+    // Reset the camera to be the pinhole camera with original focal
+    // length and zero principal point
+    camera_poselib1 = poselib::Camera(
+        "PINHOLE",
+        {camera1.FocalLengthX(), camera1.FocalLengthY(), 0., 0.},
+        camera1.width,
+        camera1.height);
+    camera_poselib2 = poselib::Camera(
+        "PINHOLE",
+        {camera2.FocalLengthX(), camera2.FocalLengthY(), 0., 0.},
+        camera2.width,
+        camera2.height);
+  }
+  inliers.clear();
+  poselib::CameraPose pose_rel_calc;
+  try {
+    poselib::estimate_relative_pose(points2D_1,
+                                    points2D_2,
+                                    camera_poselib1,
+                                    camera_poselib2,
+                                    options.ransac_options,
+                                    options.bundle_options,
+                                    &pose_rel_calc,
+                                    &inliers);
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Error in relative pose estimation: " << e.what();
+    image_pair.is_valid = false;
+    result.success = false;
+    return false;
+  }
+
+  // Convert the relative pose to the glomap format
+  for (int i = 0; i < 4; i++) {
+    image_pair.cam2_from_cam1.rotation.coeffs()[i] =
+        pose_rel_calc.q[(i + 1) % 4];
+  }
+  image_pair.cam2_from_cam1.translation = pose_rel_calc.t;
+  result.success = true;
+  result.cam2_from_cam1 = image_pair.cam2_from_cam1;
+  return false;
+}
+
+}  // namespace
+
 void EstimateRelativePoses(ViewGraph& view_graph,
                            std::unordered_map<camera_t, Camera>& cameras,
                            std::unordered_map<image_t, Image>& images,
                            const RelativePoseEstimationOptions& options) {
-  std::vector<image_pair_t> valid_pair_ids;
+  std::vector<ImagePair*> valid_pairs;
   for (auto& [image_pair_id, image_pair] : view_graph.image_pairs) {
     if (!image_pair.is_valid) continue;
-    valid_pair_ids.push_back(image_pair_id);
+    valid_pairs.push_back(&image_pair);
   }
 
-  const int64_t num_image_pairs = valid_pair_ids.size();
-  const int64_t kNumChunks = 10;
-  const int64_t interval =
-      std::ceil(static_cast<double>(num_image_pairs) / kNumChunks);
-
-  colmap::ThreadPool thread_pool(colmap::ThreadPool::kMaxNumThreads);
+  // The cost of RANSAC grows with the number of matches, so the pairs with
+  // the most matches are started first and the small ones fill the tail
+  const int64_t num_image_pairs = valid_pairs.size();
+  std::vector<int> pair_order(num_image_pairs);
+  std::iota(pair_order.begin(), pair_order.end(), 0);
+  std::stable_sort(pair_order.begin(), pair_order.end(), [&](int i, int j) {
+    return valid_pairs[i]->matches.rows() > valid_pairs[j]->matches.rows();
+  });
+
+  // Results of earlier runs, which are reused for the pairs whose inputs did
+  // not change
+  RelativePoseCache cache;
+  const bool use_cache = !options.cache_path.empty();
+  if (use_cache && cache.Read(options.cache_path)) {
+    LOG(INFO) << "Read " << cache.NumEntries()
+              << " relative poses from the cache";
+  }
+  std::vector<RelativePoseCache::Entry> results(num_image_pairs);
+  std::vector<char> is_cached(num_image_pairs, 0);
 
   LOG(INFO) << "Estimating relative pose for " << num_image_pairs << " pairs";
-  for (int64_t chunk_id = 0; chunk_id < kNumChunks; chunk_id++) {
-    std::cout << "\r Estimating relative pose: " << chunk_id * kNumChunks << "%"
-              << std::flush;
-    const int64_t start = chunk_id * interval;
-    const int64_t end =
-        std::min<int64_t>((chunk_id + 1) * interval, num_image_pairs);
-
-    for (int64_t pair_idx = start; pair_idx < end; pair_idx++) {
-      thread_pool.AddTask([&, pair_idx]() {
-        // Define as thread-local to reuse memory allocation in different tasks.
-        thread_local std::vector<Eigen::Vector2d> points2D_1;
-        thread_local std::vector<Eigen::Vector2d> points2D_2;
-        thread_local std::vector<char> inliers;
-
-        ImagePair& image_pair =
-            view_graph.image_pairs[valid_pair_ids[pair_idx]];
-        const Image& image1 = images[image_pair.image_id1];
-        const Image& image2 = images[image_pair.image_id2];
-        const Eigen::MatrixXi& matches = image_pair.matches;
-
-        const Camera& camera1 = cameras[image1.camera_id];
-        const Camera& camera2 = cameras[image2.camera_id];
-        poselib::Camera camera_poselib1 = ColmapCameraToPoseLibCamera(camera1);
-        poselib::Camera camera_poselib2 = ColmapCameraToPoseLibCamera(camera2);
-        bool valid_camera_model =
-            (camera_poselib1.model_id >= 0 && camera_poselib2.model_id >= 0);
-
-        // Collect the original 2D points
-        points2D_1.clear();
-        points2D_2.clear();
-        for (size_t idx = 0; idx < matches.rows(); idx++) {
-          points2D_1.push_back(image1.features[matches(idx, 0)]);
-          points2D_2.push_back(image2.features[matches(idx, 1)]);
-        }
-        // If the camera model is not supported by poselib
-        if (!valid_camera_model) {
-          // Undistort points
-          // Note that here, we still rescale by the focal length (to avoid
-          // change the RANSAC threshold)
-          Eigen::Matrix2d K1_new = Eigen::Matrix2d::Zero();
-          Eigen::Matrix2d K2_new = Eigen::Matrix2d::Zero();
-          K1_new(0, 0) = camera1.FocalLengthX();
-          K1_new(1, 1) = camera1.FocalLengthY();
-          K2_new(0, 0) = camera2.FocalLengthX();
-          K2_new(1, 1) = camera2.FocalLengthY();
-          for (size_t idx = 0; idx < matches.rows(); idx++) {
-            points2D_1[idx] = K1_new * camera1.CamFromImg(points2D_1[idx])
-                                           .value_or(Eigen::Vector2d::Zero());
-            points2D_2[idx] = K2_new * camera2.CamFromImg(points2D_2[idx])
-                                           .value_or(Eigen::Vector2d::Zero());
-          }
-
-          // Reset the camera to be the pinhole camera with original focal
-          // length and zero principal point
-          camera_poselib1 = poselib::Camera(
-              "PINHOLE",
-              {camera1.FocalLengthX(), camera1.FocalLengthY(), 0., 0.},
-              camera1.width,
-              camera1.height);
-          camera_poselib2 = poselib::Camera(
-              "PINHOLE",
-              {camera2.FocalLengthX(), camera2.FocalLengthY(), 0., 0.},
-              camera2.width,
-              camera2.height);
-        }
-        inliers.clear();
-        poselib::CameraPose pose_rel_calc;
-        try {
-          poselib::estimate_relative_pose(points2D_1,
-                                          points2D_2,
-                                          camera_poselib1,
-                                          camera_poselib2,
-                                          options.ransac_options,
-                                          options.bundle_options,
-                                          &pose_rel_calc,
-                                          &inliers);
-        } catch (const std::exception& e) {
-          LOG(ERROR) << "Error in relative pose estimation: " << e.what();
-          image_pair.is_valid = false;
-          return;
+  std::atomic<int64_t> num_done(0);
+  std::mutex progress_mutex;
+  const WorkStealingSummary summary = RunWithWorkStealing(
+      pair_order,
+      [&](int pair_idx) {
+        is_cached[pair_idx] =
+            EstimateRelativePose(*valid_pairs[pair_idx],
+                                 cameras,
+                                 images,
+                                 options,
+                                 use_cache ? &cache : nullptr,
+                                 results[pair_idx]);
+
+        // Report the progress in steps of 10%
+        const int64_t num_done_now = ++num_done;
+        if (num_done_now * 10 / num_image_pairs !=
+            (num_done_now - 1) * 10 / num_image_pairs) {
+          std::lock_guard<std::mutex> lock(progress_mutex);
+          std::cout << "\r Estimating relative pose: "
+                    << num_done_now * 100 / num_image_pairs << "%"
+                    << std::flush;
         }
+      },
+      options.num_threads);
 
-        // Convert the relative pose to the glomap format
-        for (int i = 0; i < 4; i++) {
-          image_pair.cam2_from_cam1.rotation.coeffs()[i] =
-              pose_rel_calc.q[(i + 1) % 4];
-        }
-        image_pair.cam2_from_cam1.translation = pose_rel_calc.t;
-      });
-    }
+  std::cout << "\r Estimating relative pose: 100%" << std::endl;
+  for (size_t thread_idx = 0; thread_idx < summary.num_tasks.size();
+       thread_idx++) {
+    VLOG(2) << "Relative pose thread " << thread_idx << ": "
+            << summary.num_tasks[thread_idx] << " pairs ("
+            << summary.num_stolen_tasks[thread_idx] << " stolen), busy "
+            << summary.busy_seconds[thread_idx] << "s / "
+            << summary.wall_seconds << "s";
+  }
 
-    thread_pool.Wait();
+  if (use_cache) {
+    int64_t num_cached = 0;
+    for (int64_t pair_idx = 0; pair_idx < num_image_pairs; pair_idx++) {
+      if (is_cached[pair_idx]) {
+        num_cached++;
+      } else {
+        cache.Insert(valid_pairs[pair_idx]->pair_id, results[pair_idx]);
+      }
+    }
+    LOG(INFO) << "Reused " << num_cached << " / " << num_image_pairs
+              << " relative poses from the cache";
+    if (num_cached < num_image_pairs) cache.Write(options.cache_path);
   }
 
-  std::cout << "\r Estimating relative pose: 100%" << std::endl;
-  LOG(INFO) << "Estimating relative pose done";
+  LOG(INFO) << "Estimating relative pose done, "
+            << summary.num_tasks.size() << " threads busy "
+            << 100 * summary.Utilization() << "% of the time";
 }
 
 }  // namespace glomap
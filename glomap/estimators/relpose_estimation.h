@@ -4,6 +4,8 @@
 
 #include <PoseLib/types.h>
 
+#include <string>
+
 namespace glomap {
 
 struct RelativePoseEstimationOptions {
@@ -11,6 +13,14 @@ struct RelativePoseEstimationOptions {
   poselib::RansacOptions ransac_options;
   poselib::BundleOptions bundle_options;
 
+  // Number of threads, -1 for all the available ones
+  int num_threads = -1;
+
+  // File that keeps the estimated poses across runs, so that the pairs whose
+  // matches, cameras and options did not change are not estimated again.
+  // Disabled if empty
+  std::string cache_path;
+
   RelativePoseEstimationOptions() { ransac_options.max_iterations = 50000; }
 };
 
@@ -22,7 +22,11 @@ int RunMapper(int argc, char** argv) {
   std::string image_path = "";
   std::string image_list_path = "";
   std::string constraint_type = "ONLY_POINTS";
+  std::string rotation_linear_solver = "SPARSE_CHOLESKY";
+  std::string positioning_solver = "CERES";
+  std::string track_selection = "LONGEST";
   std::string output_format = "bin";
+  bool only_matched_keypoints = false;
 
   OptionManager options;
   options.AddRequiredOption("database_path", &database_path);
@@ -33,7 +37,15 @@ int RunMapper(int argc, char** argv) {
                            &constraint_type,
                            "{ONLY_POINTS, ONLY_CAMERAS, "
                            "POINTS_AND_CAMERAS_BALANCED, POINTS_AND_CAMERAS}");
+  options.AddDefaultOption("rotation_linear_solver",
+                           &rotation_linear_solver,
+                           "{SPARSE_CHOLESKY, PCG}");
+  options.AddDefaultOption(
+      "positioning_solver", &positioning_solver, "{CERES, BATA}");
+  options.AddDefaultOption(
+      "track_selection", &track_selection, "{LONGEST, SPATIALLY_BALANCED}");
   options.AddDefaultOption("output_format", &output_format, "{bin, txt}");
+  options.AddDefaultOption("only_matched_keypoints", &only_matched_keypoints);
   options.AddGlobalMapperFullOptions();
 
   options.Parse(argc, argv);
@@ -63,6 +75,36 @@ int RunMapper(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  if (rotation_linear_solver == "SPARSE_CHOLESKY") {
+    options.mapper->opt_ra.linear_solver_type =
+        RotationEstimatorOptions::SPARSE_CHOLESKY;
+  } else if (rotation_linear_solver == "PCG") {
+    options.mapper->opt_ra.linear_solver_type = RotationEstimatorOptions::PCG;
+  } else {
+    LOG(ERROR) << "Invalid rotation linear solver";
+    return EXIT_FAILURE;
+  }
+
+  if (positioning_solver == "CERES") {
+    options.mapper->opt_gp.solver_type = GlobalPositionerOptions::CERES;
+  } else if (positioning_solver == "BATA") {
+    options.mapper->opt_gp.solver_type = GlobalPositionerOptions::BATA;
+  } else {
+    LOG(ERROR) << "Invalid positioning solver";
+    return EXIT_FAILURE;
+  }
+
+  if (track_selection == "LONGEST") {
+    options.mapper->opt_gp.track_selection_type =
+        GlobalPositionerOptions::LONGEST;
+  } else if (track_selection == "SPATIALLY_BALANCED") {
+    options.mapper->opt_gp.track_selection_type =
+        GlobalPositionerOptions::SPATIALLY_BALANCED;
+  } else {
+    LOG(ERROR) << "Invalid track selection";
+    return EXIT_FAILURE;
+  }
+
   // Check whether output_format is valid
   if (output_format != "bin" && output_format != "txt") {
     LOG(ERROR) << "Invalid output format";
@@ -78,7 +120,15 @@ int RunMapper(int argc, char** argv) {
   std::unordered_map<track_t, Track> tracks;
 
   auto database = colmap::Database::Open(database_path);
-  ConvertDatabaseToGlomap(*database, view_graph, rigs, cameras, frames, images, image_list_path);
+  ConvertDatabaseToGlomap(*database,
+                          view_graph,
+                          rigs,
+                          cameras,
+                          frames,
+                          images,
+                          image_list_path,
+                          database_path,
+                          only_matched_keypoints);
 
   if (view_graph.image_pairs.empty()) {
     LOG(ERROR) << "Can't continue without image pairs";
@@ -127,7 +177,13 @@ int RunMapper(int argc, char** argv) {
     colmap::Reconstruction recon;
     recon.Read(GetCheckpointModelRoot(checkpoint_ba_path));
     ConvertColmapToGlomap(recon, rigs, cameras, frames, images, tracks);
-    ReadExtraData(checkpoint_ba_path + "/view_graph.bin", view_graph, frames);
+    // The stages after track establishment do not use the matches
+    if (!ReadExtraData(checkpoint_ba_path + "/view_graph.bin",
+                       view_graph,
+                       frames,
+                       /*load_matches=*/false)) {
+      return EXIT_FAILURE;
+    }
 
     options.mapper->skip_preprocessing = true;
     options.mapper->skip_view_graph_calibration = true;
@@ -144,7 +200,12 @@ int RunMapper(int argc, char** argv) {
     colmap::Reconstruction recon;
     recon.Read(GetCheckpointModelRoot(checkpoint_gp_path));
     ConvertColmapToGlomap(recon, rigs, cameras, frames, images, tracks);
-    ReadExtraData(checkpoint_gp_path + "/view_graph.bin", view_graph, frames);
+    if (!ReadExtraData(checkpoint_gp_path + "/view_graph.bin",
+                       view_graph,
+                       frames,
+                       /*load_matches=*/false)) {
+      return EXIT_FAILURE;
+    }
 
     options.mapper->skip_preprocessing = true;
     options.mapper->skip_view_graph_calibration = true;
@@ -160,7 +221,12 @@ int RunMapper(int argc, char** argv) {
     colmap::Reconstruction recon;
     recon.Read(GetCheckpointModelRoot(checkpoint_tracks_path));
     ConvertColmapToGlomap(recon, rigs, cameras, frames, images, tracks);
-    ReadExtraData(checkpoint_tracks_path + "/view_graph.bin", view_graph, frames);
+    if (!ReadExtraData(checkpoint_tracks_path + "/view_graph.bin",
+                       view_graph,
+                       frames,
+                       /*load_matches=*/false)) {
+      return EXIT_FAILURE;
+    }
 
     options.mapper->skip_preprocessing = true;
     options.mapper->skip_view_graph_calibration = true;
@@ -175,7 +241,11 @@ int RunMapper(int argc, char** argv) {
     colmap::Reconstruction recon;
     recon.Read(GetCheckpointModelRoot(checkpoint_rotation_path));
     ConvertColmapToGlomap(recon, rigs, cameras, frames, images, tracks);
-    ReadExtraData(checkpoint_rotation_path + "/view_graph.bin", view_graph, frames);
+    // Track establishment runs next, so the matches are needed
+    if (!ReadExtraData(
+            checkpoint_rotation_path + "/view_graph.bin", view_graph, frames)) {
+      return EXIT_FAILURE;
+    }
 
     options.mapper->skip_preprocessing = true;
     options.mapper->skip_view_graph_calibration = true;
@@ -242,7 +312,7 @@ int RunMapperResume(int argc, char** argv) {
   }
 
   // Load the reconstruction
-  ViewGraph view_graph;                        // dummy variable
+  ViewGraph view_graph;
   std::shared_ptr<colmap::Database> database;  // dummy variable
 
   std::unordered_map<rig_t, Rig> rigs;
@@ -254,6 +324,17 @@ int RunMapperResume(int argc, char** argv) {
   reconstruction.Read(input_path);
   ConvertColmapToGlomap(reconstruction, rigs, cameras, frames, images, tracks);
 
+  // Restore the relative poses and frame data if the input is a checkpoint.
+  // Only the stages after track establishment run here, so the matches are
+  // not needed
+  if (colmap::ExistsFile(input_path + "/view_graph.bin") &&
+      !ReadExtraData(input_path + "/view_graph.bin",
+                     view_graph,
+                     frames,
+                     /*load_matches=*/false)) {
+    return EXIT_FAILURE;
+  }
+
   GlobalMapper global_mapper(*options.mapper);
 
   // Main solver
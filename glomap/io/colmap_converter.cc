@@ -1,14 +1,130 @@
 #include "glomap/io/colmap_converter.h"
 
+#include "glomap/io/database_pair_reader.h"
 #include "glomap/math/two_view_geometry.h"
 
 #include "colmap/scene/reconstruction_io_utils.h"
 
+#include <colmap/util/threading.h>
+
 #include <fstream>
 #include <algorithm>
 
 namespace glomap {
 
+namespace {
+
+// Number of database pairs that are held in memory at once (per buffer)
+constexpr size_t kDatabasePairBatchSize = 4096;
+
+// Number of raw keypoint arrays that wait for conversion at once
+constexpr size_t kKeypointQueueSize = 64;
+
+// Read the keypoints of the images into Image::features. The database is read
+// on the calling thread while the thread pool converts the keypoints that are
+// already read. If num_used_keypoints is given, only the keypoints with an
+// index below the number stored for the image are kept.
+void ReadKeypoints(
+    const colmap::Database& database,
+    std::unordered_map<image_t, Image>& images,
+    const std::unordered_map<image_t, size_t>* num_used_keypoints = nullptr) {
+  using KeypointsJob = std::pair<Image*, colmap::FeatureKeypoints>;
+  colmap::JobQueue<KeypointsJob> queue(kKeypointQueueSize);
+
+  colmap::ThreadPool thread_pool(colmap::ThreadPool::kMaxNumThreads);
+  for (int thread_idx = 0; thread_idx < thread_pool.NumThreads();
+       thread_idx++) {
+    thread_pool.AddTask([&]() {
+      while (true) {
+        auto job = queue.Pop();
+        if (!job.IsValid()) break;
+        Image& image = *job.Data().first;
+        const colmap::FeatureKeypoints& keypoints = job.Data().second;
+
+        size_t num_keypoints = keypoints.size();
+        if (num_used_keypoints != nullptr) {
+          const auto it = num_used_keypoints->find(image.image_id);
+          num_keypoints = it == num_used_keypoints->end()
+                              ? 0
+                              : std::min(num_keypoints, it->second);
+        }
+        image.features.resize(num_keypoints);
+        for (size_t i = 0; i < num_keypoints; i++) {
+          image.features[i] = Eigen::Vector2d(keypoints[i].x, keypoints[i].y);
+        }
+      }
+    });
+  }
+
+  for (auto& [image_id, image] : images) {
+    queue.Push(KeypointsJob(&image, database.ReadKeypoints(image_id)));
+  }
+  queue.Wait();
+  queue.Stop();
+  thread_pool.Wait();
+}
+
+// Fill the geometry and the matches of image_pair from the database rows.
+// Matches to keypoints outside of the images are dropped.
+void ConvertDatabasePair(
+    const colmap::TwoViewGeometry& two_view,
+    const colmap::FeatureMatches& feature_matches,
+    const std::unordered_map<camera_t, Camera>& cameras,
+    const std::unordered_map<image_t, Image>& images,
+    const std::unordered_map<image_t, size_t>& num_keypoints,
+    ImagePair& image_pair) {
+  // If the image is marked as invalid or watermark, then skip
+  if (two_view.config == colmap::TwoViewGeometry::UNDEFINED ||
+      two_view.config == colmap::TwoViewGeometry::DEGENERATE ||
+      two_view.config == colmap::TwoViewGeometry::WATERMARK ||
+      two_view.config == colmap::TwoViewGeometry::MULTIPLE) {
+    image_pair.is_valid = false;
+    return;
+  }
+
+  const Image& image1 = images.at(image_pair.image_id1);
+  const Image& image2 = images.at(image_pair.image_id2);
+
+  // Collect the fundemental matrices
+  if (two_view.config == colmap::TwoViewGeometry::UNCALIBRATED) {
+    image_pair.F = two_view.F;
+  } else if (two_view.config == colmap::TwoViewGeometry::CALIBRATED) {
+    FundamentalFromMotionAndCameras(cameras.at(image1.camera_id),
+                                    cameras.at(image2.camera_id),
+                                    two_view.cam2_from_cam1,
+                                    &image_pair.F);
+  } else if (two_view.config == colmap::TwoViewGeometry::PLANAR ||
+             two_view.config == colmap::TwoViewGeometry::PANORAMIC ||
+             two_view.config ==
+                 colmap::TwoViewGeometry::PLANAR_OR_PANORAMIC) {
+    image_pair.H = two_view.H;
+    image_pair.F = two_view.F;
+  }
+  image_pair.config = two_view.config;
+
+  // Collect the matches
+  image_pair.matches = Eigen::MatrixXi(feature_matches.size(), 2);
+
+  const size_t num_keypoints1 = num_keypoints.at(image_pair.image_id1);
+  const size_t num_keypoints2 = num_keypoints.at(image_pair.image_id2);
+
+  feature_t count = 0;
+  for (int i = 0; i < feature_matches.size(); i++) {
+    colmap::point2D_t point2D_idx1 = feature_matches[i].point2D_idx1;
+    colmap::point2D_t point2D_idx2 = feature_matches[i].point2D_idx2;
+    if (point2D_idx1 != colmap::kInvalidPoint2DIdx &&
+        point2D_idx2 != colmap::kInvalidPoint2DIdx) {
+      if (num_keypoints1 <= point2D_idx1 || num_keypoints2 <= point2D_idx2)
+        continue;
+      image_pair.matches.row(count) << point2D_idx1, point2D_idx2;
+      count++;
+    }
+  }
+  image_pair.matches.conservativeResize(count, 2);
+}
+
+}  // namespace
+
 void ConvertGlomapToColmapImage(const Image& image,
                                 colmap::Image& image_colmap,
                                 bool keep_points) {
@@ -239,15 +355,15 @@ void ConvertColmapPoints3DToGlomapTracks(
   }
 }
 
-// For ease of debug, go through the database twice: first extract the
-// available pairs, then read matches from pairs.
 void ConvertDatabaseToGlomap(const colmap::Database& database,
                              ViewGraph& view_graph,
                              std::unordered_map<rig_t, Rig>& rigs,
                              std::unordered_map<camera_t, Camera>& cameras,
                              std::unordered_map<frame_t, Frame>& frames,
                              std::unordered_map<image_t, Image>& images,
-                             const std::string& image_list_path) {
+                             const std::string& image_list_path,
+                             const std::string& database_path,
+                             bool only_matched_keypoints) {
   // Load image filter list if provided
   std::set<image_t> allowed_image_ids;
   if (!image_list_path.empty()) {
@@ -306,13 +422,18 @@ void ConvertDatabaseToGlomap(const colmap::Database& database,
   }
   std::cout << std::endl;
 
-  // Read keypoints
-  for (auto& [image_id, image] : images) {
-    const colmap::FeatureKeypoints keypoints = database.ReadKeypoints(image_id);
-    const int num_keypoints = keypoints.size();
-    image.features.resize(num_keypoints);
-    for (int i = 0; i < num_keypoints; i++) {
-      image.features[i] = Eigen::Vector2d(keypoints[i].x, keypoints[i].y);
+  // Read keypoints. If only the matched keypoints are kept, they are read
+  // after the pairs and only their number is needed to check the matches.
+  std::unordered_map<image_t, size_t> num_keypoints;
+  num_keypoints.reserve(images.size());
+  if (only_matched_keypoints) {
+    for (const auto& [image_id, image] : images) {
+      num_keypoints[image_id] = database.NumKeypointsForImage(image_id);
+    }
+  } else {
+    ReadKeypoints(database, images);
+    for (const auto& [image_id, image] : images) {
+      num_keypoints[image_id] = image.features.size();
     }
   }
 
@@ -439,101 +560,101 @@ void ConvertDatabaseToGlomap(const colmap::Database& database,
     }
   }
 
-  // Add the matches
-  std::vector<std::pair<colmap::image_pair_t, colmap::FeatureMatches>>
-      all_matches = database.ReadAllMatches();
+  // Add the matches. The pairs are read in batches: while the worker threads
+  // convert one batch, the next one is read from the database.
+  DatabasePairReader pair_reader;
+  if (!database_path.empty() && !pair_reader.Open(database_path)) {
+    LOG(WARNING) << "Could not stream the pairs of " << database_path
+                 << ", reading all the matches at once";
+  }
 
-  // Build set of valid image IDs for fast lookup
-  std::set<image_t> valid_image_ids;
-  for (const auto& [image_id, image] : images) {
-    valid_image_ids.insert(image_id);
+  // Fallback for databases that cannot be opened by path, e.g. in memory
+  std::vector<std::pair<colmap::image_pair_t, colmap::FeatureMatches>>
+      all_matches;
+  size_t num_pairs = 0;
+  if (pair_reader.IsOpen()) {
+    num_pairs = pair_reader.NumPairs();
+  } else {
+    all_matches = database.ReadAllMatches();
+    num_pairs = all_matches.size();
   }
 
+  size_t num_pairs_read = 0;
+  auto ReadBatch = [&](std::vector<DatabasePairRecord>& batch) {
+    if (pair_reader.IsOpen()) {
+      pair_reader.ReadBatch(kDatabasePairBatchSize, batch);
+    } else {
+      batch.clear();
+      for (size_t idx = num_pairs_read;
+           idx < all_matches.size() &&
+           batch.size() < kDatabasePairBatchSize;
+           idx++) {
+        DatabasePairRecord& record = batch.emplace_back();
+        record.pair_id = all_matches[idx].first;
+        record.matches = std::move(all_matches[idx].second);
+        const auto [image_id1, image_id2] =
+            colmap::PairIdToImagePair(record.pair_id);
+        record.two_view = database.ReadTwoViewGeometry(image_id1, image_id2);
+      }
+    }
+    num_pairs_read += batch.size();
+  };
+
   // Go through all matches and store the matches with enough observations in
   // the view_graph (filtering out pairs with excluded images)
   size_t invalid_count = 0;
   size_t filtered_pair_count = 0;
   std::unordered_map<image_pair_t, ImagePair>& image_pairs =
       view_graph.image_pairs;
-  for (size_t match_idx = 0; match_idx < all_matches.size(); match_idx++) {
-    if ((match_idx + 1) % 1000 == 0 || match_idx == all_matches.size() - 1)
-      std::cout << "\r Loading Image Pair " << match_idx + 1 << " / "
-                << all_matches.size() << std::flush;
-    // Read the image pair from COLMAP database
-    colmap::image_pair_t pair_id = all_matches[match_idx].first;
-    std::pair<colmap::image_t, colmap::image_t> image_pair_colmap =
-        colmap::PairIdToImagePair(pair_id);
-    colmap::image_t image_id1 = image_pair_colmap.first;
-    colmap::image_t image_id2 = image_pair_colmap.second;
+  image_pairs.reserve(num_pairs);
+
+  colmap::ThreadPool thread_pool(colmap::ThreadPool::kMaxNumThreads);
+  std::vector<DatabasePairRecord> batch;
+  std::vector<DatabasePairRecord> next_batch;
+  std::vector<ImagePair> batch_pairs;
+  std::vector<size_t> batch_record_idxs;
+  ReadBatch(batch);
+  while (!batch.empty()) {
+    std::cout << "\r Loading Image Pair " << num_pairs_read << " / "
+              << num_pairs << std::flush;
 
     // Skip pairs where either image is not in the filtered set
-    if (valid_image_ids.find(image_id1) == valid_image_ids.end() ||
-        valid_image_ids.find(image_id2) == valid_image_ids.end()) {
-      filtered_pair_count++;
-      continue;
+    batch_pairs.clear();
+    batch_record_idxs.clear();
+    for (size_t record_idx = 0; record_idx < batch.size(); record_idx++) {
+      const auto [image_id1, image_id2] =
+          colmap::PairIdToImagePair(batch[record_idx].pair_id);
+      if (images.find(image_id1) == images.end() ||
+          images.find(image_id2) == images.end()) {
+        filtered_pair_count++;
+        continue;
+      }
+      batch_pairs.emplace_back(image_id1, image_id2);
+      batch_record_idxs.push_back(record_idx);
     }
 
-    colmap::FeatureMatches& feature_matches = all_matches[match_idx].second;
-
-    // Initialize the image pair
-    auto ite = image_pairs.insert(
-        std::make_pair(ImagePair::ImagePairToPairId(image_id1, image_id2),
-                       ImagePair(image_id1, image_id2)));
-    ImagePair& image_pair = ite.first->second;
-
-    colmap::TwoViewGeometry two_view =
-        database.ReadTwoViewGeometry(image_id1, image_id2);
-
-    // If the image is marked as invalid or watermark, then skip
-    if (two_view.config == colmap::TwoViewGeometry::UNDEFINED ||
-        two_view.config == colmap::TwoViewGeometry::DEGENERATE ||
-        two_view.config == colmap::TwoViewGeometry::WATERMARK ||
-        two_view.config == colmap::TwoViewGeometry::MULTIPLE) {
-      image_pair.is_valid = false;
-      invalid_count++;
-      continue;
+    for (size_t idx = 0; idx < batch_pairs.size(); idx++) {
+      thread_pool.AddTask([&, idx]() {
+        DatabasePairRecord& record = batch[batch_record_idxs[idx]];
+        ConvertDatabasePair(record.two_view,
+                            record.matches,
+                            cameras,
+                            images,
+                            num_keypoints,
+                            batch_pairs[idx]);
+        // Release the raw matches as soon as they are converted
+        colmap::FeatureMatches().swap(record.matches);
+      });
     }
+    ReadBatch(next_batch);
+    thread_pool.Wait();
 
-    // Collect the fundemental matrices
-    if (two_view.config == colmap::TwoViewGeometry::UNCALIBRATED) {
-      image_pair.F = two_view.F;
-    } else if (two_view.config == colmap::TwoViewGeometry::CALIBRATED) {
-      FundamentalFromMotionAndCameras(
-          cameras.at(images.at(image_pair.image_id1).camera_id),
-          cameras.at(images.at(image_pair.image_id2).camera_id),
-          two_view.cam2_from_cam1,
-          &image_pair.F);
-    } else if (two_view.config == colmap::TwoViewGeometry::PLANAR ||
-               two_view.config == colmap::TwoViewGeometry::PANORAMIC ||
-               two_view.config ==
-                   colmap::TwoViewGeometry::PLANAR_OR_PANORAMIC) {
-      image_pair.H = two_view.H;
-      image_pair.F = two_view.F;
-    }
-    image_pair.config = two_view.config;
-
-    // Collect the matches
-    image_pair.matches = Eigen::MatrixXi(feature_matches.size(), 2);
-
-    std::vector<Eigen::Vector2d>& keypoints1 =
-        images[image_pair.image_id1].features;
-    std::vector<Eigen::Vector2d>& keypoints2 =
-        images[image_pair.image_id2].features;
-
-    feature_t count = 0;
-    for (int i = 0; i < feature_matches.size(); i++) {
-      colmap::point2D_t point2D_idx1 = feature_matches[i].point2D_idx1;
-      colmap::point2D_t point2D_idx2 = feature_matches[i].point2D_idx2;
-      if (point2D_idx1 != colmap::kInvalidPoint2DIdx &&
-          point2D_idx2 != colmap::kInvalidPoint2DIdx) {
-        if (keypoints1.size() <= point2D_idx1 ||
-            keypoints2.size() <= point2D_idx2)
-          continue;
-        image_pair.matches.row(count) << point2D_idx1, point2D_idx2;
-        count++;
-      }
+    for (ImagePair& image_pair : batch_pairs) {
+      if (!image_pair.is_valid) invalid_count++;
+      const image_pair_t pair_id = image_pair.pair_id;
+      image_pairs.emplace(pair_id, std::move(image_pair));
     }
-    image_pair.matches.conservativeResize(count, 2);
+    std::swap(batch, next_batch);
   }
   std::cout << std::endl;
 
@@ -543,6 +664,31 @@ void ConvertDatabaseToGlomap(const colmap::Database& database,
     LOG(INFO) << "Filtered out " << filtered_pair_count 
               << " pairs with excluded images";
   }
+
+  if (only_matched_keypoints) {
+    // Keep the keypoints up to the last one used by a valid pair, so that the
+    // feature indices of the matches stay the same
+    std::unordered_map<image_t, size_t> num_matched_keypoints;
+    for (const auto& [pair_id, image_pair] : image_pairs) {
+      if (!image_pair.is_valid || image_pair.matches.rows() == 0) continue;
+      size_t& num_matched1 = num_matched_keypoints[image_pair.image_id1];
+      size_t& num_matched2 = num_matched_keypoints[image_pair.image_id2];
+      num_matched1 = std::max<size_t>(
+          num_matched1, image_pair.matches.col(0).maxCoeff() + 1);
+      num_matched2 = std::max<size_t>(
+          num_matched2, image_pair.matches.col(1).maxCoeff() + 1);
+    }
+    ReadKeypoints(database, images, &num_matched_keypoints);
+
+    size_t num_total = 0;
+    size_t num_kept = 0;
+    for (const auto& [image_id, image] : images) {
+      num_total += num_keypoints[image_id];
+      num_kept += image.features.size();
+    }
+    LOG(INFO) << "Kept " << num_kept << " / " << num_total
+              << " keypoints up to the last matched one";
+  }
 }
 
 void CreateOneRigPerCamera(const std::unordered_map<camera_t, Camera>& cameras,
@@ -31,13 +31,21 @@ void ConvertColmapPoints3DToGlomapTracks(
     const colmap::Reconstruction& reconstruction,
     std::unordered_map<track_t, Track>& tracks);
 
+// Read the images, cameras, rigs, frames and image pairs of a database. If
+// database_path is set, the pairs are streamed from that file in batches
+// instead of loading all the matches of the database at once.
+// If only_matched_keypoints is set, the keypoints of an image are truncated
+// after the last one that is matched by a valid pair. This saves memory, but
+// the images then have fewer features than in the database.
 void ConvertDatabaseToGlomap(const colmap::Database& database,
                              ViewGraph& view_graph,
                              std::unordered_map<rig_t, Rig>& rigs,
                              std::unordered_map<camera_t, Camera>& cameras,
                              std::unordered_map<frame_t, Frame>& frames,
                              std::unordered_map<image_t, Image>& images,
-                             const std::string& image_list_path = "");
+                             const std::string& image_list_path = "",
+                             const std::string& database_path = "",
+                             bool only_matched_keypoints = false);
 
 void CreateOneRigPerCamera(const std::unordered_map<camera_t, Camera>& cameras,
                            std::unordered_map<rig_t, Rig>& rigs);
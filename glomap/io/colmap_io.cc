@@ -1,9 +1,12 @@
 #include "glomap/io/colmap_io.h"
 
+#include "glomap/io/view_graph_io.h"
+
 #include <colmap/sensor/bitmap.h>
 #include <colmap/util/file.h>
 #include <colmap/util/misc.h>
 #include <colmap/util/threading.h>
+#include <cstdio>
 #include <fstream>
 #include <mutex>
 #include <unordered_set>
@@ -178,68 +181,13 @@ void WriteColmapReconstruction(const std::string& reconstruction_path,
   }
 }
 
-void WriteExtraData(const std::string& path,
-                    const ViewGraph& view_graph,
-                    const std::unordered_map<frame_t, Frame>& frames) {
-  std::ofstream file(path, std::ios::binary);
-  if (!file.is_open()) {
-    LOG(ERROR) << "Could not open file for writing: " << path;
-    return;
-  }
-
-  // 1. Write ViewGraph
-  const uint64_t num_pairs = view_graph.image_pairs.size();
-  file.write(reinterpret_cast<const char*>(&num_pairs), sizeof(uint64_t));
-
-  for (const auto& [pair_id, pair] : view_graph.image_pairs) {
-    file.write(reinterpret_cast<const char*>(&pair.image_id1), sizeof(image_t));
-    file.write(reinterpret_cast<const char*>(&pair.image_id2), sizeof(image_t));
-    file.write(reinterpret_cast<const char*>(&pair.is_valid), sizeof(bool));
-    file.write(reinterpret_cast<const char*>(&pair.weight), sizeof(double));
-    file.write(reinterpret_cast<const char*>(&pair.config), sizeof(int));
-
-    file.write(reinterpret_cast<const char*>(pair.E.data()), 9 * sizeof(double));
-    file.write(reinterpret_cast<const char*>(pair.F.data()), 9 * sizeof(double));
-    file.write(reinterpret_cast<const char*>(pair.H.data()), 9 * sizeof(double));
-
-    const Eigen::Quaterniond q = pair.cam2_from_cam1.rotation;
-    const Eigen::Vector3d t = pair.cam2_from_cam1.translation;
-    file.write(reinterpret_cast<const char*>(q.coeffs().data()), 4 * sizeof(double));
-    file.write(reinterpret_cast<const char*>(t.data()), 3 * sizeof(double));
-
-    const uint64_t num_matches = pair.matches.rows();
-    file.write(reinterpret_cast<const char*>(&num_matches), sizeof(uint64_t));
-    if (num_matches > 0) {
-      file.write(reinterpret_cast<const char*>(pair.matches.data()), pair.matches.size() * sizeof(int));
-    }
-
-    const uint64_t num_inliers = pair.inliers.size();
-    file.write(reinterpret_cast<const char*>(&num_inliers), sizeof(uint64_t));
-    if (num_inliers > 0) {
-      file.write(reinterpret_cast<const char*>(pair.inliers.data()), num_inliers * sizeof(int));
-    }
-  }
-
-  // 2. Write Frames Extra Data
-  const uint64_t num_frames = frames.size();
-  file.write(reinterpret_cast<const char*>(&num_frames), sizeof(uint64_t));
-
-  for (const auto& [frame_id, frame] : frames) {
-    file.write(reinterpret_cast<const char*>(&frame_id), sizeof(frame_t));
-    file.write(reinterpret_cast<const char*>(&frame.cluster_id), sizeof(int));
-
-    bool has_gravity = frame.HasGravity();
-    file.write(reinterpret_cast<const char*>(&has_gravity), sizeof(bool));
-    if (has_gravity) {
-      Eigen::Vector3d gravity = frame.gravity_info.GetGravity();
-      file.write(reinterpret_cast<const char*>(gravity.data()), 3 * sizeof(double));
-    }
-  }
-}
+namespace {
 
-bool ReadExtraData(const std::string& path,
-                   ViewGraph& view_graph,
-                   std::unordered_map<frame_t, Frame>& frames) {
+// Reader of the stream format written before the mappable layout, where every
+// field of the pairs and frames is stored one after another
+bool ReadLegacyExtraData(const std::string& path,
+                         ViewGraph& view_graph,
+                         std::unordered_map<frame_t, Frame>& frames) {
   std::ifstream file(path, std::ios::binary);
   if (!file.is_open()) {
     LOG(ERROR) << "Could not open file for reading: " << path;
@@ -252,6 +200,7 @@ bool ReadExtraData(const std::string& path,
 
   view_graph.image_pairs.clear();
   view_graph.image_pairs.reserve(num_pairs);
+  view_graph.has_matches = true;
 
   for (uint64_t i = 0; i < num_pairs; ++i) {
     image_t image_id1, image_id2;
@@ -326,4 +275,34 @@ bool ReadExtraData(const std::string& path,
   return true;
 }
 
+}  // namespace
+
+bool WriteExtraData(const std::string& path,
+                    const ViewGraph& view_graph,
+                    const std::unordered_map<frame_t, Frame>& frames) {
+  if (!WriteViewGraphBinary(path, view_graph, frames)) {
+    // A checkpoint without its view graph is not resumed from
+    std::remove(path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ReadExtraData(const std::string& path,
+                   ViewGraph& view_graph,
+                   std::unordered_map<frame_t, Frame>& frames,
+                   bool load_matches) {
+  if (!ViewGraphFileReader::HasMagic(path)) {
+    return ReadLegacyExtraData(path, view_graph, frames);
+  }
+
+  ViewGraphFileReader reader;
+  if (!reader.Open(path)) return false;
+  if (load_matches && !reader.HasMatches()) {
+    LOG(ERROR) << "The view graph was written without matches: " << path;
+    return false;
+  }
+  return reader.Materialize(view_graph, frames, load_matches);
+}
+
 }  // namespace glomap
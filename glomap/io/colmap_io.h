@@ -20,12 +20,20 @@ void WriteColmapReconstruction(const std::string& reconstruction_path,
                                const colmap::Reconstruction& reconstruction,
                                const std::string output_format = "bin");
 
-void WriteExtraData(const std::string& path,
+// Write the view graph and the cluster id and gravity of the frames to a
+// checkpoint file (see view_graph_io.h for the layout). On failure, the
+// partially written file is removed.
+bool WriteExtraData(const std::string& path,
                     const ViewGraph& view_graph,
                     const std::unordered_map<frame_t, Frame>& frames);
 
+// Read a checkpoint file written by WriteExtraData, or by its earlier stream
+// based version. If load_matches is false, the matches and inliers of the
+// pairs are not loaded. Fails if they are requested from a checkpoint that
+// was written without them
 bool ReadExtraData(const std::string& path,
                    ViewGraph& view_graph,
-                   std::unordered_map<frame_t, Frame>& frames);
+                   std::unordered_map<frame_t, Frame>& frames,
+                   bool load_matches = true);
 
 }  // namespace glomap
@@ -0,0 +1,187 @@
+#include "glomap/io/database_pair_reader.h"
+
+#include <colmap/util/file.h>
+#include <colmap/util/logging.h>
+
+#include <cstring>
+
+#include <sqlite3.h>
+
+namespace glomap {
+namespace {
+
+// COLMAP stores the 3x3 matrices in row-major order
+bool ReadMatrix3dBlob(sqlite3_stmt* stmt, int col, Eigen::Matrix3d& matrix) {
+  if (sqlite3_column_bytes(stmt, col) != sizeof(double) * 9) return false;
+  Eigen::Matrix3d matrix_transposed;
+  std::memcpy(matrix_transposed.data(),
+              sqlite3_column_blob(stmt, col),
+              sizeof(double) * 9);
+  matrix = matrix_transposed.transpose();
+  return true;
+}
+
+template <int N>
+bool ReadVectorBlob(sqlite3_stmt* stmt,
+                    int col,
+                    Eigen::Matrix<double, N, 1>& vector) {
+  if (sqlite3_column_bytes(stmt, col) != sizeof(double) * N) return false;
+  std::memcpy(
+      vector.data(), sqlite3_column_blob(stmt, col), sizeof(double) * N);
+  return true;
+}
+
+bool PrepareStatement(sqlite3* database, const char* sql, sqlite3_stmt** stmt) {
+  if (sqlite3_prepare_v2(database, sql, -1, stmt, nullptr) != SQLITE_OK) {
+    LOG(ERROR) << "Failed to prepare \"" << sql
+               << "\": " << sqlite3_errmsg(database);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+DatabasePairReader::~DatabasePairReader() { Close(); }
+
+bool DatabasePairReader::Open(const std::string& path) {
+  Close();
+  if (!colmap::ExistsFile(path)) return false;
+
+  if (sqlite3_open_v2(path.c_str(),
+                      &database_,
+                      SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                      nullptr) != SQLITE_OK) {
+    LOG(ERROR) << "Failed to open database " << path << ": "
+               << sqlite3_errmsg(database_);
+    Close();
+    return false;
+  }
+
+  sqlite3_stmt* count_stmt = nullptr;
+  if (!PrepareStatement(
+          database_, "SELECT COUNT(*) FROM matches;", &count_stmt)) {
+    Close();
+    return false;
+  }
+  if (sqlite3_step(count_stmt) == SQLITE_ROW) {
+    num_pairs_ = static_cast<size_t>(sqlite3_column_int64(count_stmt, 0));
+  }
+  sqlite3_finalize(count_stmt);
+
+  // pair_id is the integer primary key of both tables, so these are plain
+  // forward scans of the tables
+  if (!PrepareStatement(database_,
+                        "SELECT pair_id, rows, cols, data FROM matches "
+                        "ORDER BY pair_id;",
+                        &matches_stmt_) ||
+      !PrepareStatement(database_,
+                        "SELECT pair_id, config, F, E, H, qvec, tvec "
+                        "FROM two_view_geometries ORDER BY pair_id;",
+                        &two_view_stmt_)) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void DatabasePairReader::Close() {
+  if (matches_stmt_ != nullptr) sqlite3_finalize(matches_stmt_);
+  if (two_view_stmt_ != nullptr) sqlite3_finalize(two_view_stmt_);
+  if (database_ != nullptr) sqlite3_close(database_);
+  database_ = nullptr;
+  matches_stmt_ = nullptr;
+  two_view_stmt_ = nullptr;
+  num_pairs_ = 0;
+  matches_done_ = false;
+  two_view_pending_ = false;
+  two_view_done_ = false;
+}
+
+bool DatabasePairReader::ReadBatch(size_t max_num_pairs,
+                                   std::vector<DatabasePairRecord>& batch) {
+  batch.clear();
+  if (!IsOpen() || matches_done_) return false;
+
+  batch.reserve(max_num_pairs);
+  while (batch.size() < max_num_pairs) {
+    const int rc = sqlite3_step(matches_stmt_);
+    if (rc != SQLITE_ROW) {
+      if (rc != SQLITE_DONE) {
+        LOG(ERROR) << "Failed to read matches: " << sqlite3_errmsg(database_);
+      }
+      matches_done_ = true;
+      break;
+    }
+
+    DatabasePairRecord& record = batch.emplace_back();
+    record.pair_id =
+        static_cast<image_pair_t>(sqlite3_column_int64(matches_stmt_, 0));
+
+    // The blob holds a row-major Nx2 array of point2D_t
+    const size_t rows =
+        static_cast<size_t>(sqlite3_column_int64(matches_stmt_, 1));
+    const size_t cols =
+        static_cast<size_t>(sqlite3_column_int64(matches_stmt_, 2));
+    const size_t num_bytes = sqlite3_column_bytes(matches_stmt_, 3);
+    if (cols == 2 && num_bytes == rows * 2 * sizeof(colmap::point2D_t)) {
+      const colmap::point2D_t* data = static_cast<const colmap::point2D_t*>(
+          sqlite3_column_blob(matches_stmt_, 3));
+      record.matches.resize(rows);
+      for (size_t i = 0; i < rows; i++) {
+        record.matches[i].point2D_idx1 = data[2 * i];
+        record.matches[i].point2D_idx2 = data[2 * i + 1];
+      }
+    } else if (rows > 0) {
+      LOG(WARNING) << "Skipping malformed matches of pair " << record.pair_id;
+    }
+
+    ReadTwoViewGeometry(record.pair_id, record.two_view);
+  }
+  return !batch.empty();
+}
+
+void DatabasePairReader::ReadTwoViewGeometry(
+    image_pair_t pair_id, colmap::TwoViewGeometry& two_view) {
+  while (!two_view_done_) {
+    if (!two_view_pending_) {
+      const int rc = sqlite3_step(two_view_stmt_);
+      if (rc != SQLITE_ROW) {
+        if (rc != SQLITE_DONE) {
+          LOG(ERROR) << "Failed to read two-view geometries: "
+                     << sqlite3_errmsg(database_);
+        }
+        two_view_done_ = true;
+        return;
+      }
+      two_view_pending_ = true;
+    }
+
+    const image_pair_t row_pair_id =
+        static_cast<image_pair_t>(sqlite3_column_int64(two_view_stmt_, 0));
+    // Geometry of a pair without matches, not needed
+    if (row_pair_id < pair_id) {
+      two_view_pending_ = false;
+      continue;
+    }
+    // The pair has no geometry, keep the row for the next pairs
+    if (row_pair_id > pair_id) return;
+
+    two_view_pending_ = false;
+    two_view.config = sqlite3_column_int(two_view_stmt_, 1);
+    ReadMatrix3dBlob(two_view_stmt_, 2, two_view.F);
+    ReadMatrix3dBlob(two_view_stmt_, 3, two_view.E);
+    ReadMatrix3dBlob(two_view_stmt_, 4, two_view.H);
+    Eigen::Vector4d qvec;
+    Eigen::Vector3d tvec;
+    if (ReadVectorBlob<4>(two_view_stmt_, 5, qvec) &&
+        ReadVectorBlob<3>(two_view_stmt_, 6, tvec)) {
+      // The rotation is stored as (w, x, y, z)
+      two_view.cam2_from_cam1 = Rigid3d(
+          Eigen::Quaterniond(qvec(0), qvec(1), qvec(2), qvec(3)), tvec);
+    }
+    return;
+  }
+}
+
+}  // namespace glomap
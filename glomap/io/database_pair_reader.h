@@ -0,0 +1,65 @@
+#pragma once
+
+#include "glomap/scene/types.h"
+
+#include <colmap/estimators/two_view_geometry.h>
+#include <colmap/feature/types.h>
+
+#include <string>
+#include <vector>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace glomap {
+
+// Raw matches and two-view geometry of one image pair of a COLMAP database
+struct DatabasePairRecord {
+  image_pair_t pair_id;
+  colmap::FeatureMatches matches;
+  // Left as UNDEFINED if the pair has no two-view geometry
+  colmap::TwoViewGeometry two_view;
+};
+
+// Streams the image pairs of a COLMAP database file. It uses its own
+// read-only connection with one forward cursor over the matches table and one
+// over the two_view_geometries table. Both tables are keyed by pair id and
+// read in that order, so they are joined on the fly and only the current
+// batch of matches is held in memory.
+class DatabasePairReader {
+ public:
+  DatabasePairReader() = default;
+  ~DatabasePairReader();
+  DatabasePairReader(const DatabasePairReader&) = delete;
+  DatabasePairReader& operator=(const DatabasePairReader&) = delete;
+
+  // Open the database file and prepare the cursors. Fails for in-memory
+  // databases and files without the COLMAP tables.
+  bool Open(const std::string& path);
+  void Close();
+  bool IsOpen() const { return database_ != nullptr; }
+
+  // Number of rows in the matches table
+  size_t NumPairs() const { return num_pairs_; }
+
+  // Replace the content of batch with the next (at most) max_num_pairs pairs.
+  // Returns false once all the pairs have been read.
+  bool ReadBatch(size_t max_num_pairs, std::vector<DatabasePairRecord>& batch);
+
+ private:
+  // Step the two-view geometry cursor up to the given pair id and copy the
+  // geometry if it is stored
+  void ReadTwoViewGeometry(image_pair_t pair_id,
+                           colmap::TwoViewGeometry& two_view);
+
+  sqlite3* database_ = nullptr;
+  sqlite3_stmt* matches_stmt_ = nullptr;
+  sqlite3_stmt* two_view_stmt_ = nullptr;
+  size_t num_pairs_ = 0;
+  bool matches_done_ = false;
+  // Whether two_view_stmt_ points to a row that has not been consumed yet
+  bool two_view_pending_ = false;
+  bool two_view_done_ = false;
+};
+
+}  // namespace glomap
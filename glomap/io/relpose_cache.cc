@@ -0,0 +1,114 @@
+#include "glomap/io/relpose_cache.h"
+
+#include <colmap/util/logging.h>
+
+#include <Eigen/Core>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+namespace glomap {
+
+bool RelativePoseCache::Read(const std::string& path) {
+  entries_.clear();
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open()) return false;
+
+  RelativePoseCacheHeader header;
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      std::memcmp(header.magic,
+                  kRelativePoseCacheMagic,
+                  sizeof(kRelativePoseCacheMagic)) != 0 ||
+      header.version != kRelativePoseCacheVersion ||
+      header.header_size != sizeof(RelativePoseCacheHeader)) {
+    LOG(WARNING) << "Ignoring invalid relative pose cache " << path;
+    return false;
+  }
+
+  // Check the size before allocating the records
+  const std::streamoff records_begin = file.tellg();
+  file.seekg(0, std::ios::end);
+  const uint64_t num_record_bytes = file.tellg() - records_begin;
+  file.seekg(records_begin);
+  if (header.num_records >
+      num_record_bytes / sizeof(RelativePoseCacheRecord)) {
+    LOG(WARNING) << "Ignoring truncated relative pose cache " << path;
+    return false;
+  }
+
+  std::vector<RelativePoseCacheRecord> records(header.num_records);
+  if (!file.read(reinterpret_cast<char*>(records.data()),
+                 records.size() * sizeof(RelativePoseCacheRecord))) {
+    LOG(WARNING) << "Ignoring truncated relative pose cache " << path;
+    return false;
+  }
+
+  entries_.reserve(records.size());
+  for (const RelativePoseCacheRecord& record : records) {
+    Entry& entry = entries_[record.pair_id];
+    entry.input_hash = record.input_hash;
+    entry.success = record.success != 0;
+    entry.cam2_from_cam1.rotation.coeffs() =
+        Eigen::Map<const Eigen::Vector4d>(record.rotation);
+    entry.cam2_from_cam1.translation =
+        Eigen::Map<const Eigen::Vector3d>(record.translation);
+  }
+  return true;
+}
+
+bool RelativePoseCache::Write(const std::string& path) const {
+  std::ofstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open file for writing: " << path;
+    return false;
+  }
+
+  // Order the records by pair id, so that the file is deterministic
+  std::vector<image_pair_t> pair_ids;
+  pair_ids.reserve(entries_.size());
+  for (const auto& [pair_id, entry] : entries_) pair_ids.push_back(pair_id);
+  std::sort(pair_ids.begin(), pair_ids.end());
+
+  RelativePoseCacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kRelativePoseCacheMagic, sizeof(header.magic));
+  header.version = kRelativePoseCacheVersion;
+  header.header_size = sizeof(RelativePoseCacheHeader);
+  header.num_records = pair_ids.size();
+
+  std::vector<RelativePoseCacheRecord> records(pair_ids.size());
+  for (size_t i = 0; i < pair_ids.size(); i++) {
+    const Entry& entry = entries_.at(pair_ids[i]);
+    RelativePoseCacheRecord& record = records[i];
+    std::memset(&record, 0, sizeof(record));
+    record.pair_id = pair_ids[i];
+    record.input_hash = entry.input_hash;
+    record.success = entry.success;
+    Eigen::Map<Eigen::Vector4d>(record.rotation) =
+        entry.cam2_from_cam1.rotation.coeffs();
+    Eigen::Map<Eigen::Vector3d>(record.translation) =
+        entry.cam2_from_cam1.translation;
+  }
+
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(records.data()),
+             records.size() * sizeof(RelativePoseCacheRecord));
+  return file.good();
+}
+
+const RelativePoseCache::Entry* RelativePoseCache::Find(
+    image_pair_t pair_id, uint64_t input_hash) const {
+  const auto it = entries_.find(pair_id);
+  if (it == entries_.end() || it->second.input_hash != input_hash) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+void RelativePoseCache::Insert(image_pair_t pair_id, const Entry& entry) {
+  entries_[pair_id] = entry;
+}
+
+}  // namespace glomap
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "glomap/scene/types.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+namespace glomap {
+
+// Binary file of the relative poses estimated for the image pairs. Every
+// result is stored with a hash of the inputs of the estimation, so that a
+// rerun on the same matches, cameras and RANSAC options can reuse it:
+//
+//   RelativePoseCacheHeader
+//   RelativePoseCacheRecord[num_records]    (sorted by pair_id)
+//
+// Records use fixed width fields in the native (little endian) byte order.
+constexpr char kRelativePoseCacheMagic[8] = {
+    'G', 'L', 'O', 'M', 'A', 'P', 'R', 'P'};
+constexpr uint32_t kRelativePoseCacheVersion = 1;
+
+struct RelativePoseCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t num_records;
+};
+
+struct RelativePoseCacheRecord {
+  uint64_t pair_id;
+  uint64_t input_hash;
+  // Whether the estimation succeeded, the pose is only set if it did
+  uint32_t success;
+  uint32_t padding;
+  // cam2_from_cam1, the rotation is stored as (x, y, z, w)
+  double rotation[4];
+  double translation[3];
+};
+
+static_assert(sizeof(RelativePoseCacheHeader) == 24);
+static_assert(sizeof(RelativePoseCacheRecord) == 80);
+
+class RelativePoseCache {
+ public:
+  struct Entry {
+    uint64_t input_hash = 0;
+    bool success = false;
+    Rigid3d cam2_from_cam1;
+  };
+
+  // Replace the entries with the ones of the file. Returns false and leaves
+  // the cache empty if the file does not exist or is not a valid cache file.
+  bool Read(const std::string& path);
+  bool Write(const std::string& path) const;
+
+  // The entry of the pair if it was estimated from the same inputs, nullptr
+  // otherwise. Safe to call from several threads while nothing is inserted.
+  const Entry* Find(image_pair_t pair_id, uint64_t input_hash) const;
+
+  // Add or replace the entry of the pair
+  void Insert(image_pair_t pair_id, const Entry& entry);
+
+  size_t NumEntries() const { return entries_.size(); }
+
+ private:
+  std::unordered_map<image_pair_t, Entry> entries_;
+};
+
+}  // namespace glomap
@@ -0,0 +1,458 @@
+#include "glomap/io/view_graph_io.h"
+
+#include <colmap/util/logging.h>
+#include <colmap/util/threading.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace glomap {
+namespace {
+
+uint64_t AlignOffset(uint64_t offset) {
+  return (offset + kViewGraphFileAlignment - 1) / kViewGraphFileAlignment *
+         kViewGraphFileAlignment;
+}
+
+// Write zeros until the stream reaches the given offset
+void WritePadding(std::ofstream& file, uint64_t& position, uint64_t offset) {
+  static const char kZeros[kViewGraphFileAlignment] = {};
+  file.write(kZeros, offset - position);
+  position = offset;
+}
+
+// Whether the block [offset, offset + num_bytes) lies in [begin, end) and is
+// aligned for int32 access
+bool IsBlockInRange(uint64_t offset,
+                    uint64_t num_bytes,
+                    uint64_t begin,
+                    uint64_t end) {
+  return offset % sizeof(int32_t) == 0 && offset >= begin && offset <= end &&
+         num_bytes <= end - offset;
+}
+
+}  // namespace
+
+bool WriteViewGraphBinary(const std::string& path,
+                          const ViewGraph& view_graph,
+                          const std::unordered_map<frame_t, Frame>& frames) {
+  static_assert(sizeof(image_t) == sizeof(uint32_t));
+  static_assert(sizeof(frame_t) == sizeof(uint32_t));
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open file for writing: " << path;
+    return false;
+  }
+
+  // Order the pairs and frames by their id, so that the file is deterministic
+  // and pairs can be found by binary search
+  std::vector<const ImagePair*> pairs;
+  pairs.reserve(view_graph.image_pairs.size());
+  for (const auto& [pair_id, image_pair] : view_graph.image_pairs) {
+    pairs.push_back(&image_pair);
+  }
+  std::sort(pairs.begin(),
+            pairs.end(),
+            [](const ImagePair* pair1, const ImagePair* pair2) {
+              return pair1->pair_id < pair2->pair_id;
+            });
+  std::vector<frame_t> frame_ids;
+  frame_ids.reserve(frames.size());
+  for (const auto& [frame_id, frame] : frames) frame_ids.push_back(frame_id);
+  std::sort(frame_ids.begin(), frame_ids.end());
+
+  // Lay out the sections
+  ViewGraphFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kViewGraphFileMagic, sizeof(header.magic));
+  header.version = kViewGraphFileVersion;
+  header.header_size = sizeof(ViewGraphFileHeader);
+  header.num_pairs = pairs.size();
+  header.num_frames = frame_ids.size();
+  if (!view_graph.has_matches) header.flags |= kViewGraphFileWithoutMatches;
+  header.pairs_offset = AlignOffset(sizeof(ViewGraphFileHeader));
+
+  std::vector<ViewGraphPairRecord> records(pairs.size());
+  uint64_t offset = AlignOffset(header.pairs_offset +
+                                records.size() * sizeof(ViewGraphPairRecord));
+  header.matches_offset = offset;
+  for (size_t i = 0; i < pairs.size(); i++) {
+    const ImagePair& image_pair = *pairs[i];
+    if (image_pair.matches.rows() > 0 && image_pair.matches.cols() != 2) {
+      LOG(ERROR) << "Matches of pair " << image_pair.pair_id
+                 << " do not have 2 columns";
+      return false;
+    }
+
+    ViewGraphPairRecord& record = records[i];
+    std::memset(&record, 0, sizeof(record));
+    record.pair_id = image_pair.pair_id;
+    record.image_id1 = image_pair.image_id1;
+    record.image_id2 = image_pair.image_id2;
+    record.config = image_pair.config;
+    record.is_valid = image_pair.is_valid;
+    record.weight = image_pair.weight;
+    Eigen::Map<Eigen::Matrix3d>(record.E) = image_pair.E;
+    Eigen::Map<Eigen::Matrix3d>(record.F) = image_pair.F;
+    Eigen::Map<Eigen::Matrix3d>(record.H) = image_pair.H;
+    Eigen::Map<Eigen::Vector4d>(record.rotation) =
+        image_pair.cam2_from_cam1.rotation.coeffs();
+    Eigen::Map<Eigen::Vector3d>(record.translation) =
+        image_pair.cam2_from_cam1.translation;
+
+    record.matches_offset = offset;
+    record.num_matches = image_pair.matches.rows();
+    offset += 2 * record.num_matches * sizeof(int32_t);
+  }
+  offset = AlignOffset(offset);
+  header.inliers_offset = offset;
+  for (size_t i = 0; i < pairs.size(); i++) {
+    records[i].inliers_offset = offset;
+    records[i].num_inliers = pairs[i]->inliers.size();
+    offset += records[i].num_inliers * sizeof(int32_t);
+  }
+  header.frames_offset = AlignOffset(offset);
+
+  // Write the sections
+  uint64_t position = 0;
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  position += sizeof(header);
+
+  WritePadding(file, position, header.pairs_offset);
+  file.write(reinterpret_cast<const char*>(records.data()),
+             records.size() * sizeof(ViewGraphPairRecord));
+  position += records.size() * sizeof(ViewGraphPairRecord);
+
+  WritePadding(file, position, header.matches_offset);
+  for (const ImagePair* image_pair : pairs) {
+    const uint64_t num_bytes = image_pair->matches.size() * sizeof(int32_t);
+    file.write(reinterpret_cast<const char*>(image_pair->matches.data()),
+               num_bytes);
+    position += num_bytes;
+  }
+
+  WritePadding(file, position, header.inliers_offset);
+  for (const ImagePair* image_pair : pairs) {
+    const uint64_t num_bytes = image_pair->inliers.size() * sizeof(int32_t);
+    file.write(reinterpret_cast<const char*>(image_pair->inliers.data()),
+               num_bytes);
+    position += num_bytes;
+  }
+
+  WritePadding(file, position, header.frames_offset);
+  for (const frame_t frame_id : frame_ids) {
+    const Frame& frame = frames.at(frame_id);
+    ViewGraphFrameRecord record;
+    std::memset(&record, 0, sizeof(record));
+    record.frame_id = frame_id;
+    record.cluster_id = frame.cluster_id;
+    record.has_gravity = frame.HasGravity();
+    if (record.has_gravity) {
+      Eigen::Map<Eigen::Vector3d>(record.gravity) =
+          frame.gravity_info.GetGravity();
+    }
+    file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+  }
+
+  if (!file.good()) {
+    LOG(ERROR) << "Failed to write view graph to " << path;
+    return false;
+  }
+  return true;
+}
+
+ViewGraphFileReader::~ViewGraphFileReader() { Close(); }
+
+bool ViewGraphFileReader::HasMagic(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  char magic[sizeof(kViewGraphFileMagic)];
+  if (!file.read(magic, sizeof(magic))) return false;
+  return std::memcmp(magic, kViewGraphFileMagic, sizeof(magic)) == 0;
+}
+
+bool ViewGraphFileReader::Open(const std::string& path) {
+  Close();
+
+#ifdef _WIN32
+  HANDLE file_handle = CreateFileA(path.c_str(),
+                                   GENERIC_READ,
+                                   FILE_SHARE_READ,
+                                   nullptr,
+                                   OPEN_EXISTING,
+                                   FILE_ATTRIBUTE_NORMAL,
+                                   nullptr);
+  if (file_handle == INVALID_HANDLE_VALUE) {
+    LOG(ERROR) << "Could not open file for reading: " << path;
+    return false;
+  }
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file_handle, &file_size) ||
+      file_size.QuadPart < static_cast<LONGLONG>(sizeof(ViewGraphFileHeader))) {
+    LOG(ERROR) << "Invalid view graph file: " << path;
+    CloseHandle(file_handle);
+    return false;
+  }
+  HANDLE mapping_handle =
+      CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  const void* data =
+      mapping_handle == nullptr
+          ? nullptr
+          : MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+  if (data == nullptr) {
+    LOG(ERROR) << "Could not map file: " << path;
+    if (mapping_handle != nullptr) CloseHandle(mapping_handle);
+    CloseHandle(file_handle);
+    return false;
+  }
+  file_handle_ = file_handle;
+  mapping_handle_ = mapping_handle;
+  size_ = static_cast<size_t>(file_size.QuadPart);
+#else
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "Could not open file for reading: " << path;
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      file_stat.st_size < static_cast<off_t>(sizeof(ViewGraphFileHeader))) {
+    LOG(ERROR) << "Invalid view graph file: " << path;
+    close(fd);
+    return false;
+  }
+  size_ = static_cast<size_t>(file_stat.st_size);
+  void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the descriptor is closed
+  close(fd);
+  if (data == MAP_FAILED) {
+    LOG(ERROR) << "Could not map file: " << path;
+    size_ = 0;
+    return false;
+  }
+#endif
+  data_ = static_cast<const char*>(data);
+
+  // Validate the header and the bounds of every section and block, so that
+  // the accessors never read outside of the mapping
+  header_ = reinterpret_cast<const ViewGraphFileHeader*>(data_);
+  const ViewGraphFileHeader& header = *header_;
+  if (std::memcmp(header.magic, kViewGraphFileMagic, sizeof(header.magic)) !=
+      0) {
+    LOG(ERROR) << "Invalid view graph file: " << path;
+    Close();
+    return false;
+  }
+  if (header.version != kViewGraphFileVersion) {
+    LOG(ERROR) << "Unsupported view graph file version " << header.version
+               << ": " << path;
+    Close();
+    return false;
+  }
+  if (header.header_size != sizeof(ViewGraphFileHeader)) {
+    LOG(ERROR) << "Invalid view graph file: " << path;
+    Close();
+    return false;
+  }
+  const bool valid_sections =
+      header.pairs_offset % kViewGraphFileAlignment == 0 &&
+      header.frames_offset % kViewGraphFileAlignment == 0 &&
+      header.pairs_offset >= sizeof(ViewGraphFileHeader) &&
+      header.num_pairs <= (size_ - header.pairs_offset) /
+                              sizeof(ViewGraphPairRecord) &&
+      header.pairs_offset + header.num_pairs * sizeof(ViewGraphPairRecord) <=
+          header.matches_offset &&
+      header.matches_offset <= header.inliers_offset &&
+      header.inliers_offset <= header.frames_offset &&
+      header.frames_offset <= size_ &&
+      header.num_frames <=
+          (size_ - header.frames_offset) / sizeof(ViewGraphFrameRecord);
+  if (!valid_sections) {
+    LOG(ERROR) << "Corrupted view graph file: " << path;
+    Close();
+    return false;
+  }
+  pairs_ = reinterpret_cast<const ViewGraphPairRecord*>(data_ +
+                                                        header.pairs_offset);
+  frames_ = reinterpret_cast<const ViewGraphFrameRecord*>(
+      data_ + header.frames_offset);
+
+  for (size_t i = 0; i < NumPairs(); i++) {
+    const ViewGraphPairRecord& record = pairs_[i];
+    const bool valid_blocks =
+        record.num_matches <= header.inliers_offset / 8 &&
+        IsBlockInRange(record.matches_offset,
+                       2 * record.num_matches * sizeof(int32_t),
+                       header.matches_offset,
+                       header.inliers_offset) &&
+        record.num_inliers <= header.frames_offset / 4 &&
+        IsBlockInRange(record.inliers_offset,
+                       record.num_inliers * sizeof(int32_t),
+                       header.inliers_offset,
+                       header.frames_offset) &&
+        (i == 0 || pairs_[i - 1].pair_id < record.pair_id);
+    if (!valid_blocks) {
+      LOG(ERROR) << "Corrupted view graph file: " << path;
+      Close();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void ViewGraphFileReader::Close() {
+  if (data_ != nullptr) {
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+    CloseHandle(static_cast<HANDLE>(mapping_handle_));
+    CloseHandle(static_cast<HANDLE>(file_handle_));
+    mapping_handle_ = nullptr;
+    file_handle_ = nullptr;
+#else
+    munmap(const_cast<char*>(data_), size_);
+#endif
+  }
+  data_ = nullptr;
+  size_ = 0;
+  header_ = nullptr;
+  pairs_ = nullptr;
+  frames_ = nullptr;
+}
+
+int64_t ViewGraphFileReader::FindPair(image_pair_t pair_id) const {
+  const ViewGraphPairRecord* end = pairs_ + NumPairs();
+  const ViewGraphPairRecord* it = std::lower_bound(
+      pairs_,
+      end,
+      pair_id,
+      [](const ViewGraphPairRecord& record, image_pair_t pair_id) {
+        return record.pair_id < pair_id;
+      });
+  if (it == end || it->pair_id != pair_id) return -1;
+  return it - pairs_;
+}
+
+Eigen::Map<const Eigen::MatrixXi> ViewGraphFileReader::Matches(
+    size_t idx) const {
+  const ViewGraphPairRecord& record = pairs_[idx];
+  return Eigen::Map<const Eigen::MatrixXi>(
+      IntAt(record.matches_offset), record.num_matches, 2);
+}
+
+Eigen::Map<const Eigen::VectorXi> ViewGraphFileReader::Inliers(
+    size_t idx) const {
+  const ViewGraphPairRecord& record = pairs_[idx];
+  return Eigen::Map<const Eigen::VectorXi>(IntAt(record.inliers_offset),
+                                           record.num_inliers);
+}
+
+bool ViewGraphFileReader::HasValidInliers(size_t idx) const {
+  const ViewGraphPairRecord& record = pairs_[idx];
+  const int* inliers = IntAt(record.inliers_offset);
+  for (uint64_t k = 0; k < record.num_inliers; k++) {
+    if (inliers[k] < 0 ||
+        static_cast<uint64_t>(inliers[k]) >= record.num_matches) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ViewGraphFileReader::CopyMatches(size_t idx,
+                                      ImagePair& image_pair) const {
+  if (!HasValidInliers(idx)) return false;
+  image_pair.matches = Matches(idx);
+  const ViewGraphPairRecord& record = pairs_[idx];
+  const int* inliers = IntAt(record.inliers_offset);
+  image_pair.inliers.assign(inliers, inliers + record.num_inliers);
+  return true;
+}
+
+bool ViewGraphFileReader::Materialize(
+    ViewGraph& view_graph,
+    std::unordered_map<frame_t, Frame>& frames,
+    bool with_matches) const {
+  view_graph.image_pairs.clear();
+  view_graph.image_pairs.reserve(NumPairs());
+  view_graph.has_matches = with_matches && HasMatches();
+
+  // Create the pairs first, the map is not thread safe
+  std::vector<ImagePair*> image_pairs(NumPairs());
+  for (size_t i = 0; i < NumPairs(); i++) {
+    const ViewGraphPairRecord& record = pairs_[i];
+    ImagePair image_pair(
+        record.image_id1,
+        record.image_id2,
+        Rigid3d(Eigen::Quaterniond(Eigen::Map<const Eigen::Vector4d>(
+                    record.rotation)),
+                Eigen::Map<const Eigen::Vector3d>(record.translation)));
+    image_pair.is_valid = record.is_valid != 0;
+    image_pair.weight = record.weight;
+    image_pair.config = record.config;
+    image_pair.E = Eigen::Map<const Eigen::Matrix3d>(record.E);
+    image_pair.F = Eigen::Map<const Eigen::Matrix3d>(record.F);
+    image_pair.H = Eigen::Map<const Eigen::Matrix3d>(record.H);
+    image_pairs[i] =
+        &view_graph.image_pairs.emplace(record.pair_id, std::move(image_pair))
+             .first->second;
+  }
+
+  // Copy the matches and inliers, which make up most of the file, in parallel
+  if (view_graph.has_matches) {
+    std::atomic<int64_t> invalid_pair_idx(-1);
+    colmap::ThreadPool thread_pool(colmap::ThreadPool::kMaxNumThreads);
+    const int64_t num_pairs = NumPairs();
+    const int64_t range_size = std::ceil(static_cast<double>(num_pairs) /
+                                         thread_pool.NumThreads());
+    for (int64_t start = 0; start < num_pairs; start += range_size) {
+      const int64_t end = std::min(start + range_size, num_pairs);
+      thread_pool.AddTask([&, start, end]() {
+        for (int64_t i = start; i < end; i++) {
+          if (!CopyMatches(i, *image_pairs[i])) {
+            invalid_pair_idx = i;
+            return;
+          }
+        }
+      });
+    }
+    thread_pool.Wait();
+    if (invalid_pair_idx >= 0) {
+      LOG(ERROR) << "Corrupted view graph file: the inliers of pair "
+                 << pairs_[invalid_pair_idx].pair_id
+                 << " do not index its matches";
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < NumFrames(); i++) {
+    const ViewGraphFrameRecord& record = frames_[i];
+    auto frame_it = frames.find(record.frame_id);
+    // Skip the frames that are not in the reconstruction
+    if (frame_it == frames.end()) continue;
+    frame_it->second.cluster_id = record.cluster_id;
+    if (record.has_gravity) {
+      frame_it->second.gravity_info.SetGravity(
+          Eigen::Map<const Eigen::Vector3d>(record.gravity));
+    }
+  }
+  return true;
+}
+
+}  // namespace glomap
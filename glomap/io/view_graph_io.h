@@ -0,0 +1,156 @@
+#pragma once
+
+#include "glomap/scene/types_sfm.h"
+
+#include <Eigen/Core>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+namespace glomap {
+
+// Binary checkpoint of the view graph and of the per frame data that is not
+// part of a COLMAP reconstruction. The file can be memory mapped and read in
+// place. All the sections start at a multiple of kViewGraphFileAlignment:
+//
+//   ViewGraphFileHeader
+//   ViewGraphPairRecord[num_pairs]    (sorted by pair_id)
+//   matches                           (int32, one column-major Nx2 block/pair)
+//   inliers                           (int32, one block per pair)
+//   ViewGraphFrameRecord[num_frames]
+//
+// Records use fixed width fields in the native (little endian) byte order.
+constexpr char kViewGraphFileMagic[8] = {
+    'G', 'L', 'O', 'M', 'A', 'P', 'V', 'G'};
+constexpr uint32_t kViewGraphFileVersion = 2;
+constexpr uint64_t kViewGraphFileAlignment = 64;
+
+// Header flag of a view graph that was written without its matches and
+// inliers, so that they cannot be read back
+constexpr uint64_t kViewGraphFileWithoutMatches = 1;
+
+struct ViewGraphFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t num_pairs;
+  uint64_t num_frames;
+  // Byte offsets of the sections from the beginning of the file
+  uint64_t pairs_offset;
+  uint64_t matches_offset;
+  uint64_t inliers_offset;
+  uint64_t frames_offset;
+  uint64_t flags;
+};
+
+struct ViewGraphPairRecord {
+  uint64_t pair_id;
+  uint32_t image_id1;
+  uint32_t image_id2;
+  int32_t config;
+  uint32_t is_valid;
+  double weight;
+  // Column-major 3x3 matrices
+  double E[9];
+  double F[9];
+  double H[9];
+  // cam2_from_cam1, the rotation is stored as (x, y, z, w)
+  double rotation[4];
+  double translation[3];
+  // Byte offsets from the beginning of the file and number of entries
+  uint64_t matches_offset;
+  uint64_t num_matches;
+  uint64_t inliers_offset;
+  uint64_t num_inliers;
+};
+
+struct ViewGraphFrameRecord {
+  uint32_t frame_id;
+  int32_t cluster_id;
+  uint32_t has_gravity;
+  uint32_t padding;
+  double gravity[3];
+};
+
+static_assert(sizeof(ViewGraphFileHeader) == 72);
+static_assert(sizeof(ViewGraphPairRecord) == 336);
+static_assert(sizeof(ViewGraphFrameRecord) == 40);
+
+// Write the view graph and the extra frame data in the format above
+bool WriteViewGraphBinary(const std::string& path,
+                          const ViewGraph& view_graph,
+                          const std::unordered_map<frame_t, Frame>& frames);
+
+// Read-only memory mapping of a view graph file. Pairs, matches and inliers
+// are accessed in place, nothing is copied until Materialize is called.
+class ViewGraphFileReader {
+ public:
+  ViewGraphFileReader() = default;
+  ~ViewGraphFileReader();
+  ViewGraphFileReader(const ViewGraphFileReader&) = delete;
+  ViewGraphFileReader& operator=(const ViewGraphFileReader&) = delete;
+
+  // Map the file and validate its header and section bounds
+  bool Open(const std::string& path);
+  void Close();
+  bool IsOpen() const { return data_ != nullptr; }
+
+  // Whether the file starts with the magic of the format above
+  static bool HasMagic(const std::string& path);
+
+  size_t NumPairs() const { return header_->num_pairs; }
+  size_t NumFrames() const { return header_->num_frames; }
+
+  // Whether the matches and inliers of the pairs are stored
+  bool HasMatches() const {
+    return (header_->flags & kViewGraphFileWithoutMatches) == 0;
+  }
+
+  const ViewGraphPairRecord& PairRecord(size_t idx) const {
+    return pairs_[idx];
+  }
+  const ViewGraphFrameRecord& FrameRecord(size_t idx) const {
+    return frames_[idx];
+  }
+
+  // Index of the record of a pair, or -1 if the pair is not stored
+  int64_t FindPair(image_pair_t pair_id) const;
+
+  // Zero-copy views on the matches and inliers of a pair. Open only checks
+  // the bounds of the blocks, not the inlier indices.
+  Eigen::Map<const Eigen::MatrixXi> Matches(size_t idx) const;
+  Eigen::Map<const Eigen::VectorXi> Inliers(size_t idx) const;
+
+  // Whether all the inliers of a pair index one of its matches
+  bool HasValidInliers(size_t idx) const;
+
+  // Rebuild the image pairs of the view graph and set the cluster id and
+  // gravity of the frames that exist. The matches and inliers of all the pairs
+  // are copied at once. If with_matches is false or the file does not store
+  // them, they are left empty and the view graph is marked as without
+  // matches. Fails if the inliers of a pair do not index its matches.
+  bool Materialize(ViewGraph& view_graph,
+                   std::unordered_map<frame_t, Frame>& frames,
+                   bool with_matches = true) const;
+
+ private:
+  // Copy the matches and inliers of a pair if its inliers are valid
+  bool CopyMatches(size_t idx, ImagePair& image_pair) const;
+
+  const int* IntAt(uint64_t offset) const {
+    return reinterpret_cast<const int*>(data_ + offset);
+  }
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  const ViewGraphFileHeader* header_ = nullptr;
+  const ViewGraphPairRecord* pairs_ = nullptr;
+  const ViewGraphFrameRecord* frames_ = nullptr;
+#ifdef _WIN32
+  void* file_handle_ = nullptr;
+  void* mapping_handle_ = nullptr;
+#endif
+};
+
+}  // namespace glomap
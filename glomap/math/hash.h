@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace glomap {
+
+// FNV-1a hash over the bytes of the values added to it. The hash depends on
+// the memory layout of the values, so it is only meant to detect changes of
+// the inputs of a computation, e.g. between runs on the same machine.
+class Fnv1aHasher {
+ public:
+  void AddBytes(const void* data, size_t num_bytes) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < num_bytes; i++) {
+      hash_ = (hash_ ^ bytes[i]) * 1099511628211ULL;
+    }
+  }
+
+  template <typename T>
+  void Add(const T& value) {
+    AddBytes(&value, sizeof(T));
+  }
+
+  uint64_t Hash() const { return hash_; }
+
+ private:
+  uint64_t hash_ = 14695981039346656037ULL;
+};
+
+}  // namespace glomap
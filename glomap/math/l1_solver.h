@@ -4,8 +4,13 @@
 
 #pragma once
 
+#include "glomap/math/pcg_solver.h"
+
 #include <colmap/util/logging.h>
 
+#include <memory>
+#include <vector>
+
 #include <Eigen/Cholesky>
 #include <Eigen/CholmodSupport>
 #include <Eigen/Core>
@@ -20,28 +25,76 @@ struct L1SolverOptions {
   int max_num_iterations = 1000;
   // Rho is the augmented Lagrangian parameter.
   double rho = 1.0;
+  // Adapt rho to keep the primal and dual residuals within a factor of
+  // rho_balance_ratio of each other, scaling it by rho_scale. The x-update
+  // does not depend on rho, so this does not require a new factorization.
+  bool adaptive_rho = true;
+  double rho_balance_ratio = 10.0;
+  double rho_scale = 2.0;
   // Alpha is the over-relaxation parameter (typically between 1.0 and 1.8).
   double alpha = 1.0;
 
   double absolute_tolerance = 1e-4;
   double relative_tolerance = 1e-2;
+
+  // Solve the x-update with PCG instead of a Cholesky factorization of A^T A
+  bool use_pcg = false;
+  PcgSolverOptions pcg_options;
 };
 
+// Convergence of the last call to L1Solver::Solve
+struct L1SolverSummary {
+  int num_iterations = 0;
+  double primal_residual = 0;
+  double dual_residual = 0;
+  // Rho at the end of the solve
+  double rho = 0;
+  bool converged = false;
+};
+
+// The solver keeps A^T, the factorization of A^T A and rho across calls to
+// Solve, so that it can be reused for a sequence of right hand sides.
 template <class MatrixType>
 class L1Solver {
  public:
-  L1Solver(const L1SolverOptions& options, const MatrixType& mat)
-      : options_(options), a_(mat) {
+  using LinearSolver = Eigen::CholmodSupernodalLLT<Eigen::SparseMatrix<double>>;
+
+  // block_sizes are the sizes of the parameter blocks of x, used by the PCG
+  // preconditioner
+  L1Solver(const L1SolverOptions& options,
+           const MatrixType& mat,
+           const std::vector<int>& block_sizes = {})
+      : options_(options), a_(mat), at_(mat.transpose()), rho_(options.rho) {
+    if (options_.use_pcg) {
+      pcg_solver_ =
+          std::make_unique<PcgSolver>(options_.pcg_options, a_, block_sizes);
+      return;
+    }
     // Pre-compute the sparsity pattern.
-    const MatrixType spd_mat = a_.transpose() * a_;
-    linear_solver_.compute(spd_mat);
+    const MatrixType spd_mat = at_ * a_;
+    own_linear_solver_.compute(spd_mat);
+    linear_solver_ = &own_linear_solver_;
   }
 
+  // Use a factorization of A^T A computed by the caller. It must outlive the
+  // solver and must not be changed while the solver is used.
+  L1Solver(const L1SolverOptions& options,
+           const MatrixType& mat,
+           LinearSolver* linear_solver)
+      : options_(options),
+        a_(mat),
+        at_(mat.transpose()),
+        rho_(options.rho),
+        linear_solver_(linear_solver) {}
+
+  const L1SolverSummary& Summary() const { return summary_; }
+
   void Solve(const Eigen::VectorXd& rhs, Eigen::VectorXd* solution) {
     Eigen::VectorXd& x = *solution;
     Eigen::VectorXd z(a_.rows()), u(a_.rows());
     z.setZero();
     u.setZero();
+    summary_ = L1SolverSummary();
 
     Eigen::VectorXd a_times_x(a_.rows()), z_old(z.size()), ax_hat(a_.rows());
     // Precompute some convergence terms.
@@ -54,9 +107,15 @@ class L1Solver {
     const std::string row_format =
         "  % 4d     % 4.4e     % 4.4e     % 4.4e     % 4.4e";
     for (int i = 0; i < options_.max_num_iterations; i++) {
-      // Update x.
-      x.noalias() = linear_solver_.solve(a_.transpose() * (rhs + z - u));
-      if (linear_solver_.info() != Eigen::Success) {
+      summary_.num_iterations = i + 1;
+
+      // Update x. PCG starts from the x of the previous step.
+      if (pcg_solver_ != nullptr) {
+        pcg_solver_->Solve(at_ * (rhs + z - u), x);
+      } else {
+        x.noalias() = linear_solver_->solve(at_ * (rhs + z - u));
+      }
+      if (pcg_solver_ == nullptr && linear_solver_->info() != Eigen::Success) {
         LOG(ERROR) << "L1 Minimization failed. Could not solve the sparse "
                       "linear system with Cholesky Decomposition";
         return;
@@ -68,38 +127,62 @@ class L1Solver {
 
       // Update z and set z_old.
       std::swap(z, z_old);
-      z.noalias() = Shrinkage(ax_hat - rhs + u, 1.0 / options_.rho);
+      z.noalias() = Shrinkage(ax_hat - rhs + u, 1.0 / rho_);
 
       // Update u.
       u.noalias() += ax_hat - z - rhs;
 
       // Compute the convergence terms.
       const double r_norm = (a_times_x - z - rhs).norm();
-      const double s_norm =
-          (-options_.rho * a_.transpose() * (z - z_old)).norm();
+      const double s_norm = rho_ * (at_ * (z - z_old)).norm();
       const double max_norm = std::max({a_times_x.norm(), z.norm(), rhs_norm});
       const double primal_eps =
           primal_abs_tolerance_eps + options_.relative_tolerance * max_norm;
-      const double dual_eps = dual_abs_tolerance_eps +
-                              options_.relative_tolerance *
-                                  (options_.rho * a_.transpose() * u).norm();
+      const double dual_eps =
+          dual_abs_tolerance_eps +
+          options_.relative_tolerance * rho_ * (at_ * u).norm();
+      summary_.primal_residual = r_norm;
+      summary_.dual_residual = s_norm;
 
       // Determine if the minimizer has converged.
       if (r_norm < primal_eps && s_norm < dual_eps) {
+        summary_.converged = true;
         break;
       }
+
+      // Residual balancing (Boyd et al., Section 3.4.1). u is the scaled dual
+      // variable, so it is rescaled with rho.
+      if (options_.adaptive_rho) {
+        if (r_norm > options_.rho_balance_ratio * s_norm) {
+          rho_ *= options_.rho_scale;
+          u /= options_.rho_scale;
+        } else if (s_norm > options_.rho_balance_ratio * r_norm) {
+          rho_ /= options_.rho_scale;
+          u *= options_.rho_scale;
+        }
+      }
     }
+    summary_.rho = rho_;
   }
 
  private:
   const L1SolverOptions& options_;
 
-  // Matrix A in || Ax - b ||_1
+  // Matrix A in || Ax - b ||_1 and its transpose
   const MatrixType a_;
+  const MatrixType at_;
+
+  double rho_;
+  L1SolverSummary summary_;
 
   // Cholesky linear solver. Since our linear system will be a SPD matrix we can
-  // utilize the Cholesky factorization.
-  Eigen::CholmodSupernodalLLT<Eigen::SparseMatrix<double>> linear_solver_;
+  // utilize the Cholesky factorization. Points to own_linear_solver_ unless the
+  // factorization is given by the caller.
+  LinearSolver own_linear_solver_;
+  LinearSolver* linear_solver_ = nullptr;
+
+  // Iterative solver, used instead of linear_solver_ if set
+  std::unique_ptr<PcgSolver> pcg_solver_;
 
   static Eigen::VectorXd Shrinkage(const Eigen::VectorXd& vec,
                                    const double kappa) {
@@ -0,0 +1,86 @@
+#include "glomap/math/normal_equations.h"
+
+#include <colmap/util/logging.h>
+
+#include <algorithm>
+
+namespace glomap {
+
+void NormalEquations::Setup(const Eigen::SparseMatrix<double>& a) {
+  // Row access to A, the columns of a row are sorted
+  const Eigen::SparseMatrix<double, Eigen::RowMajor> a_rows = a;
+
+  // Sparsity of the lower triangle of A^T * A
+  std::vector<Eigen::Triplet<double>> triplets;
+  for (int row = 0; row < a_rows.outerSize(); row++) {
+    for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it_i(
+             a_rows, row);
+         it_i;
+         ++it_i) {
+      for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it_j(
+               a_rows, row);
+           it_j && it_j.col() <= it_i.col();
+           ++it_j) {
+        triplets.emplace_back(it_i.col(), it_j.col(), 0.);
+      }
+    }
+  }
+  matrix_.resize(a.cols(), a.cols());
+  matrix_.setFromTriplets(triplets.begin(), triplets.end());
+  matrix_.makeCompressed();
+
+  // Index of the non-zero of every contribution, in the same order as the
+  // triplets
+  const int* outer = matrix_.outerIndexPtr();
+  const int* inner = matrix_.innerIndexPtr();
+  std::vector<int> contribution_nnz(triplets.size());
+  for (size_t k = 0; k < triplets.size(); k++) {
+    const int row = triplets[k].row();
+    const int col = triplets[k].col();
+    contribution_nnz[k] =
+        std::lower_bound(inner + outer[col], inner + outer[col + 1], row) -
+        inner;
+  }
+
+  // Bucket the contributions by non-zero
+  offsets_.assign(matrix_.nonZeros() + 1, 0);
+  for (const int nnz : contribution_nnz) offsets_[nnz + 1]++;
+  for (size_t k = 1; k < offsets_.size(); k++) offsets_[k] += offsets_[k - 1];
+  rows_.resize(triplets.size());
+  products_.resize(triplets.size());
+  std::vector<int> next(offsets_.begin(), offsets_.end() - 1);
+  size_t k = 0;
+  for (int row = 0; row < a_rows.outerSize(); row++) {
+    for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it_i(
+             a_rows, row);
+         it_i;
+         ++it_i) {
+      for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it_j(
+               a_rows, row);
+           it_j && it_j.col() <= it_i.col();
+           ++it_j) {
+        const int pos = next[contribution_nnz[k++]]++;
+        rows_[pos] = row;
+        products_[pos] = it_i.value() * it_j.value();
+      }
+    }
+  }
+
+  VLOG(2) << "Normal equations with " << matrix_.nonZeros()
+          << " non-zeros from " << products_.size() << " contributions";
+}
+
+void NormalEquations::Assemble(const Eigen::ArrayXd& row_weights) {
+  THROW_CHECK(IsSetup());
+  double* values = matrix_.valuePtr();
+  const int num_nonzeros = matrix_.nonZeros();
+  for (int nnz = 0; nnz < num_nonzeros; nnz++) {
+    double value = 0;
+    for (int k = offsets_[nnz]; k < offsets_[nnz + 1]; k++) {
+      value += row_weights[rows_[k]] * products_[k];
+    }
+    values[nnz] = value;
+  }
+}
+
+}  // namespace glomap
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+
+#include <vector>
+
+namespace glomap {
+
+// Assembles the normal equations A^T * diag(w) * A of a fixed matrix A for
+// changing row weights w. The sparsity of the product and, for every one of
+// its non-zeros, the rows of A that contribute to it are computed once, so
+// that the assembly for new weights only updates the values in place and
+// keeps the sparsity pattern of the matrix (and of its symbolic
+// factorization) stable.
+class NormalEquations {
+ public:
+  // Analyze the product for the matrix A. The matrix is not kept.
+  void Setup(const Eigen::SparseMatrix<double>& a);
+
+  bool IsSetup() const { return !offsets_.empty(); }
+
+  // Compute the values of A^T * diag(row_weights) * A
+  void Assemble(const Eigen::ArrayXd& row_weights);
+
+  // The lower triangle of the product, as read by the Cholesky solvers
+  const Eigen::SparseMatrix<double>& Matrix() const { return matrix_; }
+
+ private:
+  Eigen::SparseMatrix<double> matrix_;
+
+  // The contributions to the non-zero k of matrix_ are in the range
+  // [offsets_[k], offsets_[k + 1]) of rows_ and products_: the row r of A and
+  // the product of the two entries of the row, a_ri * a_rj
+  std::vector<int> offsets_;
+  std::vector<int> rows_;
+  std::vector<double> products_;
+};
+
+}  // namespace glomap
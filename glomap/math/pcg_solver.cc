@@ -0,0 +1,202 @@
+#include "glomap/math/pcg_solver.h"
+
+#include <colmap/util/logging.h>
+
+#include <algorithm>
+
+#include <Eigen/Dense>
+
+namespace glomap {
+namespace {
+
+// Below this size the products are computed on the calling thread
+constexpr int kMinNumItemsPerThread = 4096;
+
+}  // namespace
+
+PcgSolver::PcgSolver(const PcgSolverOptions& options,
+                     const Eigen::SparseMatrix<double>& a,
+                     const std::vector<int>& block_sizes)
+    : options_(options), a_rows_(a), a_cols_(a) {
+  a_rows_.makeCompressed();
+  a_cols_.makeCompressed();
+  row_weights_.setOnes(a.rows());
+  a_times_x_.resize(a.rows());
+
+  block_starts_.reserve(a.cols() + 1);
+  block_starts_.push_back(0);
+  if (block_sizes.empty()) {
+    for (int col = 1; col <= a.cols(); col++) block_starts_.push_back(col);
+  } else {
+    for (const int block_size : block_sizes) {
+      block_starts_.push_back(block_starts_.back() + block_size);
+    }
+  }
+  THROW_CHECK_EQ(block_starts_.back(), a.cols());
+
+  const int num_blocks = block_starts_.size() - 1;
+  block_offsets_.resize(num_blocks + 1);
+  block_offsets_[0] = 0;
+  for (int block = 0; block < num_blocks; block++) {
+    const int size = block_starts_[block + 1] - block_starts_[block];
+    block_offsets_[block + 1] = block_offsets_[block] + size * size;
+  }
+  block_inverses_.resize(block_offsets_.back());
+
+  const int num_threads = colmap::GetEffectiveNumThreads(options_.num_threads);
+  if (num_threads > 1 && a.rows() >= 2 * kMinNumItemsPerThread) {
+    thread_pool_ = std::make_unique<colmap::ThreadPool>(num_threads);
+  }
+
+  SetRowWeights(row_weights_);
+}
+
+template <typename Func>
+void PcgSolver::ParallelFor(int num_items, const Func& func) {
+  if (thread_pool_ == nullptr || num_items < 2 * kMinNumItemsPerThread) {
+    func(0, num_items);
+    return;
+  }
+  const int num_chunks =
+      std::min(thread_pool_->NumThreads(), num_items / kMinNumItemsPerThread);
+  const int chunk_size = (num_items + num_chunks - 1) / num_chunks;
+  for (int begin = 0; begin < num_items; begin += chunk_size) {
+    const int end = std::min(begin + chunk_size, num_items);
+    thread_pool_->AddTask([&func, begin, end]() { func(begin, end); });
+  }
+  thread_pool_->Wait();
+}
+
+void PcgSolver::SetRowWeights(const Eigen::ArrayXd& row_weights) {
+  row_weights_ = row_weights;
+
+  // Block of the column
+  std::vector<int> col_to_block(a_cols_.cols());
+  for (int block = 0; block + 1 < static_cast<int>(block_starts_.size());
+       block++) {
+    std::fill(col_to_block.begin() + block_starts_[block],
+              col_to_block.begin() + block_starts_[block + 1],
+              block);
+  }
+
+  // Accumulate the diagonal blocks of A^T * diag(w) * A row by row
+  std::fill(block_inverses_.begin(), block_inverses_.end(), 0.);
+  for (int row = 0; row < a_rows_.outerSize(); row++) {
+    const double w = row_weights_[row];
+    if (w == 0) continue;
+    for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it_i(
+             a_rows_, row);
+         it_i;
+         ++it_i) {
+      const int block = col_to_block[it_i.col()];
+      const int start = block_starts_[block];
+      const int size = block_starts_[block + 1] - start;
+      for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it_j(
+               a_rows_, row);
+           it_j;
+           ++it_j) {
+        if (col_to_block[it_j.col()] != block) continue;
+        block_inverses_[block_offsets_[block] +
+                        (it_i.col() - start) * size + it_j.col() - start] +=
+            w * it_i.value() * it_j.value();
+      }
+    }
+  }
+
+  // Invert the blocks, unconstrained blocks are left as identity
+  for (int block = 0; block + 1 < static_cast<int>(block_starts_.size());
+       block++) {
+    const int size = block_starts_[block + 1] - block_starts_[block];
+    Eigen::Map<Eigen::MatrixXd> block_matrix(
+        block_inverses_.data() + block_offsets_[block], size, size);
+    Eigen::LDLT<Eigen::MatrixXd> ldlt(block_matrix);
+    if (ldlt.info() != Eigen::Success || !ldlt.isPositive() ||
+        ldlt.vectorD().minCoeff() <= 0) {
+      block_matrix.setIdentity();
+    } else {
+      block_matrix = ldlt.solve(Eigen::MatrixXd::Identity(size, size));
+    }
+  }
+}
+
+void PcgSolver::Multiply(const Eigen::VectorXd& x, Eigen::VectorXd& y) {
+  ParallelFor(a_rows_.rows(), [&](int begin, int end) {
+    for (int row = begin; row < end; row++) {
+      double value = 0;
+      for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(
+               a_rows_, row);
+           it;
+           ++it) {
+        value += it.value() * x[it.col()];
+      }
+      a_times_x_[row] = row_weights_[row] * value;
+    }
+  });
+  y.resize(a_cols_.cols());
+  ParallelFor(a_cols_.cols(), [&](int begin, int end) {
+    for (int col = begin; col < end; col++) {
+      double value = 0;
+      for (Eigen::SparseMatrix<double>::InnerIterator it(a_cols_, col); it;
+           ++it) {
+        value += it.value() * a_times_x_[it.row()];
+      }
+      y[col] = value;
+    }
+  });
+}
+
+void PcgSolver::ApplyPreconditioner(const Eigen::VectorXd& r,
+                                    Eigen::VectorXd& z) const {
+  z.resize(r.size());
+  for (int block = 0; block + 1 < static_cast<int>(block_starts_.size());
+       block++) {
+    const int start = block_starts_[block];
+    const int size = block_starts_[block + 1] - start;
+    const Eigen::Map<const Eigen::MatrixXd> block_inverse(
+        block_inverses_.data() + block_offsets_[block], size, size);
+    z.segment(start, size).noalias() =
+        block_inverse * r.segment(start, size);
+  }
+}
+
+bool PcgSolver::Solve(const Eigen::VectorXd& rhs, Eigen::VectorXd& x) {
+  num_iterations_ = 0;
+  if (x.size() != rhs.size()) x.setZero(rhs.size());
+
+  const double rhs_norm = rhs.norm();
+  if (rhs_norm == 0) {
+    x.setZero();
+    return true;
+  }
+  const double threshold = options_.tolerance * rhs_norm;
+
+  Eigen::VectorXd r(rhs.size()), z(rhs.size()), p(rhs.size()),
+      q(rhs.size());
+  Multiply(x, q);
+  r = rhs - q;
+  if (r.norm() <= threshold) return true;
+
+  ApplyPreconditioner(r, z);
+  p = z;
+  double rz = r.dot(z);
+  while (num_iterations_ < options_.max_num_iterations) {
+    num_iterations_++;
+    Multiply(p, q);
+    const double pq = p.dot(q);
+    if (pq <= 0) break;
+    const double alpha = rz / pq;
+    x.noalias() += alpha * p;
+    r.noalias() -= alpha * q;
+    if (r.norm() <= threshold) return true;
+
+    ApplyPreconditioner(r, z);
+    const double rz_new = r.dot(z);
+    p = z + (rz_new / rz) * p;
+    rz = rz_new;
+  }
+  VLOG(2) << "PCG stopped after " << num_iterations_
+          << " iterations with relative residual " << r.norm() / rhs_norm;
+  return false;
+}
+
+}  // namespace glomap
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <colmap/util/threading.h>
+
+#include <memory>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+
+namespace glomap {
+
+struct PcgSolverOptions {
+  // Maximum number of conjugate gradient iterations per solve
+  int max_num_iterations = 500;
+
+  // Stop once the residual norm dropped by this factor relative to the norm
+  // of the right hand side
+  double tolerance = 1e-8;
+
+  // Number of threads for the matrix-vector products, -1 for all cores
+  int num_threads = -1;
+};
+
+// Solves the normal equations A^T * diag(w) * A * x = b with preconditioned
+// conjugate gradients. The product is never formed, each iteration multiplies
+// by A and A^T, so the memory stays linear in the number of non-zeros of A.
+// The preconditioner is the inverse of the diagonal blocks of the product, one
+// block per parameter block of x.
+class PcgSolver {
+ public:
+  // block_sizes partition the columns of A, an empty vector means 1x1 blocks
+  PcgSolver(const PcgSolverOptions& options,
+            const Eigen::SparseMatrix<double>& a,
+            const std::vector<int>& block_sizes = {});
+
+  // Set the row weights w and update the preconditioner
+  void SetRowWeights(const Eigen::ArrayXd& row_weights);
+
+  // Solve for x, starting from the given value of x. Returns false if the
+  // tolerance was not reached.
+  bool Solve(const Eigen::VectorXd& rhs, Eigen::VectorXd& x);
+
+  int NumIterations() const { return num_iterations_; }
+
+ private:
+  // y = A^T * diag(w) * A * x
+  void Multiply(const Eigen::VectorXd& x, Eigen::VectorXd& y);
+  void ApplyPreconditioner(const Eigen::VectorXd& r, Eigen::VectorXd& z) const;
+
+  // Run func(begin, end) over chunks of [0, num_items) on the thread pool
+  template <typename Func>
+  void ParallelFor(int num_items, const Func& func);
+
+  const PcgSolverOptions options_;
+
+  // A in row-major order for A * x and in column-major order for A^T * y, so
+  // that every output entry is computed by one thread
+  Eigen::SparseMatrix<double, Eigen::RowMajor> a_rows_;
+  Eigen::SparseMatrix<double> a_cols_;
+  Eigen::ArrayXd row_weights_;
+
+  std::vector<int> block_starts_;
+  // Inverse of the diagonal blocks, stored densely one after the other
+  std::vector<int> block_offsets_;
+  std::vector<double> block_inverses_;
+
+  // Scratch vector for A * x
+  Eigen::VectorXd a_times_x_;
+
+  std::unique_ptr<colmap::ThreadPool> thread_pool_;
+  int num_iterations_ = 0;
+};
+
+}  // namespace glomap
@@ -1,23 +1,75 @@
 #include "tree.h"
 
-// BGL includes
-#include <boost/graph/adjacency_list.hpp>
-#include <boost/graph/kruskal_min_spanning_tree.hpp>
+#include "glomap/math/union_find.h"
+
+#include <colmap/util/threading.h>
+
+#include <memory>
+#include <queue>
 
 namespace glomap {
 
 namespace {
 
-typedef boost::adjacency_list<boost::vecS,
-                              boost::vecS,
-                              boost::undirectedS,
-                              boost::no_property,
-                              boost::property<boost::edge_weight_t, double>>
-    weighted_graph;
-typedef boost::property_map<weighted_graph, boost::edge_weight_t>::type
-    weight_map;
-typedef boost::graph_traits<weighted_graph>::edge_descriptor edge_desc;
-typedef boost::graph_traits<weighted_graph>::vertex_descriptor vertex_desc;
+// Below this number of nodes per thread, a round of Boruvka is run serially
+const int kMinNumNodesPerThread = 4096;
+
+// Run func(begin, end) on chunks of [0, num_items), on the thread pool if any
+template <typename Func>
+void ParallelFor(colmap::ThreadPool* thread_pool,
+                 int num_items,
+                 const Func& func) {
+  if (thread_pool == nullptr || num_items < 2 * kMinNumNodesPerThread) {
+    func(0, num_items);
+    return;
+  }
+  const int num_chunks =
+      std::min(thread_pool->NumThreads(), num_items / kMinNumNodesPerThread);
+  const int chunk_size = (num_items + num_chunks - 1) / num_chunks;
+  for (int begin = 0; begin < num_items; begin += chunk_size) {
+    const int end = std::min(begin + chunk_size, num_items);
+    thread_pool->AddTask([&func, begin, end]() { func(begin, end); });
+  }
+  thread_pool->Wait();
+}
+
+// Key of an undirected edge, independent of the order of the nodes
+uint64_t EdgeKey(int node1, int node2) {
+  if (node1 > node2) std::swap(node1, node2);
+  return (static_cast<uint64_t>(static_cast<uint32_t>(node1)) << 32) |
+         static_cast<uint32_t>(node2);
+}
+
+// Whether edge1 is heavier than edge2, where -1 is lighter than any edge.
+// Equal weights are ordered by the edge index, so that the order is strict.
+bool IsHeavier(int edge1, double weight1, int edge2, double weight2) {
+  if (edge1 == -1) return false;
+  if (edge2 == -1) return true;
+  if (weight1 != weight2) return weight1 > weight2;
+  return edge1 < edge2;
+}
+
+// Parents of the nodes in a breadth-first traversal from the root of a graph
+// in CSR form. The root is its own parent, nodes not reached have -1.
+std::vector<int> BFSParents(const std::vector<int>& offsets,
+                            const std::vector<int>& neighbors,
+                            int root) {
+  std::vector<int> parents(offsets.size() - 1, -1);
+  std::vector<int> queue;
+  queue.reserve(parents.size());
+  parents[root] = root;
+  queue.push_back(root);
+  for (size_t head = 0; head < queue.size(); head++) {
+    const int node = queue[head];
+    for (int k = offsets[node]; k < offsets[node + 1]; k++) {
+      const int neighbor = neighbors[k];
+      if (parents[neighbor] != -1) continue;
+      parents[neighbor] = node;
+      queue.push_back(neighbor);
+    }
+  }
+  return parents;
+}
 
 }  // namespace
 
@@ -29,6 +81,13 @@ int BFS(const std::vector<std::vector<int>>& graph,
         std::vector<std::pair<int, int>> banned_edges) {
   int num_vertices = graph.size();
 
+  // Hash the banned edges, so that every neighbor visit is checked in O(1)
+  std::unordered_set<uint64_t> banned_keys;
+  banned_keys.reserve(banned_edges.size());
+  for (const auto& [vertex1, vertex2] : banned_edges) {
+    banned_keys.insert(EdgeKey(vertex1, vertex2));
+  }
+
   // Create a vector to store the visited status of each vertex
   std::vector<bool> visited(num_vertices, false);
 
@@ -52,15 +111,8 @@ int BFS(const std::vector<std::vector<int>>& graph,
     // Process the current vertex
     // Traverse the adjacent vertices
     for (int neighbor : graph[current_vertex]) {
-      if (std::find(banned_edges.begin(),
-                    banned_edges.end(),
-                    std::make_pair(current_vertex, neighbor)) !=
-          banned_edges.end())
-        continue;
-      if (std::find(banned_edges.begin(),
-                    banned_edges.end(),
-                    std::make_pair(neighbor, current_vertex)) !=
-          banned_edges.end())
+      if (!banned_keys.empty() &&
+          banned_keys.count(EdgeKey(current_vertex, neighbor)) > 0)
         continue;
 
       if (!visited[neighbor]) {
@@ -75,77 +127,198 @@ int BFS(const std::vector<std::vector<int>>& graph,
   return counter;
 }
 
+std::vector<int> MaximumSpanningForest(int num_nodes,
+                                       const std::vector<WeightedEdge>& edges,
+                                       int num_threads) {
+  std::vector<int> forest;
+  if (num_nodes == 0) return forest;
+
+  // Adjacency in CSR form. The segment of a node is [offsets[node],
+  // offsets[node] + degrees[node]), it shrinks as the edges inside the
+  // component of the node are dropped.
+  std::vector<int> offsets(num_nodes + 1, 0);
+  for (const WeightedEdge& edge : edges) {
+    if (edge.node1 == edge.node2) continue;
+    offsets[edge.node1 + 1]++;
+    offsets[edge.node2 + 1]++;
+  }
+  for (int node = 0; node < num_nodes; node++) {
+    offsets[node + 1] += offsets[node];
+  }
+  std::vector<int> degrees(num_nodes, 0);
+  std::vector<int> neighbors(offsets.back());
+  std::vector<int> neighbor_edges(offsets.back());
+  std::vector<double> neighbor_weights(offsets.back());
+  for (int edge_idx = 0; edge_idx < static_cast<int>(edges.size());
+       edge_idx++) {
+    const WeightedEdge& edge = edges[edge_idx];
+    if (edge.node1 == edge.node2) continue;
+    const int k1 = offsets[edge.node1] + degrees[edge.node1]++;
+    neighbors[k1] = edge.node2;
+    neighbor_edges[k1] = edge_idx;
+    neighbor_weights[k1] = edge.weight;
+    const int k2 = offsets[edge.node2] + degrees[edge.node2]++;
+    neighbors[k2] = edge.node1;
+    neighbor_edges[k2] = edge_idx;
+    neighbor_weights[k2] = edge.weight;
+  }
+
+  std::unique_ptr<colmap::ThreadPool> thread_pool;
+  num_threads = colmap::GetEffectiveNumThreads(num_threads);
+  if (num_threads > 1 && num_nodes >= 2 * kMinNumNodesPerThread) {
+    thread_pool = std::make_unique<colmap::ThreadPool>(num_threads);
+  }
+
+  // The component of a node is the root of its set, the roots of the
+  // concurrent union find are stable under parallel finds
+  ConcurrentUnionFind<int> union_find(num_nodes);
+  std::vector<int> components(num_nodes);
+  std::iota(components.begin(), components.end(), 0);
+  std::vector<int> node_best_edges(num_nodes);
+  std::vector<int> component_best_edges(num_nodes);
+  std::vector<double> component_best_weights(num_nodes);
+
+  forest.reserve(num_nodes - 1);
+  int num_rounds = 0;
+  while (true) {
+    num_rounds++;
+
+    // Heaviest edge leaving the component of every node
+    ParallelFor(thread_pool.get(), num_nodes, [&](int begin, int end) {
+      for (int node = begin; node < end; node++) {
+        const int component = components[node];
+        int best_edge = -1;
+        double best_weight = 0;
+        int num_kept = 0;
+        const int begin_k = offsets[node];
+        for (int k = begin_k; k < begin_k + degrees[node]; k++) {
+          const int neighbor = neighbors[k];
+          if (components[neighbor] == component) continue;
+          const int edge_idx = neighbor_edges[k];
+          const double weight = neighbor_weights[k];
+          neighbors[begin_k + num_kept] = neighbor;
+          neighbor_edges[begin_k + num_kept] = edge_idx;
+          neighbor_weights[begin_k + num_kept] = weight;
+          num_kept++;
+          if (IsHeavier(edge_idx, weight, best_edge, best_weight)) {
+            best_edge = edge_idx;
+            best_weight = weight;
+          }
+        }
+        degrees[node] = num_kept;
+        node_best_edges[node] = best_edge;
+      }
+    });
+
+    // Heaviest edge leaving every component
+    std::fill(component_best_edges.begin(), component_best_edges.end(), -1);
+    for (int node = 0; node < num_nodes; node++) {
+      const int edge_idx = node_best_edges[node];
+      if (edge_idx == -1) continue;
+      const int component = components[node];
+      if (IsHeavier(edge_idx,
+                    edges[edge_idx].weight,
+                    component_best_edges[component],
+                    component_best_weights[component])) {
+        component_best_edges[component] = edge_idx;
+        component_best_weights[component] = edges[edge_idx].weight;
+      }
+    }
+
+    // Since the order of the edges is strict, the selected edges belong to
+    // the forest. An edge selected by both of its components is added once.
+    const size_t num_forest_edges = forest.size();
+    for (int component = 0; component < num_nodes; component++) {
+      const int edge_idx = component_best_edges[component];
+      if (edge_idx == -1) continue;
+      const WeightedEdge& edge = edges[edge_idx];
+      if (union_find.Find(edge.node1) == union_find.Find(edge.node2)) {
+        continue;
+      }
+      union_find.Union(edge.node1, edge.node2);
+      forest.push_back(edge_idx);
+    }
+    if (forest.size() == num_forest_edges) break;
+
+    ParallelFor(thread_pool.get(), num_nodes, [&](int begin, int end) {
+      for (int node = begin; node < end; node++) {
+        components[node] = union_find.Find(node);
+      }
+    });
+  }
+
+  VLOG(2) << "Maximum spanning forest with " << forest.size()
+          << " edges found in " << num_rounds << " rounds";
+  return forest;
+}
+
 image_t MaximumSpanningTree(const ViewGraph& view_graph,
                             const std::unordered_map<image_t, Image>& images,
                             std::unordered_map<image_t, image_t>& parents,
-                            WeightType type) {
+                            WeightType type,
+                            int num_threads) {
   std::unordered_map<image_t, int> image_id_to_idx;
   image_id_to_idx.reserve(images.size());
-  std::unordered_map<int, image_t> idx_to_image_id;
+  std::vector<image_t> idx_to_image_id;
   idx_to_image_id.reserve(images.size());
   for (auto& [image_id, image] : images) {
     if (image.IsRegistered() == false) continue;
-    idx_to_image_id[image_id_to_idx.size()] = image_id;
-    image_id_to_idx[image_id] = image_id_to_idx.size();
+    image_id_to_idx[image_id] = idx_to_image_id.size();
+    idx_to_image_id.push_back(image_id);
   }
 
-  double max_weight = 0;
-  for (const auto& [pair_id, image_pair] : view_graph.image_pairs) {
-    if (image_pair.is_valid == false) continue;
-    if (type == INLIER_RATIO)
-      max_weight = std::max(max_weight, image_pair.weight);
-    else
-      max_weight =
-          std::max(max_weight, static_cast<double>(image_pair.inliers.size()));
-  }
+  parents.clear();
+  if (idx_to_image_id.empty()) return colmap::kInvalidImageId;
 
   // establish graph
-  weighted_graph G(image_id_to_idx.size());
-  weight_map weights_boost = boost::get(boost::edge_weight, G);
-
-  edge_desc e;
+  std::vector<WeightedEdge> edges;
+  edges.reserve(view_graph.image_pairs.size());
   for (auto& [pair_id, image_pair] : view_graph.image_pairs) {
     if (image_pair.is_valid == false) continue;
 
-    const Image& image1 = images.at(image_pair.image_id1);
-    const Image& image2 = images.at(image_pair.image_id2);
-
-    if (image1.IsRegistered() == false || image2.IsRegistered() == false) {
+    const auto it1 = image_id_to_idx.find(image_pair.image_id1);
+    const auto it2 = image_id_to_idx.find(image_pair.image_id2);
+    if (it1 == image_id_to_idx.end() || it2 == image_id_to_idx.end()) {
       continue;
     }
 
-    int idx1 = image_id_to_idx[image_pair.image_id1];
-    int idx2 = image_id_to_idx[image_pair.image_id2];
-
-    // Set the weight to be negative, then the result would be a maximum
-    // spanning tree
-    e = boost::add_edge(idx1, idx2, G).first;
-    if (type == INLIER_NUM)
-      weights_boost[e] = max_weight - image_pair.inliers.size();
-    else if (type == INLIER_RATIO)
-      weights_boost[e] = max_weight - image_pair.weight;
+    WeightedEdge& edge = edges.emplace_back();
+    edge.node1 = it1->second;
+    edge.node2 = it2->second;
+    if (type == INLIER_RATIO)
+      edge.weight = image_pair.weight;
     else
-      weights_boost[e] = max_weight - image_pair.inliers.size();
+      edge.weight = image_pair.inliers.size();
   }
 
-  std::vector<edge_desc>
-      mst;  // vector to store MST edges (not a property map!)
-  boost::kruskal_minimum_spanning_tree(G, std::back_inserter(mst));
+  const std::vector<int> forest =
+      MaximumSpanningForest(idx_to_image_id.size(), edges, num_threads);
 
-  std::vector<std::vector<int>> edges_list(image_id_to_idx.size());
-  for (const auto& edge : mst) {
-    auto source = boost::source(edge, G);
-    auto target = boost::target(edge, G);
-    edges_list[source].push_back(target);
-    edges_list[target].push_back(source);
+  // Tree in CSR form
+  const int num_nodes = idx_to_image_id.size();
+  std::vector<int> offsets(num_nodes + 1, 0);
+  for (const int edge_idx : forest) {
+    offsets[edges[edge_idx].node1 + 1]++;
+    offsets[edges[edge_idx].node2 + 1]++;
+  }
+  for (int node = 0; node < num_nodes; node++) {
+    offsets[node + 1] += offsets[node];
+  }
+  std::vector<int> neighbors(offsets.back());
+  std::vector<int> fill_counts(num_nodes, 0);
+  for (const int edge_idx : forest) {
+    const WeightedEdge& edge = edges[edge_idx];
+    neighbors[offsets[edge.node1] + fill_counts[edge.node1]++] = edge.node2;
+    neighbors[offsets[edge.node2] + fill_counts[edge.node2]++] = edge.node1;
   }
 
-  std::vector<int> parents_idx;
-  BFS(edges_list, 0, parents_idx);
+  const std::vector<int> parents_idx = BFSParents(offsets, neighbors, 0);
 
-  // change the index back to image id
-  parents.clear();
-  for (int i = 0; i < parents_idx.size(); i++) {
+  // change the index back to image id, images outside of the tree of the
+  // root are left out
+  parents.reserve(num_nodes);
+  for (int i = 0; i < num_nodes; i++) {
+    if (parents_idx[i] == -1) continue;
     parents[idx_to_image_id[i]] = idx_to_image_id[parents_idx[i]];
   }
 
@@ -6,14 +6,31 @@
 namespace glomap {
 enum WeightType { INLIER_NUM, INLIER_RATIO };
 
+// Undirected edge between the nodes [0, num_nodes) of a graph
+struct WeightedEdge {
+  int node1;
+  int node2;
+  double weight;
+};
+
 // Return the number of nodes in the tree
 int BFS(const std::vector<std::vector<int>>& graph,
         int root,
         std::vector<int>& parents,
         std::vector<std::pair<int, int>> banned_edges = {});
 
+// Compute a maximum spanning forest with Boruvka's algorithm. The graph is
+// stored in CSR form, and in every round each node finds its heaviest edge
+// leaving its component in parallel, while dropping the edges inside it. Ties
+// are broken by the edge index, so the forest does not depend on the number
+// of threads. Returns the indices of the edges of the forest.
+std::vector<int> MaximumSpanningForest(int num_nodes,
+                                       const std::vector<WeightedEdge>& edges,
+                                       int num_threads = -1);
+
 image_t MaximumSpanningTree(const ViewGraph& view_graph,
                             const std::unordered_map<image_t, Image>& images,
                             std::unordered_map<image_t, image_t>& parents,
-                            WeightType type);
-}  // namespace glomap
\ No newline at end of file
+                            WeightType type,
+                            int num_threads = -1);
+}  // namespace glomap
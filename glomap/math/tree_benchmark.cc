@@ -0,0 +1,96 @@
+// Benchmark of MaximumSpanningForest on random graphs with 10k to 1M nodes.
+// Every forest is checked against a serial Kruskal over the edges sorted in
+// the same strict order, which has the same unique result.
+
+#include "glomap/math/tree.h"
+#include "glomap/math/union_find.h"
+
+#include <colmap/util/timer.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+#include <random>
+
+namespace glomap {
+namespace {
+
+// Random graph with the given average degree. The weights are integers, as
+// for inlier counts, so that many edges have equal weights.
+std::vector<WeightedEdge> RandomGraph(int num_nodes, int average_degree) {
+  std::mt19937 rng(num_nodes);
+  std::uniform_int_distribution<int> node_dist(0, num_nodes - 1);
+  std::uniform_int_distribution<int> weight_dist(30, 1000);
+  std::vector<WeightedEdge> edges(
+      static_cast<size_t>(num_nodes) * average_degree / 2);
+  for (WeightedEdge& edge : edges) {
+    edge.node1 = node_dist(rng);
+    edge.node2 = node_dist(rng);
+    edge.weight = weight_dist(rng);
+  }
+  return edges;
+}
+
+std::vector<int> KruskalForest(int num_nodes,
+                               const std::vector<WeightedEdge>& edges) {
+  std::vector<int> order(edges.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](int edge1, int edge2) {
+    return edges[edge1].weight > edges[edge2].weight;
+  });
+  DenseUnionFind<int> union_find(num_nodes);
+  std::vector<int> forest;
+  for (const int edge_idx : order) {
+    const WeightedEdge& edge = edges[edge_idx];
+    if (union_find.Find(edge.node1) == union_find.Find(edge.node2)) continue;
+    union_find.Union(edge.node1, edge.node2);
+    forest.push_back(edge_idx);
+  }
+  return forest;
+}
+
+bool RunBenchmark(int num_nodes, int average_degree) {
+  const std::vector<WeightedEdge> edges =
+      RandomGraph(num_nodes, average_degree);
+
+  colmap::Timer timer;
+  timer.Start();
+  std::vector<int> kruskal_forest = KruskalForest(num_nodes, edges);
+  const double kruskal_seconds = timer.ElapsedSeconds();
+
+  timer.Restart();
+  std::vector<int> serial_forest =
+      MaximumSpanningForest(num_nodes, edges, /*num_threads=*/1);
+  const double serial_seconds = timer.ElapsedSeconds();
+
+  timer.Restart();
+  std::vector<int> parallel_forest = MaximumSpanningForest(num_nodes, edges);
+  const double parallel_seconds = timer.ElapsedSeconds();
+
+  std::sort(kruskal_forest.begin(), kruskal_forest.end());
+  std::sort(serial_forest.begin(), serial_forest.end());
+  std::sort(parallel_forest.begin(), parallel_forest.end());
+  const bool success =
+      kruskal_forest == serial_forest && kruskal_forest == parallel_forest;
+
+  std::cout << "nodes: " << num_nodes << ", edges: " << edges.size()
+            << ", forest edges: " << kruskal_forest.size()
+            << ", kruskal: " << kruskal_seconds
+            << "s, boruvka (1 thread): " << serial_seconds
+            << "s, boruvka (all threads): " << parallel_seconds << "s"
+            << (success ? "" : ", MISMATCH") << std::endl;
+  return success;
+}
+
+}  // namespace
+}  // namespace glomap
+
+int main(int argc, char** argv) {
+  const int average_degree = argc > 1 ? std::atoi(argv[1]) : 20;
+  bool success = true;
+  for (const int num_nodes : {10000, 100000, 1000000}) {
+    success &= glomap::RunBenchmark(num_nodes, average_degree);
+  }
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -2,7 +2,118 @@
 
 #include "glomap/math/two_view_geometry.h"
 
+#include <colmap/util/threading.h>
+#include <colmap/util/timer.h>
+
 namespace glomap {
+namespace {
+
+// Undistorted rays of the matches of an image pair, stored as structure of
+// arrays
+struct RayBuffers {
+  std::vector<double> x1, y1, z1, x2, y2, z2;
+
+  size_t Size() const { return x1.size(); }
+
+  void Gather(const FeatureRays& rays1,
+              const FeatureRays& rays2,
+              const Eigen::MatrixXi& matches) {
+    const size_t num_matches = matches.rows();
+    for (auto* buffer : {&x1, &y1, &z1, &x2, &y2, &z2}) {
+      buffer->resize(num_matches);
+    }
+    for (size_t k = 0; k < num_matches; ++k) {
+      const int idx1 = matches(k, 0);
+      const int idx2 = matches(k, 1);
+      x1[k] = rays1.X()[idx1];
+      y1[k] = rays1.Y()[idx1];
+      z1[k] = rays1.Z()[idx1];
+      x2[k] = rays2.X()[idx2];
+      y2[k] = rays2.Y()[idx2];
+      z2[k] = rays2.Z()[idx2];
+    }
+  }
+};
+
+// Branch-free evaluation of SampsonError, CheckCheirality (with depth range
+// [1e-2, 100]) and the triangulation angle / epipole checks of
+// ScoreErrorEssential over all the rays, so that the loop is vectorized
+void ScoreEssentialBatch(const Eigen::Matrix3d& E,
+                         const Rigid3d& cam2_from_cam1,
+                         const Eigen::Vector3d& epipole12,
+                         const Eigen::Vector3d& epipole21,
+                         double thres_angle,
+                         double thres_epipole,
+                         const RayBuffers& rays,
+                         double* errors,
+                         char* valid) {
+  const Eigen::Matrix3d R = cam2_from_cam1.rotation.toRotationMatrix();
+  const Eigen::Vector3d& t = cam2_from_cam1.translation;
+  const double e00 = E(0, 0), e01 = E(0, 1), e02 = E(0, 2);
+  const double e10 = E(1, 0), e11 = E(1, 1), e12 = E(1, 2);
+  const double e20 = E(2, 0), e21 = E(2, 1), e22 = E(2, 2);
+  const double r00 = R(0, 0), r01 = R(0, 1), r02 = R(0, 2);
+  const double r10 = R(1, 0), r11 = R(1, 1), r12 = R(1, 2);
+  const double r20 = R(2, 0), r21 = R(2, 1), r22 = R(2, 2);
+  const double t0 = t[0], t1 = t[1], t2 = t[2];
+  const double ep12_0 = epipole12[0], ep12_1 = epipole12[1],
+               ep12_2 = epipole12[2];
+  const double ep21_0 = epipole21[0], ep21_1 = epipole21[1],
+               ep21_2 = epipole21[2];
+
+  const double* x1 = rays.x1.data();
+  const double* y1 = rays.y1.data();
+  const double* z1 = rays.z1.data();
+  const double* x2 = rays.x2.data();
+  const double* y2 = rays.y2.data();
+  const double* z2 = rays.z2.data();
+  const int num_rays = rays.Size();
+
+#pragma omp simd
+  for (int k = 0; k < num_rays; ++k) {
+    // Sampson error
+    const double inv_w1 = 1. / (EPS + z1[k]);
+    const double inv_w2 = 1. / (EPS + z2[k]);
+    const double ex1_0 = (e00 * x1[k] + e01 * y1[k] + e02 * z1[k]) * inv_w1;
+    const double ex1_1 = (e10 * x1[k] + e11 * y1[k] + e12 * z1[k]) * inv_w1;
+    const double ex1_2 = (e20 * x1[k] + e21 * y1[k] + e22 * z1[k]) * inv_w1;
+    const double etx2_0 = (e00 * x2[k] + e10 * y2[k] + e20 * z2[k]) * inv_w2;
+    const double etx2_1 = (e01 * x2[k] + e11 * y2[k] + e21 * z2[k]) * inv_w2;
+    const double c = ex1_0 * x2[k] + ex1_1 * y2[k] + ex1_2 * z2[k];
+    const double cx = ex1_0 * ex1_0 + ex1_1 * ex1_1;
+    const double cy = etx2_0 * etx2_0 + etx2_1 * etx2_1;
+    errors[k] = c * c / (cx + cy);
+
+    // Cheirality
+    const double rx1_0 = r00 * x1[k] + r01 * y1[k] + r02 * z1[k];
+    const double rx1_1 = r10 * x1[k] + r11 * y1[k] + r12 * z1[k];
+    const double rx1_2 = r20 * x1[k] + r21 * y1[k] + r22 * z1[k];
+    const double a = -(rx1_0 * x2[k] + rx1_1 * y2[k] + rx1_2 * z2[k]);
+    const double b1 = -(rx1_0 * t0 + rx1_1 * t1 + rx1_2 * t2);
+    const double b2 = x2[k] * t0 + y2[k] * t1 + z2[k] * t2;
+    const double lambda1 = b1 - a * b2;
+    const double lambda2 = -a * b1 + b2;
+    const double scale = 1 - a * a;
+    const bool cheirality = (lambda1 > 1e-2 * scale) &
+                            (lambda2 > 1e-2 * scale) &
+                            (lambda1 < 100. * scale) & (lambda2 < 100. * scale);
+
+    // Check whether two image rays are too close, and whether the points are
+    // too close to the epipoles
+    const double diff_angle = -a;
+    const double diff_epipole1 =
+        x1[k] * ep21_0 + y1[k] * ep21_1 + z1[k] * ep21_2;
+    const double diff_epipole2 =
+        x2[k] * ep12_0 + y2[k] * ep12_1 + z2[k] * ep12_2;
+    const bool not_degenerate = (diff_angle < thres_angle) &
+                                (diff_epipole1 < thres_epipole) &
+                                (diff_epipole2 < thres_epipole);
+
+    valid[k] = cheirality & not_degenerate;
+  }
+}
+
+}  // namespace
 
 double ImagePairInliers::ScoreError() {
   // Count inliers base on the type
@@ -34,20 +145,19 @@ double ImagePairInliers::ScoreErrorEssential() {
     image_pair.inliers.clear();
   }
 
-  image_t image_id1 = image_pair.image_id1;
-  image_t image_id2 = image_pair.image_id2;
+  const Image& image1 = images.at(image_pair.image_id1);
+  const Image& image2 = images.at(image_pair.image_id2);
 
   double thres = options.max_epipolar_error_E;
 
   // Conver the threshold from pixel space to normalized space
   thres = options.max_epipolar_error_E * 0.5 *
-          (1. / cameras->at(images.at(image_id1).camera_id).Focal() +
-           1. / cameras->at(images.at(image_id2).camera_id).Focal());
+          (1. / cameras->at(image1.camera_id).Focal() +
+           1. / cameras->at(image2.camera_id).Focal());
 
   // Square the threshold for faster computation
   double sq_threshold = thres * thres;
   double score = 0.;
-  Eigen::Vector3d pt1, pt2;
 
   // TODO: determine the best threshold for triangulation angle
   // double thres_angle = std::cos(DegToRad(1.));
@@ -55,35 +165,31 @@ double ImagePairInliers::ScoreErrorEssential() {
   double thres_angle = 1;
   thres_angle += 1e-6;
   thres_epipole += 1e-6;
-  for (size_t k = 0; k < image_pair.matches.rows(); ++k) {
-    // Use the undistorted features
-    pt1 = images.at(image_id1).features_undist[image_pair.matches(k, 0)];
-    pt2 = images.at(image_id2).features_undist[image_pair.matches(k, 1)];
-    const double r2 = SampsonError(E, pt1, pt2);
-
-    if (r2 < sq_threshold) {
-      bool cheirality = CheckCheirality(cam2_from_cam1, pt1, pt2, 1e-2, 100.);
 
-      // Check whether two image rays have small triangulation angle or are too
-      // close to the epipoles
-      bool not_denegerate = true;
-
-      // Check whether two image rays are too close
-      double diff_angle = pt1.dot(cam2_from_cam1.rotation.inverse() * pt2);
-      not_denegerate = (diff_angle < thres_angle);
-
-      // Check whether two points are too close to the epipoles
-      double diff_epipole1 = pt1.dot(epipole21);
-      double diff_epipole2 = pt2.dot(epipole12);
-      not_denegerate = not_denegerate && (diff_epipole1 < thres_epipole &&
-                                          diff_epipole2 < thres_epipole);
-
-      if (cheirality && not_denegerate) {
-        score += r2;
-        image_pair.inliers.push_back(k);
-      } else {
-        score += sq_threshold;
-      }
+  // Use the undistorted features, gathered into contiguous buffers so that
+  // all the matches are scored in one vectorized pass
+  thread_local RayBuffers rays;
+  thread_local std::vector<double> errors;
+  thread_local std::vector<char> valid;
+  rays.Gather(
+      image1.features_undist, image2.features_undist, image_pair.matches);
+  errors.resize(rays.Size());
+  valid.resize(rays.Size());
+  ScoreEssentialBatch(E,
+                      cam2_from_cam1,
+                      epipole12,
+                      epipole21,
+                      thres_angle,
+                      thres_epipole,
+                      rays,
+                      errors.data(),
+                      valid.data());
+
+  for (size_t k = 0; k < rays.Size(); ++k) {
+    const double r2 = errors[k];
+    if (r2 < sq_threshold && valid[k]) {
+      score += r2;
+      image_pair.inliers.push_back(k);
     } else {
       score += sq_threshold;
     }
@@ -114,8 +220,8 @@ double ImagePairInliers::ScoreErrorFundamental() {
   int positive_count = 0;
   int negative_count = 0;
 
-  image_t image_id1 = image_pair.image_id1;
-  image_t image_id2 = image_pair.image_id2;
+  const Image& image1 = images.at(image_pair.image_id1);
+  const Image& image2 = images.at(image_pair.image_id2);
 
   double thres = options.max_epipolar_error_F;
   double sq_threshold = thres * thres;
@@ -126,8 +232,8 @@ double ImagePairInliers::ScoreErrorFundamental() {
   std::vector<int> inliers_pre;
   std::vector<double> errors;
   for (size_t k = 0; k < image_pair.matches.rows(); ++k) {
-    pt1 = images.at(image_id1).features[image_pair.matches(k, 0)];
-    pt2 = images.at(image_id2).features[image_pair.matches(k, 1)];
+    pt1 = image1.features[image_pair.matches(k, 0)];
+    pt2 = image2.features[image_pair.matches(k, 1)];
     const double r2 = SampsonError(image_pair.F, pt1, pt2);
 
     if (r2 < sq_threshold) {
@@ -168,16 +274,16 @@ double ImagePairInliers::ScoreErrorHomography() {
     image_pair.inliers.clear();
   }
 
-  image_t image_id1 = image_pair.image_id1;
-  image_t image_id2 = image_pair.image_id2;
+  const Image& image1 = images.at(image_pair.image_id1);
+  const Image& image2 = images.at(image_pair.image_id2);
 
   double thres = options.max_epipolar_error_H;
   double sq_threshold = thres * thres;
   double score = 0.;
   Eigen::Vector2d pt1, pt2;
   for (size_t k = 0; k < image_pair.matches.rows(); ++k) {
-    pt1 = images.at(image_id1).features[image_pair.matches(k, 0)];
-    pt2 = images.at(image_id2).features[image_pair.matches(k, 1)];
+    pt1 = image1.features[image_pair.matches(k, 0)];
+    pt2 = image2.features[image_pair.matches(k, 1)];
     const double r2 = HomographyError(image_pair.H, pt1, pt2);
 
     if (r2 < sq_threshold) {
@@ -202,14 +308,35 @@ void ImagePairsInlierCount(ViewGraph& view_graph,
                            const std::unordered_map<image_t, Image>& images,
                            const InlierThresholdOptions& options,
                            bool clean_inliers) {
+  std::vector<ImagePair*> image_pairs;
+  size_t num_matches = 0;
   for (auto& [pair_id, image_pair] : view_graph.image_pairs) {
     if (!clean_inliers && image_pair.inliers.size() > 0) continue;
     image_pair.inliers.clear();
 
     if (image_pair.is_valid == false) continue;
-    ImagePairInliers inlier_finder(image_pair, images, options, &cameras);
-    inlier_finder.ScoreError();
+    image_pairs.push_back(&image_pair);
+    num_matches += image_pair.matches.rows();
+  }
+
+  colmap::Timer timer;
+  timer.Start();
+
+  // The pairs are independent of each other
+  colmap::ThreadPool thread_pool(colmap::ThreadPool::kMaxNumThreads);
+  for (ImagePair* image_pair : image_pairs) {
+    thread_pool.AddTask([&, image_pair]() {
+      ImagePairInliers inlier_finder(*image_pair, images, options, &cameras);
+      inlier_finder.ScoreError();
+    });
   }
+  thread_pool.Wait();
+
+  LOG(INFO) << "Counted inliers for " << image_pairs.size() << " pairs ("
+            << num_matches << " matches) in " << timer.ElapsedSeconds()
+            << " seconds, "
+            << num_matches / std::max(timer.ElapsedSeconds(), EPS)
+            << " matches / second";
 }
 
-}  // namespace glomap
\ No newline at end of file
+}  // namespace glomap
@@ -0,0 +1,186 @@
+// Benchmark of the inlier counting of calibrated image pairs on random pairs.
+// The batched kernel of ImagePairInliers is timed against the scalar loop it
+// replaced, on one thread each, and ImagePairsInlierCount on all threads.
+// Every result is checked against the inliers of the scalar loop.
+
+#include "glomap/math/two_view_geometry.h"
+#include "glomap/processors/image_pair_inliers.h"
+
+#include <colmap/util/timer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+#include <random>
+
+namespace glomap {
+namespace {
+
+constexpr double kFocal = 1000.;
+
+Eigen::Vector3d RandomRay(std::mt19937& rng) {
+  std::normal_distribution<double> dist(0, 1);
+  Eigen::Vector3d ray(dist(rng), dist(rng), dist(rng));
+  return ray.normalized();
+}
+
+// Random calibrated pairs, each between two images of its own. The matches
+// are projections of random points with pixel noise, and a third of them are
+// outliers. The features of the second image are shuffled, so that the
+// gathering of the rays reads them in random order.
+void RandomPairs(int num_pairs,
+                 int num_matches,
+                 std::unordered_map<camera_t, Camera>& cameras,
+                 std::unordered_map<image_t, Image>& images,
+                 ViewGraph& view_graph) {
+  std::mt19937 rng(num_pairs);
+  std::uniform_real_distribution<double> unit_dist(-1, 1);
+  std::uniform_real_distribution<double> depth_dist(2, 10);
+  std::normal_distribution<double> noise_dist(0, 0.5 / kFocal);
+
+  cameras[1] = colmap::Camera::CreateFromModelId(
+      1, colmap::SimplePinholeCameraModel::model_id, kFocal, 1920, 1080);
+
+  std::vector<int> permutation(num_matches);
+  for (int pair_idx = 0; pair_idx < num_pairs; ++pair_idx) {
+    const image_t image_id1 = 2 * pair_idx + 1;
+    const image_t image_id2 = 2 * pair_idx + 2;
+    Image& image1 =
+        images.emplace(image_id1, Image(image_id1, 1, "")).first->second;
+    Image& image2 =
+        images.emplace(image_id2, Image(image_id2, 1, "")).first->second;
+
+    const Eigen::Vector3d axis = RandomRay(rng);
+    const Rigid3d cam2_from_cam1(
+        Eigen::Quaterniond(Eigen::AngleAxisd(0.3 * unit_dist(rng), axis)),
+        RandomRay(rng));
+
+    ImagePair image_pair(image_id1, image_id2, cam2_from_cam1);
+    image_pair.config = colmap::TwoViewGeometry::CALIBRATED;
+    image_pair.matches.resize(num_matches, 2);
+    image1.features_undist.resize(num_matches);
+    image2.features_undist.resize(num_matches);
+    std::iota(permutation.begin(), permutation.end(), 0);
+    std::shuffle(permutation.begin(), permutation.end(), rng);
+    for (int k = 0; k < num_matches; ++k) {
+      const Eigen::Vector3d point =
+          depth_dist(rng) *
+          Eigen::Vector3d(0.5 * unit_dist(rng), 0.5 * unit_dist(rng), 1);
+      Eigen::Vector3d ray1 = point / point.z();
+      Eigen::Vector3d ray2 = cam2_from_cam1 * point;
+      ray2 /= ray2.z();
+      ray1.head<2>() += Eigen::Vector2d(noise_dist(rng), noise_dist(rng));
+      ray2.head<2>() += Eigen::Vector2d(noise_dist(rng), noise_dist(rng));
+      image1.features_undist.Set(k, ray1.normalized());
+      image2.features_undist.Set(
+          permutation[k], k % 3 == 0 ? RandomRay(rng) : ray2.normalized());
+      image_pair.matches(k, 0) = k;
+      image_pair.matches(k, 1) = permutation[k];
+    }
+    view_graph.image_pairs.emplace(image_pair.pair_id, image_pair);
+  }
+}
+
+// The per-match loop of ScoreErrorEssential before it was batched
+std::vector<int> ScalarInliers(const ImagePair& image_pair,
+                               const std::unordered_map<image_t, Image>& images,
+                               const InlierThresholdOptions& options) {
+  const Rigid3d& cam2_from_cam1 = image_pair.cam2_from_cam1;
+  Eigen::Matrix3d E;
+  EssentialFromMotion(cam2_from_cam1, &E);
+
+  Eigen::Vector3d epipole12 = cam2_from_cam1.translation;
+  Eigen::Vector3d epipole21 = Inverse(cam2_from_cam1).translation;
+  if (epipole12[2] < 0) epipole12 = -epipole12;
+  if (epipole21[2] < 0) epipole21 = -epipole21;
+
+  const Image& image1 = images.at(image_pair.image_id1);
+  const Image& image2 = images.at(image_pair.image_id2);
+  const double thres = options.max_epipolar_error_E / kFocal;
+  const double sq_threshold = thres * thres;
+  const double thres_angle = 1 + 1e-6;
+  const double thres_epipole = std::cos(DegToRad(3.)) + 1e-6;
+
+  std::vector<int> inliers;
+  for (size_t k = 0; k < image_pair.matches.rows(); ++k) {
+    const Eigen::Vector3d pt1 =
+        image1.features_undist[image_pair.matches(k, 0)];
+    const Eigen::Vector3d pt2 =
+        image2.features_undist[image_pair.matches(k, 1)];
+    if (SampsonError(E, pt1, pt2) >= sq_threshold) continue;
+    if (!CheckCheirality(cam2_from_cam1, pt1, pt2, 1e-2, 100.)) continue;
+    const double diff_angle =
+        pt1.dot(cam2_from_cam1.rotation.inverse() * pt2);
+    if (diff_angle >= thres_angle || pt1.dot(epipole21) >= thres_epipole ||
+        pt2.dot(epipole12) >= thres_epipole) {
+      continue;
+    }
+    inliers.push_back(k);
+  }
+  return inliers;
+}
+
+bool RunBenchmark(int num_pairs, int num_matches) {
+  std::unordered_map<camera_t, Camera> cameras;
+  std::unordered_map<image_t, Image> images;
+  ViewGraph view_graph;
+  RandomPairs(num_pairs, num_matches, cameras, images, view_graph);
+  const InlierThresholdOptions options;
+
+  std::vector<ImagePair*> image_pairs;
+  for (auto& [pair_id, image_pair] : view_graph.image_pairs) {
+    image_pairs.push_back(&image_pair);
+  }
+
+  colmap::Timer timer;
+  timer.Start();
+  std::vector<std::vector<int>> scalar_inliers;
+  for (const ImagePair* image_pair : image_pairs) {
+    scalar_inliers.push_back(ScalarInliers(*image_pair, images, options));
+  }
+  const double scalar_seconds = timer.ElapsedSeconds();
+
+  timer.Restart();
+  for (ImagePair* image_pair : image_pairs) {
+    ImagePairInliers(*image_pair, images, options, &cameras).ScoreError();
+  }
+  const double batched_seconds = timer.ElapsedSeconds();
+
+  bool success = true;
+  size_t num_inliers = 0;
+  for (size_t i = 0; i < image_pairs.size(); ++i) {
+    success &= image_pairs[i]->inliers == scalar_inliers[i];
+    num_inliers += scalar_inliers[i].size();
+  }
+
+  timer.Restart();
+  ImagePairsInlierCount(view_graph, cameras, images, options, true);
+  const double parallel_seconds = timer.ElapsedSeconds();
+  for (size_t i = 0; i < image_pairs.size(); ++i) {
+    success &= image_pairs[i]->inliers == scalar_inliers[i];
+  }
+
+  std::cout << "pairs: " << num_pairs << ", matches: "
+            << static_cast<size_t>(num_pairs) * num_matches
+            << ", inliers: " << num_inliers
+            << ", scalar (1 thread): " << num_pairs / scalar_seconds
+            << " pairs/s, batched (1 thread): " << num_pairs / batched_seconds
+            << " pairs/s, batched (all threads): "
+            << num_pairs / parallel_seconds << " pairs/s"
+            << (success ? "" : ", MISMATCH") << std::endl;
+  return success;
+}
+
+}  // namespace
+}  // namespace glomap
+
+int main(int argc, char** argv) {
+  const int num_matches = argc > 1 ? std::atoi(argv[1]) : 1000;
+  bool success = true;
+  for (const int num_pairs : {1000, 4000}) {
+    success &= glomap::RunBenchmark(num_pairs, num_matches);
+  }
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,41 +1,63 @@
 #include "glomap/processors/image_undistorter.h"
 
+#include "glomap/math/hash.h"
+
 #include <colmap/util/threading.h>
 
 namespace glomap {
+namespace {
+
+uint64_t HashIntrinsics(const Camera& camera) {
+  Fnv1aHasher hasher;
+  hasher.Add(static_cast<int>(camera.model_id));
+  hasher.Add(camera.width);
+  hasher.Add(camera.height);
+  hasher.AddBytes(camera.params.data(), camera.params.size() * sizeof(double));
+  return hasher.Hash();
+}
+
+}  // namespace
 
 void UndistortImages(std::unordered_map<camera_t, Camera>& cameras,
                      std::unordered_map<image_t, Image>& images,
                      bool clean_points) {
-  std::vector<image_t> image_ids;
+  // The rays of an image are only computed again if the intrinsics of its
+  // camera changed since they were computed
+  std::unordered_map<camera_t, uint64_t> intrinsics;
+  intrinsics.reserve(cameras.size());
+  for (const auto& [camera_id, camera] : cameras) {
+    intrinsics.emplace(camera_id, HashIntrinsics(camera));
+  }
+
+  std::vector<Image*> images_to_undistort;
   for (auto& [image_id, image] : images) {
-    const int num_points = image.features.size();
-    if (image.features_undist.size() == num_points && !clean_points)
+    const uint64_t camera_intrinsics = intrinsics.at(image.camera_id);
+    if (image.features_undist.size() == image.features.size() &&
+        (!clean_points ||
+         image.features_undist_intrinsics == camera_intrinsics))
       continue;  // already undistorted
-    image_ids.push_back(image_id);
+    image.features_undist_intrinsics = camera_intrinsics;
+    images_to_undistort.push_back(&image);
   }
 
   colmap::ThreadPool thread_pool(colmap::ThreadPool::kMaxNumThreads);
 
-  LOG(INFO) << "Undistorting images..";
-  const int num_images = image_ids.size();
-  for (int image_idx = 0; image_idx < num_images; image_idx++) {
-    Image& image = images[image_ids[image_idx]];
-    const int num_points = image.features.size();
-    if (image.features_undist.size() == num_points && !clean_points)
-      continue;  // already undistorted
-
-    const Camera& camera = cameras[image.camera_id];
+  LOG(INFO) << "Undistorting " << images_to_undistort.size() << " / "
+            << images.size() << " images..";
+  for (Image* image_ptr : images_to_undistort) {
+    Image& image = *image_ptr;
+    const Camera& camera = cameras.at(image.camera_id);
 
-    thread_pool.AddTask([&image, &camera, num_points]() {
+    thread_pool.AddTask([&image, &camera]() {
+      const int num_points = image.features.size();
       image.features_undist.clear();
-      image.features_undist.reserve(num_points);
+      image.features_undist.resize(num_points);
       for (int i = 0; i < num_points; i++) {
-        image.features_undist.emplace_back(
-            camera.CamFromImg(image.features[i])
-                .value_or(Eigen::Vector2d::Zero())
-                .homogeneous()
-                .normalized());
+        image.features_undist.Set(i,
+                                  camera.CamFromImg(image.features[i])
+                                      .value_or(Eigen::Vector2d::Zero())
+                                      .homogeneous()
+                                      .normalized());
       }
     });
   }
@@ -0,0 +1,207 @@
+#include "glomap/processors/view_graph_partitioning.h"
+
+#include <colmap/util/logging.h>
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+#ifdef GLOMAP_METIS_ENABLED
+#include <metis.h>
+#endif
+
+namespace glomap {
+namespace {
+
+// Undirected frame graph in CSR form, with the number of inliers between two
+// frames as edge weight
+struct FrameGraph {
+  std::vector<frame_t> frame_ids;
+  std::vector<int> offsets;
+  std::vector<int> neighbors;
+  std::vector<int> weights;
+
+  int NumNodes() const { return frame_ids.size(); }
+};
+
+FrameGraph BuildFrameGraph(const ViewGraph& view_graph,
+                           const std::unordered_map<frame_t, Frame>& frames,
+                           const std::unordered_map<image_t, Image>& images) {
+  FrameGraph graph;
+  std::unordered_map<frame_t, int> frame_id_to_node;
+  for (const auto& [frame_id, frame] : frames) {
+    if (!frame.is_registered) continue;
+    graph.frame_ids.push_back(frame_id);
+  }
+  std::sort(graph.frame_ids.begin(), graph.frame_ids.end());
+  for (int node = 0; node < graph.NumNodes(); node++) {
+    frame_id_to_node[graph.frame_ids[node]] = node;
+  }
+
+  // Accumulate the inliers of the pairs between two frames
+  std::vector<std::unordered_map<int, int>> adjacency(graph.NumNodes());
+  for (const auto& [pair_id, image_pair] : view_graph.image_pairs) {
+    if (!image_pair.is_valid) continue;
+    const Image& image1 = images.at(image_pair.image_id1);
+    const Image& image2 = images.at(image_pair.image_id2);
+    if (!image1.IsRegistered() || !image2.IsRegistered()) continue;
+    const int node1 = frame_id_to_node.at(image1.frame_id);
+    const int node2 = frame_id_to_node.at(image2.frame_id);
+    if (node1 == node2) continue;
+    const int weight = std::max<int>(1, image_pair.inliers.size());
+    adjacency[node1][node2] += weight;
+    adjacency[node2][node1] += weight;
+  }
+
+  graph.offsets.resize(graph.NumNodes() + 1, 0);
+  for (int node = 0; node < graph.NumNodes(); node++) {
+    graph.offsets[node + 1] = graph.offsets[node] + adjacency[node].size();
+  }
+  graph.neighbors.reserve(graph.offsets.back());
+  graph.weights.reserve(graph.offsets.back());
+  for (int node = 0; node < graph.NumNodes(); node++) {
+    std::vector<std::pair<int, int>> edges(adjacency[node].begin(),
+                                           adjacency[node].end());
+    std::sort(edges.begin(), edges.end());
+    for (const auto& [neighbor, weight] : edges) {
+      graph.neighbors.push_back(neighbor);
+      graph.weights.push_back(weight);
+    }
+  }
+  return graph;
+}
+
+#ifdef GLOMAP_METIS_ENABLED
+bool PartitionWithMetis(const FrameGraph& graph,
+                        int num_clusters,
+                        std::vector<int>& node_to_cluster) {
+  idx_t num_nodes = graph.NumNodes();
+  idx_t num_constraints = 1;
+  idx_t num_parts = num_clusters;
+  idx_t edge_cut = 0;
+  std::vector<idx_t> offsets(graph.offsets.begin(), graph.offsets.end());
+  std::vector<idx_t> neighbors(graph.neighbors.begin(), graph.neighbors.end());
+  std::vector<idx_t> weights(graph.weights.begin(), graph.weights.end());
+  std::vector<idx_t> parts(num_nodes);
+  const int status = METIS_PartGraphKway(&num_nodes,
+                                         &num_constraints,
+                                         offsets.data(),
+                                         neighbors.data(),
+                                         /*vwgt=*/nullptr,
+                                         /*vsize=*/nullptr,
+                                         weights.data(),
+                                         &num_parts,
+                                         /*tpwgts=*/nullptr,
+                                         /*ubvec=*/nullptr,
+                                         /*options=*/nullptr,
+                                         &edge_cut,
+                                         parts.data());
+  if (status != METIS_OK) {
+    LOG(ERROR) << "METIS failed to partition the view graph: " << status;
+    return false;
+  }
+  node_to_cluster.assign(parts.begin(), parts.end());
+  VLOG(2) << "METIS edge cut: " << edge_cut;
+  return true;
+}
+#endif
+
+// Grow the clusters one after the other in breadth-first order, following the
+// strongest edges first
+void PartitionByGrowing(const FrameGraph& graph,
+                        int max_cluster_size,
+                        std::vector<int>& node_to_cluster) {
+  node_to_cluster.assign(graph.NumNodes(), -1);
+  int num_clusters = 0;
+  for (int seed = 0; seed < graph.NumNodes(); seed++) {
+    if (node_to_cluster[seed] != -1) continue;
+    const int cluster = num_clusters++;
+    int cluster_size = 0;
+    std::priority_queue<std::pair<int, int>> queue;
+    queue.emplace(0, seed);
+    while (!queue.empty() && cluster_size < max_cluster_size) {
+      const int node = queue.top().second;
+      queue.pop();
+      if (node_to_cluster[node] != -1) continue;
+      node_to_cluster[node] = cluster;
+      cluster_size++;
+      for (int k = graph.offsets[node]; k < graph.offsets[node + 1]; k++) {
+        if (node_to_cluster[graph.neighbors[k]] == -1) {
+          queue.emplace(graph.weights[k], graph.neighbors[k]);
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+std::vector<std::vector<frame_t>> PartitionViewGraph(
+    const ViewGraph& view_graph,
+    const std::unordered_map<frame_t, Frame>& frames,
+    const std::unordered_map<image_t, Image>& images,
+    const ViewGraphPartitionOptions& options) {
+  const FrameGraph graph = BuildFrameGraph(view_graph, frames, images);
+  const int max_cluster_size = std::max(1, options.max_num_frames_per_cluster);
+  if (graph.NumNodes() <= max_cluster_size) {
+    return {graph.frame_ids};
+  }
+
+  std::vector<int> node_to_cluster;
+  const int num_clusters =
+      (graph.NumNodes() + max_cluster_size - 1) / max_cluster_size;
+  bool partitioned = false;
+#ifdef GLOMAP_METIS_ENABLED
+  partitioned = PartitionWithMetis(graph, num_clusters, node_to_cluster);
+#endif
+  if (!partitioned) {
+    PartitionByGrowing(graph, max_cluster_size, node_to_cluster);
+  }
+
+  const int num_partitions =
+      *std::max_element(node_to_cluster.begin(), node_to_cluster.end()) + 1;
+  std::vector<std::vector<int>> cluster_nodes(num_partitions);
+  for (int node = 0; node < graph.NumNodes(); node++) {
+    cluster_nodes[node_to_cluster[node]].push_back(node);
+  }
+
+  // Extend the clusters by the frames across the strongest cut edges
+  std::vector<std::vector<frame_t>> clusters;
+  clusters.reserve(num_partitions);
+  for (int cluster = 0; cluster < num_partitions; cluster++) {
+    if (cluster_nodes[cluster].empty()) continue;
+    std::unordered_map<int, int> cut_weights;
+    for (const int node : cluster_nodes[cluster]) {
+      for (int k = graph.offsets[node]; k < graph.offsets[node + 1]; k++) {
+        const int neighbor = graph.neighbors[k];
+        if (node_to_cluster[neighbor] != cluster) {
+          cut_weights[neighbor] += graph.weights[k];
+        }
+      }
+    }
+    std::vector<std::pair<int, int>> overlap;
+    overlap.reserve(cut_weights.size());
+    for (const auto& [neighbor, weight] : cut_weights) {
+      overlap.emplace_back(weight, neighbor);
+    }
+    std::sort(overlap.begin(), overlap.end(), std::greater<>());
+    if (overlap.size() > static_cast<size_t>(options.max_num_overlap_frames)) {
+      overlap.resize(std::max(0, options.max_num_overlap_frames));
+    }
+
+    std::vector<frame_t>& frame_ids = clusters.emplace_back();
+    frame_ids.reserve(cluster_nodes[cluster].size() + overlap.size());
+    for (const int node : cluster_nodes[cluster]) {
+      frame_ids.push_back(graph.frame_ids[node]);
+    }
+    for (const auto& [weight, neighbor] : overlap) {
+      frame_ids.push_back(graph.frame_ids[neighbor]);
+    }
+  }
+
+  LOG(INFO) << "Partitioned " << graph.NumNodes() << " frames into "
+            << clusters.size() << " clusters";
+  return clusters;
+}
+
+}  // namespace glomap
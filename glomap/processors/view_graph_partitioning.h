@@ -0,0 +1,30 @@
+#pragma once
+
+#include "glomap/scene/types_sfm.h"
+
+#include <vector>
+
+namespace glomap {
+
+struct ViewGraphPartitionOptions {
+  // Maximum number of frames of a cluster before the overlap is added
+  int max_num_frames_per_cluster = 2000;
+
+  // Maximum number of frames that a cluster takes over from its neighbors.
+  // These are the frames connected to the cluster by the strongest cut pairs.
+  int max_num_overlap_frames = 200;
+};
+
+// Split the registered frames of the view graph into clusters, so that few
+// (weak) valid pairs connect different clusters, and extend every cluster by
+// the frames across its strongest cut pairs. The frame graph is partitioned
+// with METIS if glomap is built with it, and by growing clusters in
+// breadth-first order otherwise. Returns a single cluster if the graph is
+// small enough.
+std::vector<std::vector<frame_t>> PartitionViewGraph(
+    const ViewGraph& view_graph,
+    const std::unordered_map<frame_t, Frame>& frames,
+    const std::unordered_map<image_t, Image>& images,
+    const ViewGraphPartitionOptions& options);
+
+}  // namespace glomap
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Eigen/Core>
+
+#include <stdexcept>
+#include <vector>
+
+namespace glomap {
+
+// Unit rays of the features of an image, stored as arrays of float
+// coordinates. This takes half the memory of a vector of Eigen::Vector3d,
+// while the float precision is far below the noise of the features. The rays
+// are read back as Eigen::Vector3d.
+class FeatureRays {
+ public:
+  size_t size() const { return x_.size(); }
+  bool empty() const { return x_.empty(); }
+
+  void clear() {
+    x_.clear();
+    y_.clear();
+    z_.clear();
+  }
+
+  void resize(size_t size) {
+    x_.resize(size);
+    y_.resize(size);
+    z_.resize(size);
+  }
+
+  void Set(size_t idx, const Eigen::Vector3d& ray) {
+    x_[idx] = ray.x();
+    y_[idx] = ray.y();
+    z_[idx] = ray.z();
+  }
+
+  Eigen::Vector3d operator[](size_t idx) const {
+    return Eigen::Vector3d(x_[idx], y_[idx], z_[idx]);
+  }
+
+  Eigen::Vector3d at(size_t idx) const {
+    if (idx >= size()) throw std::out_of_range("FeatureRays::at");
+    return (*this)[idx];
+  }
+
+  // The coordinate arrays
+  const std::vector<float>& X() const { return x_; }
+  const std::vector<float>& Y() const { return y_; }
+  const std::vector<float>& Z() const { return z_; }
+
+ private:
+  std::vector<float> x_;
+  std::vector<float> y_;
+  std::vector<float> z_;
+};
+
+}  // namespace glomap
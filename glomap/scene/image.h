@@ -1,6 +1,7 @@
 #pragma once
 
 #include "glomap/math/gravity.h"
+#include "glomap/scene/feature_rays.h"
 #include "glomap/scene/frame.h"
 #include "glomap/scene/types.h"
 #include "glomap/types.h"
@@ -28,7 +29,9 @@ struct Image {
   // Distorted feature points in pixels.
   std::vector<Eigen::Vector2d> features;
   // Normalized feature rays, can be obtained by calling UndistortImages.
-  std::vector<Eigen::Vector3d> features_undist;
+  FeatureRays features_undist;
+  // Hash of the camera intrinsics features_undist was computed with
+  uint64_t features_undist_intrinsics = 0;
 
   // Methods
   inline Eigen::Vector3d Center() const;
@@ -2,15 +2,13 @@
 
 #include "glomap/math/union_find.h"
 
-#include <queue>
-
 namespace glomap {
 
 int ViewGraph::KeepLargestConnectedComponents(
     std::unordered_map<frame_t, Frame>& frames,
     std::unordered_map<image_t, Image>& images) {
-  EstablishAdjacencyList();
-  EstablishAdjacencyListFrame(images);
+  UpdateConnectivity(images);
+  adjacency_list_outdated = true;
 
   int num_comp = FindConnectedComponent();
 
@@ -25,7 +23,8 @@ int ViewGraph::KeepLargestConnectedComponents(
 
   if (max_img == 0) return 0;
 
-  std::unordered_set<image_t> largest_component = connected_components[max_idx];
+  const std::vector<frame_t>& largest_component =
+      connected_components[max_idx];
 
   // Set all frames to not registered
   for (auto& [frame_id, frame] : frames) {
@@ -53,28 +52,162 @@ int ViewGraph::KeepLargestConnectedComponents(
 
 int ViewGraph::FindConnectedComponent() {
   connected_components.clear();
-  std::unordered_map<image_t, bool> visited;
-  for (auto& [frame_id, neighbors] : adjacency_list_frame) {
-    visited[frame_id] = false;
+  const int num_frames = connectivity.frame_ids.size();
+  std::vector<int> root_to_component(num_frames, -1);
+  for (int frame_idx = 0; frame_idx < num_frames; frame_idx++) {
+    // Frames without valid pairs are not part of the graph
+    if (connectivity.num_valid_pairs[frame_idx] == 0) continue;
+    int& component = root_to_component[connectivity.components[frame_idx]];
+    if (component == -1) {
+      component = connected_components.size();
+      connected_components.emplace_back();
+    }
+    connected_components[component].push_back(
+        connectivity.frame_ids[frame_idx]);
+  }
+
+  return connected_components.size();
+}
+
+void ViewGraph::UpdateConnectivity(
+    const std::unordered_map<image_t, Image>& images) {
+  // The structure is only updated if the pairs are the same, in the same
+  // order, between the same frames, and none of them became valid again,
+  // which could merge components. The frames change when the same view graph
+  // is used with other frames, e.g. the trivial frames of rotation averaging.
+  bool rebuild = connectivity.pair_ids.size() != image_pairs.size();
+  std::vector<int> invalidated_pairs;
+  if (!rebuild) {
+    int pair_idx = 0;
+    for (const auto& [pair_id, image_pair] : image_pairs) {
+      const int frame_idx1 = connectivity.pair_frames[2 * pair_idx];
+      const int frame_idx2 = connectivity.pair_frames[2 * pair_idx + 1];
+      if (connectivity.pair_ids[pair_idx] != pair_id ||
+          connectivity.frame_ids[frame_idx1] !=
+              images.at(image_pair.image_id1).frame_id ||
+          connectivity.frame_ids[frame_idx2] !=
+              images.at(image_pair.image_id2).frame_id ||
+          (image_pair.is_valid && !connectivity.pair_valid[pair_idx])) {
+        rebuild = true;
+        break;
+      }
+      if (!image_pair.is_valid && connectivity.pair_valid[pair_idx]) {
+        invalidated_pairs.push_back(pair_idx);
+      }
+      pair_idx++;
+    }
+  }
+  if (rebuild) {
+    BuildConnectivity(images);
+    return;
   }
+  if (invalidated_pairs.empty()) return;
 
-  for (auto& [frame_id, neighbors] : adjacency_list_frame) {
-    if (!visited[frame_id]) {
-      std::unordered_set<image_t> component;
-      BFS(frame_id, visited, component);
-      connected_components.push_back(component);
+  // Only the components that lose a pair can split. They are marked by their
+  // roots.
+  const int num_frames = connectivity.frame_ids.size();
+  std::vector<char> is_split(num_frames, 0);
+  for (const int pair_idx : invalidated_pairs) {
+    connectivity.pair_valid[pair_idx] = 0;
+    for (int k = 0; k < 2; k++) {
+      const int frame_idx = connectivity.pair_frames[2 * pair_idx + k];
+      connectivity.num_valid_pairs[frame_idx]--;
+      is_split[connectivity.components[frame_idx]] = 1;
     }
   }
 
-  return connected_components.size();
+  // Unite the frames of these components again over their valid pairs
+  std::vector<int> split_frames;
+  for (int frame_idx = 0; frame_idx < num_frames; frame_idx++) {
+    if (!is_split[connectivity.components[frame_idx]]) continue;
+    split_frames.push_back(frame_idx);
+    connectivity.union_find.ResetElement(frame_idx);
+  }
+  for (const int frame_idx : split_frames) {
+    for (int k = connectivity.frame_pair_offsets[frame_idx];
+         k < connectivity.frame_pair_offsets[frame_idx + 1];
+         k++) {
+      const int pair_idx = connectivity.frame_pairs[k];
+      if (!connectivity.pair_valid[pair_idx]) continue;
+      connectivity.union_find.Union(connectivity.pair_frames[2 * pair_idx],
+                                    connectivity.pair_frames[2 * pair_idx + 1]);
+    }
+  }
+  for (const int frame_idx : split_frames) {
+    connectivity.components[frame_idx] =
+        connectivity.union_find.Find(frame_idx);
+  }
+
+  VLOG(2) << "Updated the components of " << split_frames.size() << " / "
+          << num_frames << " frames after " << invalidated_pairs.size()
+          << " pairs were invalidated";
+}
+
+void ViewGraph::BuildConnectivity(
+    const std::unordered_map<image_t, Image>& images) {
+  connectivity = Connectivity();
+  connectivity.pair_ids.reserve(image_pairs.size());
+  connectivity.pair_frames.reserve(2 * image_pairs.size());
+  connectivity.pair_valid.reserve(image_pairs.size());
+
+  std::unordered_map<frame_t, int> frame_id_to_idx;
+  for (const auto& [pair_id, image_pair] : image_pairs) {
+    connectivity.pair_ids.push_back(pair_id);
+    connectivity.pair_valid.push_back(image_pair.is_valid);
+    for (const image_t image_id :
+         {image_pair.image_id1, image_pair.image_id2}) {
+      const frame_t frame_id = images.at(image_id).frame_id;
+      const auto [it, inserted] =
+          frame_id_to_idx.emplace(frame_id, connectivity.frame_ids.size());
+      if (inserted) connectivity.frame_ids.push_back(frame_id);
+      connectivity.pair_frames.push_back(it->second);
+    }
+  }
+
+  // Pairs incident to every frame
+  const int num_frames = connectivity.frame_ids.size();
+  const int num_pairs = connectivity.pair_ids.size();
+  std::vector<int>& offsets = connectivity.frame_pair_offsets;
+  offsets.assign(num_frames + 1, 0);
+  for (const int frame_idx : connectivity.pair_frames) {
+    offsets[frame_idx + 1]++;
+  }
+  for (int frame_idx = 0; frame_idx < num_frames; frame_idx++) {
+    offsets[frame_idx + 1] += offsets[frame_idx];
+  }
+  connectivity.frame_pairs.resize(offsets.back());
+  std::vector<int> fill_counts(num_frames, 0);
+  for (int pair_idx = 0; pair_idx < num_pairs; pair_idx++) {
+    for (int k = 0; k < 2; k++) {
+      const int frame_idx = connectivity.pair_frames[2 * pair_idx + k];
+      connectivity.frame_pairs[offsets[frame_idx] + fill_counts[frame_idx]++] =
+          pair_idx;
+    }
+  }
+
+  connectivity.num_valid_pairs.assign(num_frames, 0);
+  connectivity.union_find.Reset(num_frames);
+  for (int pair_idx = 0; pair_idx < num_pairs; pair_idx++) {
+    if (!connectivity.pair_valid[pair_idx]) continue;
+    const int frame_idx1 = connectivity.pair_frames[2 * pair_idx];
+    const int frame_idx2 = connectivity.pair_frames[2 * pair_idx + 1];
+    connectivity.num_valid_pairs[frame_idx1]++;
+    connectivity.num_valid_pairs[frame_idx2]++;
+    connectivity.union_find.Union(frame_idx1, frame_idx2);
+  }
+  connectivity.components.resize(num_frames);
+  for (int frame_idx = 0; frame_idx < num_frames; frame_idx++) {
+    connectivity.components[frame_idx] =
+        connectivity.union_find.Find(frame_idx);
+  }
 }
 
 int ViewGraph::MarkConnectedComponents(
     std::unordered_map<frame_t, Frame>& frames,
     std::unordered_map<image_t, Image>& images,
     int min_num_img) {
-  EstablishAdjacencyList();
-  EstablishAdjacencyListFrame(images);
+  UpdateConnectivity(images);
+  adjacency_list_outdated = true;
 
   int num_comp = FindConnectedComponent();
 
@@ -99,28 +232,6 @@ int ViewGraph::MarkConnectedComponents(
   return comp;
 }
 
-void ViewGraph::BFS(image_t root,
-                    std::unordered_map<image_t, bool>& visited,
-                    std::unordered_set<image_t>& component) {
-  std::queue<image_t> q;
-  q.push(root);
-  visited[root] = true;
-  component.insert(root);
-
-  while (!q.empty()) {
-    image_t curr = q.front();
-    q.pop();
-
-    for (image_t neighbor : adjacency_list_frame[curr]) {
-      if (!visited[neighbor]) {
-        q.push(neighbor);
-        visited[neighbor] = true;
-        component.insert(neighbor);
-      }
-    }
-  }
-}
-
 void ViewGraph::EstablishAdjacencyList() {
   adjacency_list.clear();
   for (auto& [pair_id, image_pair] : image_pairs) {
@@ -143,4 +254,40 @@ void ViewGraph::EstablishAdjacencyListFrame(
     }
   }
 }
+
+const std::unordered_map<image_t, std::unordered_set<image_t>>&
+ViewGraph::GetAdjacencyList() const {
+  if (adjacency_list_outdated) EstablishOutdatedAdjacencyLists();
+  return adjacency_list;
+}
+
+const std::unordered_map<frame_t, std::unordered_set<frame_t>>&
+ViewGraph::GetAdjacencyListFrame() const {
+  if (adjacency_list_outdated) EstablishOutdatedAdjacencyLists();
+  return adjacency_list_frame;
+}
+
+void ViewGraph::EstablishOutdatedAdjacencyLists() const {
+  // The pairs that were valid when the connected components were computed
+  adjacency_list.clear();
+  adjacency_list_frame.clear();
+  for (size_t pair_idx = 0; pair_idx < connectivity.pair_ids.size();
+       pair_idx++) {
+    if (!connectivity.pair_valid[pair_idx]) continue;
+    const auto it = image_pairs.find(connectivity.pair_ids[pair_idx]);
+    if (it == image_pairs.end()) continue;
+    const ImagePair& image_pair = it->second;
+    adjacency_list[image_pair.image_id1].insert(image_pair.image_id2);
+    adjacency_list[image_pair.image_id2].insert(image_pair.image_id1);
+
+    const frame_t frame_id1 =
+        connectivity.frame_ids[connectivity.pair_frames[2 * pair_idx]];
+    const frame_t frame_id2 =
+        connectivity.frame_ids[connectivity.pair_frames[2 * pair_idx + 1]];
+    adjacency_list_frame[frame_id1].insert(frame_id2);
+    adjacency_list_frame[frame_id2].insert(frame_id1);
+  }
+  adjacency_list_outdated = false;
+}
+
 }  // namespace glomap
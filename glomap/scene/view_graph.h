@@ -1,5 +1,6 @@
 #pragma once
 
+#include "glomap/math/union_find.h"
 #include "glomap/scene/camera.h"
 #include "glomap/scene/image.h"
 #include "glomap/scene/image_pair.h"
@@ -31,9 +32,11 @@ class ViewGraph {
   // Establish the frame based adjacency list
   void EstablishAdjacencyListFrame(std::unordered_map<image_t, Image>& images);
 
-  inline const std::unordered_map<image_t, std::unordered_set<image_t>>&
+  // The adjacency lists over the valid pairs. After the connected components
+  // are computed, they are established on the first access. Not thread safe.
+  const std::unordered_map<image_t, std::unordered_set<image_t>>&
   GetAdjacencyList() const;
-  inline const std::unordered_map<frame_t, std::unordered_set<frame_t>>&
+  const std::unordered_map<frame_t, std::unordered_set<frame_t>>&
   GetAdjacencyListFrame() const;
 
   // Data
@@ -42,29 +45,53 @@ class ViewGraph {
   image_t num_images = 0;
   image_pair_t num_pairs = 0;
 
+  // Whether the pairs hold their matches and inliers. A checkpoint that is
+  // read without them leaves this false, and is marked so when written again.
+  bool has_matches = true;
+
  private:
+  // Connectivity of the frames over all the pairs, in CSR form. It is built
+  // once for a set of pairs, and the components are then updated from the
+  // pairs that changed their validity since the last update.
+  struct Connectivity {
+    // Ids of the pairs in the iteration order of image_pairs, to detect that
+    // the pairs were added or removed
+    std::vector<image_pair_t> pair_ids;
+    // Indices of the two frames of every pair, frame_ids maps them back
+    std::vector<int> pair_frames;
+    std::vector<frame_t> frame_ids;
+    // Validity of every pair at the last update
+    std::vector<char> pair_valid;
+    // Pairs incident to every frame
+    std::vector<int> frame_pair_offsets;
+    std::vector<int> frame_pairs;
+    // Number of valid pairs incident to every frame
+    std::vector<int> num_valid_pairs;
+    // Component of every frame, as the root of its set
+    DenseUnionFind<int> union_find;
+    std::vector<int> components;
+  };
+
+  // Build the connectivity, or update it from the validity of the pairs
+  void UpdateConnectivity(const std::unordered_map<image_t, Image>& images);
+  void BuildConnectivity(const std::unordered_map<image_t, Image>& images);
+
   int FindConnectedComponent();
 
-  void BFS(image_t root,
-           std::unordered_map<image_t, bool>& visited,
-           std::unordered_set<image_t>& component);
+  void EstablishOutdatedAdjacencyLists() const;
 
   // Data for processing
-  std::unordered_map<image_t, std::unordered_set<image_t>> adjacency_list;
-  std::unordered_map<frame_t, std::unordered_set<frame_t>> adjacency_list_frame;
-  std::vector<std::unordered_set<image_t>> connected_components;
+  Connectivity connectivity;
+  // Whether the adjacency lists are established on the next access
+  mutable bool adjacency_list_outdated = false;
+  mutable std::unordered_map<image_t, std::unordered_set<image_t>>
+      adjacency_list;
+  mutable std::unordered_map<frame_t, std::unordered_set<frame_t>>
+      adjacency_list_frame;
+  // Frame ids of the components over the valid pairs
+  std::vector<std::vector<frame_t>> connected_components;
 };
 
-const std::unordered_map<image_t, std::unordered_set<image_t>>&
-ViewGraph::GetAdjacencyList() const {
-  return adjacency_list;
-}
-
-const std::unordered_map<frame_t, std::unordered_set<frame_t>>&
-ViewGraph::GetAdjacencyListFrame() const {
-  return adjacency_list_frame;
-}
-
 void ViewGraph::RemoveInvalidPair(image_pair_t pair_id) {
   ImagePair& pair = image_pairs.at(pair_id);
   pair.is_valid = false;